@@ -53,12 +53,18 @@
  *        is not set. To completely invalidate the TLB, load it with
  *        translations for addresses in one of the unmapped address
  *        ranges - these will never be matched.
+ *
+ *   tlb_setentryhi: load ENTRYHI into the entryhi register. The PID
+ *        field of entryhi is the address space ID that user accesses
+ *        are matched against; all of the functions above overwrite it,
+ *        so it must be put back after using them.
  */
 
 void tlb_random(uint32_t entryhi, uint32_t entrylo);
 void tlb_write(uint32_t entryhi, uint32_t entrylo, uint32_t index);
 void tlb_read(uint32_t *entryhi, uint32_t *entrylo, uint32_t index);
 int tlb_probe(uint32_t entryhi, uint32_t entrylo);
+void tlb_setentryhi(uint32_t entryhi);
 
 /*
  * TLB entry fields.
@@ -78,7 +84,11 @@ int tlb_probe(uint32_t entryhi, uint32_t entrylo);
 
 /* Fields in the high-order word */
 #define TLBHI_VPAGE   0xfffff000
-/*      TLBHI_PID     0x00000fc0 */
+#define TLBHI_PID     0x00000fc0
+#define TLBHI_PIDSHIFT 6
+
+/* Number of distinct address space IDs */
+#define NUM_TLBPID    64
 
 /* Fields in the low-order word */
 #define TLBLO_PPAGE   0xfffff000
@@ -66,6 +66,7 @@
  * a valid address, and will make a *huge* mess if you scribble on it.
  */
 #define PADDR_TO_KVADDR(paddr) ((paddr)+MIPS_KSEG0)
+#define KVADDR_TO_PADDR(vaddr) ((vaddr)-MIPS_KSEG0)
 
 /*
  * The top of user space. (Actually, the address immediately above the
@@ -108,12 +109,17 @@ void ram_getsize(paddr_t *lo, paddr_t *hi);
  * We'll take up to 16 invalidations before just flushing the whole TLB.
  */
 
+struct semaphore;
+
 struct tlbshootdown {
 	/*
 	 * Change this to what you need for your VM design.
 	 */
 	struct addrspace *ts_addrspace;
-	vaddr_t ts_vaddr;
+	uint32_t ts_asid;		/* ASID the mappings are tagged with */
+	const vaddr_t *ts_vaddrs;	/* pages to drop, owned by the sender */
+	unsigned ts_npages;
+	struct semaphore *ts_done;	/* V'd once the mappings are gone */
 };
 
 #define TLBSHOOTDOWN_MAX 16
@@ -36,6 +36,7 @@
 #include <current.h>
 #include <syscall.h>
 #include "opt-A2.h"
+#include "opt-A3.h"
 
 
 /*
@@ -139,6 +140,52 @@ syscall(struct trapframe *tf)
 		break;
 #endif
 
+#if OPT_A3
+	case SYS_read:
+		err = sys_read((int)tf->tf_a0, (userptr_t)tf->tf_a1,
+			       (int)tf->tf_a2, &retval);
+		break;
+	case SYS_open:
+		err = sys_open((userptr_t)tf->tf_a0, (int)tf->tf_a1, &retval);
+		break;
+	case SYS_close:
+		err = sys_close((int)tf->tf_a0);
+		break;
+	case SYS_fsync:
+		err = sys_fsync((int)tf->tf_a0);
+		break;
+	case SYS_sbrk:
+		err = sys_sbrk((intptr_t)tf->tf_a0, (vaddr_t *)&retval);
+		break;
+	case SYS_mmap:
+		/* fd and the 64-bit offset are on the user stack */
+		err = sys_mmap((userptr_t)tf->tf_a0, (size_t)tf->tf_a1,
+			       (int)tf->tf_a2, (int)tf->tf_a3,
+			       (userptr_t)(tf->tf_sp + 16), (vaddr_t *)&retval);
+		break;
+	case SYS_munmap:
+		err = sys_munmap((userptr_t)tf->tf_a0, (size_t)tf->tf_a1);
+		break;
+	case SYS_getrusage:
+		err = sys_getrusage((int)tf->tf_a0, (userptr_t)tf->tf_a1);
+		break;
+	case SYS_getrlimit:
+		err = sys_getrlimit((int)tf->tf_a0, (userptr_t)tf->tf_a1);
+		break;
+	case SYS_setrlimit:
+		err = sys_setrlimit((int)tf->tf_a0,
+				    (const_userptr_t)tf->tf_a1);
+		break;
+	case SYS_madvise:
+		err = sys_madvise((userptr_t)tf->tf_a0, (size_t)tf->tf_a1,
+				  (int)tf->tf_a2);
+		break;
+	case SYS_mincore:
+		err = sys_mincore((userptr_t)tf->tf_a0, (size_t)tf->tf_a1,
+				  (userptr_t)tf->tf_a2);
+		break;
+#endif
+
 	default:
 	  kprintf("Unknown syscall %d\n", callno);
 	  err = ENOSYS;
@@ -234,3 +234,28 @@ cpu_halt(void)
 		wait();
         }
 }
+
+#if OPT_A3
+////////////////////////////////////////////////////////////
+
+/*
+ * Cycle counter.
+ *
+ * Coprocessor 0 register 9, count, goes up by one every cycle. It is
+ * also what the timer interrupt is driven from; see mips_timer_set.
+ */
+uint32_t
+cpu_cycles(void)
+{
+	uint32_t count;
+
+	/* $9 == c0_count */
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 registers */
+		"mfc0 %0, $9;"		/* do it */
+		".set pop"		/* restore assembler mode */
+		: "=r" (count));
+	return count;
+}
+#endif
@@ -37,6 +37,24 @@
 #include <mips/tlb.h>
 #include <addrspace.h>
 #include <vm.h>
+#include "opt-A3.h"
+
+#if OPT_A3
+#include <uio.h>
+#include <vnode.h>
+#include <synch.h>
+#include <coremap.h>
+#include <pagetable.h>
+#include <swap.h>
+#include <pagecache.h>
+#include <pagemerge.h>
+#include <kern/mman.h>
+#include <kern/time.h>
+#include <kern/resource.h>
+#include <cpu.h>
+#include <vmtune.h>
+#include <uw-vmstats.h>
+#endif
 
 /*
  * Dumb MIPS-only "VM system" that is intended to only be just barely
@@ -46,15 +64,93 @@
 /* under dumbvm, always have 48k of user stack */
 #define DUMBVM_STACKPAGES    12
 
+#if OPT_A3
+/* pages the user stack starts with; it grows on demand up to as_stackmax */
+#define DUMBVM_STACKINIT     1
+#endif
+
 /*
  * Wrap rma_stealmem in a spinlock.
  */
 static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
 
+#if OPT_A3
+/*
+ * TLB address space IDs. ASIDs are handed out in order within a
+ * generation; when they run out, a new generation starts and every CPU
+ * flushes its TLB the next time it activates an address space, so an
+ * ASID is never live in a TLB for two address spaces at once. ASID 0 is
+ * never handed out; it tags the invalid entries.
+ */
+static struct spinlock asid_lock = SPINLOCK_INITIALIZER;
+static uint32_t asid_generation = 1;
+static uint32_t asid_next = 1;
+
+/*
+ * Remote TLB invalidations are sent one batch at a time, and the sender
+ * waits on shootdown_sem for every CPU it sent to. Holding a sleep lock
+ * rather than a spinlock across the round trip lets the sender sleep,
+ * and keeps each CPU's queue to at most one shootdown.
+ */
+static struct lock *shootdown_lock;
+static struct semaphore *shootdown_sem;
+
+/*
+ * Every address space, so that the page cache can find who maps a file
+ * page it wants to give up (see vm_unmapcached). Regions are only linked
+ * and unlinked under as_lock, so holding that is enough to walk them.
+ */
+static struct addrspace *as_all;
+static struct lock *as_alllock;
+
+/*
+ * Pages of one address space whose TLB entries are to be dropped on every
+ * CPU, with the frames to free once they are. A full batch is flushed
+ * and started over, so it goes out in one IPI per CPU at most every
+ * TLBBATCH_MAX pages.
+ */
+#define TLBBATCH_MAX 32
+
+struct tlbbatch {
+	struct addrspace *tb_as;
+	unsigned tb_npages;
+	vaddr_t tb_vaddrs[TLBBATCH_MAX];
+	paddr_t tb_frames[TLBBATCH_MAX];	/* 0 if nothing to free */
+};
+
+/*
+ * Frames kept free for kernel allocations, which never page anything
+ * out. User page allocations evict pages rather than dip below this.
+ */
+#define DUMBVM_RESERVEPAGES 8
+#endif
+
 void
 vm_bootstrap(void)
 {
-	/* Do nothing. */
+#if OPT_A3
+	int result;
+
+	coremap_bootstrap();
+	vmstats_init();
+	pagecache_bootstrap();
+
+	shootdown_lock = lock_create("shootdown");
+	shootdown_sem = sem_create("shootdown", 0);
+	as_alllock = lock_create("as_all");
+	if (shootdown_lock == NULL || shootdown_sem == NULL ||
+	    as_alllock == NULL) {
+		panic("vm_bootstrap: Out of memory\n");
+	}
+
+	result = swap_bootstrap();
+	if (result) {
+		kprintf("dumbvm: no swap on %s (%s), dirty pages stay in RAM\n",
+			SWAP_DEVICE, strerror(result));
+	}
+
+	pagemerge_bootstrap();
+#endif
 }
 
 static
@@ -63,6 +159,13 @@ getppages(unsigned long npages)
 {
 	paddr_t addr;
 
+#if OPT_A3
+	/* Once the coremap is up, ram_stealmem can no longer be used */
+	if (coremap_isready()) {
+		return coremap_alloc(npages, NULL, 0);
+	}
+#endif
+
 	spinlock_acquire(&stealmem_lock);
 
 	addr = ram_stealmem(npages);
@@ -86,28 +189,1240 @@ alloc_kpages(int npages)
 void 
 free_kpages(vaddr_t addr)
 {
+#if OPT_A3
+	coremap_free(KVADDR_TO_PADDR(addr));
+#else
 	/* nothing - leak the memory. */
 
 	(void)addr;
+#endif
+}
+
+#if OPT_A3
+/*
+ * Invalidate every entry in this CPU's TLB. Interrupts must be off, and
+ * the caller must restore entryhi.
+ */
+static
+void
+vm_tlbflush(void)
+{
+	int i;
+
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	vmstats_inc(VMSTAT_TLB_INVALIDATE);
+}
+
+/*
+ * Invalidate this CPU's entry, if any, for VADDR tagged with ASID.
+ * Returns whether there was one.
+ */
+static
+bool
+vm_tlbinval_local(vaddr_t vaddr, uint32_t asid)
+{
+	int i, spl;
+
+	spl = splhigh();
+	i = tlb_probe(vaddr | (asid << TLBHI_PIDSHIFT), 0);
+	if (i >= 0) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	tlb_setentryhi(curcpu->c_lastasid << TLBHI_PIDSHIFT);
+	splx(spl);
+	return i >= 0;
+}
+#endif
+
+void
+vm_tlbshootdown_all(void)
+{
+#if OPT_A3
+	int spl;
+
+	/*
+	 * Only one shootdown is in flight at a time, so the per-CPU queue
+	 * never overflows into this and there is nobody to acknowledge.
+	 */
+	spl = splhigh();
+	vm_tlbflush();
+	tlb_setentryhi(curcpu->c_lastasid << TLBHI_PIDSHIFT);
+	splx(spl);
+#else
+	panic("dumbvm tried to do tlb shootdown?!\n");
+#endif
+}
+
+void
+vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+#if OPT_A3
+	unsigned i;
+
+	for (i=0; i<ts->ts_npages; i++) {
+		if (vm_tlbinval_local(ts->ts_vaddrs[i], ts->ts_asid)) {
+			vmstats_inc(VMSTAT_TLB_SHOOTDOWN_INVAL);
+		}
+	}
+	V(ts->ts_done);
+#else
+	(void)ts;
+	panic("dumbvm tried to do tlb shootdown?!\n");
+#endif
+}
+
+#if OPT_A3
+/*
+ * Region helpers.
+ */
+
+static
+struct region *
+region_create(vaddr_t vbase, size_t npages, uint32_t perms)
+{
+	struct region *rg;
+
+	/* Only the heap may be empty */
+	KASSERT((vbase & PAGE_FRAME) == vbase);
+
+	rg = kmalloc(sizeof(struct region));
+	if (rg == NULL) {
+		return NULL;
+	}
+	rg->rg_vbase = vbase;
+	rg->rg_npages = npages;
+	rg->rg_perms = perms;
+	rg->rg_vnode = NULL;
+	rg->rg_offset = 0;
+	rg->rg_filevaddr = 0;
+	rg->rg_filesize = 0;
+	rg->rg_mmap = false;
+	rg->rg_shared = false;
+	rg->rg_advice = MADV_NORMAL;
+	rg->rg_next = NULL;
+	return rg;
+}
+
+static
+void
+region_destroy(struct region *rg)
+{
+	if (rg->rg_vnode != NULL) {
+		VOP_DECREF(rg->rg_vnode);
+	}
+	kfree(rg);
+}
+
+static
+bool
+region_contains(struct region *rg, vaddr_t vaddr)
+{
+	return vaddr >= rg->rg_vbase &&
+		vaddr < rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+}
+
+/*
+ * Add RG at the end of AS's region list.
+ */
+static
+void
+as_addregion(struct addrspace *as, struct region *rg)
+{
+	struct region **rgp;
+
+	lock_acquire(as->as_lock);
+	for (rgp = &as->as_regions; *rgp != NULL; rgp = &(*rgp)->rg_next) {
+		/* nothing */
+	}
+	*rgp = rg;
+	lock_release(as->as_lock);
+}
+
+/*
+ * Find the region of AS containing VADDR. Returns NULL if there is none.
+ */
+static
+struct region *
+as_findregion(struct addrspace *as, vaddr_t vaddr)
+{
+	struct region *rg;
+
+	for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+		if (region_contains(rg, vaddr)) {
+			return rg;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Permissions for page VADDR of AS. Segments need not be page aligned,
+ * so a page may be covered by more than one region; it gets the union
+ * of their permissions.
+ */
+static
+uint32_t
+as_pageperms(struct addrspace *as, vaddr_t vaddr)
+{
+	struct region *rg;
+	uint32_t perms = 0;
+
+	for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+		if (region_contains(rg, vaddr)) {
+			perms |= rg->rg_perms;
+		}
+	}
+	return perms;
+}
+
+/*
+ * Grow the stack of AS down to cover VADDR, which is in no region. Fails
+ * with EFAULT if that would take the stack past its limit or to within
+ * vm_stackguard pages of another region. The caller holds as_lock.
+ */
+static
+int
+as_growstack(struct addrspace *as, vaddr_t vaddr)
+{
+	struct region *rg, *stack = as->as_stack;
+	vaddr_t newbase, guard;
+
+	KASSERT(lock_do_i_hold(as->as_lock));
+	KASSERT((vaddr & PAGE_FRAME) == vaddr);
+
+	if (stack == NULL || vaddr >= stack->rg_vbase ||
+	    vaddr < USERSTACK - as->as_stackmax * PAGE_SIZE) {
+		return EFAULT;
+	}
+	newbase = vaddr;
+
+	guard = (vaddr_t)vm_stackguard * PAGE_SIZE;
+	for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+		if (rg == stack || rg->rg_vbase >= stack->rg_vbase) {
+			continue;
+		}
+		if (rg->rg_vbase + rg->rg_npages * PAGE_SIZE + guard > newbase) {
+			return EFAULT;
+		}
+	}
+
+	stack->rg_npages += (stack->rg_vbase - newbase) / PAGE_SIZE;
+	stack->rg_vbase = newbase;
+	return 0;
+}
+
+/*
+ * Fill the zeroed frame PADDR with the initial contents of page VADDR of
+ * AS: every part of the page that overlaps some region's file data is
+ * read from that file, and the rest is left zero. Says through KIND
+ * whether that took the disk.
+ */
+static
+int
+vm_fillpage(struct addrspace *as, vaddr_t vaddr, paddr_t paddr,
+	    unsigned *kind)
+{
+	struct iovec iov;
+	struct uio u;
+	struct region *rg;
+	vaddr_t kvaddr, start, end;
+	bool fromfile = false;
+	int result;
+
+	kvaddr = PADDR_TO_KVADDR(paddr);
+
+	for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+		if (rg->rg_vnode == NULL) {
+			continue;
+		}
+		start = vaddr;
+		end = vaddr + PAGE_SIZE;
+		if (start < rg->rg_filevaddr) {
+			start = rg->rg_filevaddr;
+		}
+		if (end > rg->rg_filevaddr + rg->rg_filesize) {
+			end = rg->rg_filevaddr + rg->rg_filesize;
+		}
+		if (start >= end) {
+			/* Nothing from this file on this page */
+			continue;
+		}
+
+		uio_kinit(&iov, &u, (void *)(kvaddr + (start - vaddr)),
+			  end - start,
+			  rg->rg_offset + (start - rg->rg_filevaddr), UIO_READ);
+		result = VOP_READ(rg->rg_vnode, &u);
+		if (result) {
+			return result;
+		}
+		if (u.uio_resid != 0) {
+			/* short read; the file changed under us? */
+			kprintf("dumbvm: short read on page 0x%x\n", vaddr);
+			return EIO;
+		}
+		fromfile = true;
+	}
+
+	if (fromfile) {
+		vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+		vmstats_inc(VMSTAT_ELF_FILE_READ);
+		*kind = VMHIST_DISK;
+	}
+	else {
+		/* bss, heap or stack */
+		vmstats_inc(VMSTAT_PAGE_FAULT_ZERO);
+		*kind = VMHIST_ZERO;
+	}
+	return 0;
+}
+
+/*
+ * Make a copy of region OLD. The pages themselves are shared through the
+ * page table, not here.
+ */
+static
+struct region *
+region_copy(struct region *old)
+{
+	struct region *new;
+
+	new = region_create(old->rg_vbase, old->rg_npages, old->rg_perms);
+	if (new == NULL) {
+		return NULL;
+	}
+	if (old->rg_vnode != NULL) {
+		VOP_INCREF(old->rg_vnode);
+		new->rg_vnode = old->rg_vnode;
+	}
+	new->rg_offset = old->rg_offset;
+	new->rg_filevaddr = old->rg_filevaddr;
+	new->rg_filesize = old->rg_filesize;
+	new->rg_mmap = old->rg_mmap;
+	new->rg_shared = old->rg_shared;
+	new->rg_advice = old->rg_advice;
+	return new;
+}
+
+static
+void
+vm_tlbbatch_init(struct tlbbatch *tb, struct addrspace *as)
+{
+	tb->tb_as = as;
+	tb->tb_npages = 0;
+}
+
+/*
+ * Drop every TLB entry in batch TB, on this CPU and on every other CPU
+ * that has run the address space, waiting until they all have; then free
+ * the batch's frames and empty it.
+ */
+static
+void
+vm_tlbbatch_flush(struct tlbbatch *tb)
+{
+	struct tlbshootdown ts;
+	uint32_t others;
+	unsigned i, n;
+	int spl;
+
+	if (tb->tb_npages == 0) {
+		return;
+	}
+
+	ts.ts_addrspace = tb->tb_as;
+	ts.ts_asid = tb->tb_as->as_asid;
+	ts.ts_vaddrs = tb->tb_vaddrs;
+	ts.ts_npages = tb->tb_npages;
+	ts.ts_done = shootdown_sem;
+
+	/*
+	 * Stay on one CPU from dropping our own entries until the IPIs are
+	 * out, so that "the others" means the same CPUs throughout.
+	 */
+	lock_acquire(shootdown_lock);
+	spl = splhigh();
+	for (i=0; i<tb->tb_npages; i++) {
+		vm_tlbinval_local(tb->tb_vaddrs[i], tb->tb_as->as_asid);
+	}
+	others = tb->tb_as->as_cpus & ~((uint32_t)1 << curcpu->c_number);
+	n = 0;
+	if (others != 0) {
+		n = ipi_tlbshootdown_mask(others, &ts);
+	}
+	splx(spl);
+
+	for (i=0; i<n; i++) {
+		vmstats_inc(VMSTAT_TLB_SHOOTDOWN);
+		P(shootdown_sem);
+	}
+	lock_release(shootdown_lock);
+
+	for (i=0; i<tb->tb_npages; i++) {
+		if (tb->tb_frames[i] != 0) {
+			coremap_free(tb->tb_frames[i]);
+		}
+	}
+	tb->tb_npages = 0;
+}
+
+/*
+ * Add page VADDR to batch TB, and frame PADDR (if not 0) to be freed
+ * once the page is out of every TLB.
+ */
+static
+void
+vm_tlbbatch_add(struct tlbbatch *tb, vaddr_t vaddr, paddr_t paddr)
+{
+	if (tb->tb_npages == TLBBATCH_MAX) {
+		vm_tlbbatch_flush(tb);
+	}
+	tb->tb_vaddrs[tb->tb_npages] = vaddr;
+	tb->tb_frames[tb->tb_npages] = paddr;
+	tb->tb_npages++;
+}
+
+/*
+ * Invalidate the TLB entry for page VADDR of AS on every CPU that may
+ * have it, waiting until they all have.
+ */
+void
+vm_tlbinvalidate(struct addrspace *as, vaddr_t vaddr)
+{
+	struct tlbbatch tb;
+
+	vm_tlbbatch_init(&tb, as);
+	vm_tlbbatch_add(&tb, vaddr, 0);
+	vm_tlbbatch_flush(&tb);
+}
+
+/*
+ * Page out page VADDR of AS, whose entry is PTE, and free its frame,
+ * which nothing else maps. Dirty pages are written to swap; clean ones
+ * are simply dropped and filled again from the executable or with zeros
+ * on the next fault. The caller holds as_lock.
+ */
+static
+int
+vm_pageout(struct addrspace *as, vaddr_t vaddr, pte_t *pte)
+{
+	paddr_t paddr;
+	unsigned slot;
+	int result;
+
+	KASSERT(lock_do_i_hold(as->as_lock));
+	KASSERT(*pte & PTE_VALID);
+	paddr = *pte & PTE_FRAME;
+
+	/* Nobody may write the page through the TLB while we copy it */
+	vm_tlbinvalidate(as, vaddr);
+
+	if (*pte & PTE_DIRTY) {
+		result = swap_alloc(&slot);
+		if (!result) {
+			result = swap_write(slot, paddr);
+			if (result) {
+				swap_free(slot);
+			}
+		}
+		if (result) {
+			return result;
+		}
+		*pte = PTE_FROMSLOT(slot) | PTE_SWAPPED;
+	}
+	else {
+		*pte = 0;
+	}
+	as->as_rss--;
+
+	coremap_free(paddr);
+	return 0;
+}
+
+/*
+ * Page out one user page chosen by the coremap's clock and free its
+ * frame.
+ */
+static
+int
+vm_evictpage(void)
+{
+	struct addrspace *vas;
+	vaddr_t vaddr;
+	paddr_t paddr;
+	pte_t *pte;
+	bool locked;
+	int result;
+
+	/* File pages nobody has mapped are the cheapest to give up */
+	if (pagecache_reclaim() == 0) {
+		return 0;
+	}
+	/* So are merged pages everybody has written to since */
+	if (pagemerge_reclaim() == 0) {
+		return 0;
+	}
+	/* Then file pages, which can be read back in without swap */
+	if (pagecache_reclaimmapped() == 0) {
+		return 0;
+	}
+
+	paddr = coremap_pickvictim(&vas, &vaddr, &locked);
+	if (paddr == 0) {
+		return ENOMEM;
+	}
+
+	pte = pt_lookup(vas->as_pt, vaddr, false);
+	KASSERT(pte != NULL && (*pte & PTE_FRAME) == paddr);
+
+	result = vm_pageout(vas, vaddr, pte);
+	if (result) {
+		coremap_unbusy(paddr);
+	}
+	if (locked) {
+		lock_release(vas->as_lock);
+	}
+	return result;
+}
+
+/*
+ * Drop page VADDR of AS, wherever it is, so that it is zero-filled if it
+ * is ever touched again. A resident page's frame is freed when batch TB
+ * is flushed. The caller holds as_lock.
+ */
+static
+void
+as_freepage(struct addrspace *as, vaddr_t vaddr, struct tlbbatch *tb)
+{
+	pte_t *pte;
+
+	KASSERT(lock_do_i_hold(as->as_lock));
+
+	pte = pt_lookup(as->as_pt, vaddr, false);
+	if (pte == NULL) {
+		return;
+	}
+	if (*pte & PTE_VALID) {
+		vm_tlbbatch_add(tb, vaddr, *pte & PTE_FRAME);
+		as->as_rss--;
+	}
+	else if (*pte & PTE_SWAPPED) {
+		swap_free(PTE_SWAPSLOT(*pte));
+	}
+	*pte = 0;
+}
+
+/*
+ * Drop page VADDR of region RG of AS like as_freepage, but if it was
+ * written through a shared mapping mark it dirty in the page cache first.
+ * The caller holds as_lock.
+ */
+static
+void
+as_droppage(struct addrspace *as, struct region *rg, vaddr_t vaddr,
+	    struct tlbbatch *tb)
+{
+	pte_t *pte;
+
+	pte = pt_lookup(as->as_pt, vaddr, false);
+	if (pte == NULL) {
+		return;
+	}
+	if (rg->rg_shared && (*pte & PTE_VALID) && (*pte & PTE_DIRTY)) {
+		pagecache_markdirty(rg->rg_vnode,
+			rg->rg_offset + (vaddr - rg->rg_vbase));
+	}
+	as_freepage(as, vaddr, tb);
+}
+
+/*
+ * Drop every page of region RG of AS.
+ */
+static
+void
+as_unmapregion(struct addrspace *as, struct region *rg)
+{
+	struct tlbbatch tb;
+	vaddr_t vaddr;
+
+	vm_tlbbatch_init(&tb, as);
+	lock_acquire(as->as_lock);
+	for (vaddr = rg->rg_vbase;
+	     vaddr < rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+	     vaddr += PAGE_SIZE) {
+		as_droppage(as, rg, vaddr, &tb);
+	}
+	vm_tlbbatch_flush(&tb);
+	lock_release(as->as_lock);
+}
+
+/*
+ * Get a frame for page VADDR of AS, zero-filled if ZERO, paging something
+ * out first if that would leave too few free frames for the kernel.
+ */
+static
+paddr_t
+vm_getuserpage(struct addrspace *as, vaddr_t vaddr, bool zero)
+{
+	unsigned nfree, ntotal;
+
+	coremap_getstats(&nfree, &ntotal);
+	while (nfree <= DUMBVM_RESERVEPAGES) {
+		if (vm_evictpage()) {
+			/* Nothing we can page out; use the reserve */
+			break;
+		}
+		coremap_getstats(&nfree, &ntotal);
+	}
+	if (zero) {
+		return coremap_alloczero(as, vaddr);
+	}
+	return coremap_alloc(1, as, vaddr);
+}
+
+/*
+ * The page after VADDR in AS's regions, in address order, wrapping around
+ * to the lowest; 0 if AS has no pages at all.
+ */
+static
+vaddr_t
+as_nextpage(struct addrspace *as, vaddr_t vaddr)
+{
+	struct region *rg;
+	vaddr_t next = 0, lowest = 0;
+
+	if (as_findregion(as, vaddr + PAGE_SIZE) != NULL) {
+		return vaddr + PAGE_SIZE;
+	}
+	for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+		if (rg->rg_npages == 0) {
+			continue;
+		}
+		if (rg->rg_vbase > vaddr && (next == 0 || rg->rg_vbase < next)) {
+			next = rg->rg_vbase;
+		}
+		if (lowest == 0 || rg->rg_vbase < lowest) {
+			lowest = rg->rg_vbase;
+		}
+	}
+	return (next != 0) ? next : lowest;
+}
+
+/*
+ * Page out one of AS's own pages, for a process at its resident-set
+ * limit. A clock hand goes round AS's pages the way the coremap's goes
+ * round memory, passing over shared frames and giving pages with PTE_REF
+ * set a second chance: the bit is cleared and the TLB entry dropped, so
+ * the next touch faults and sets it again. The caller holds as_lock.
+ */
+static
+int
+as_reclaimpage(struct addrspace *as)
+{
+	struct tlbbatch tb;
+	struct region *rg;
+	vaddr_t vaddr;
+	pte_t *pte;
+	unsigned n, npages = 0;
+	int result = ENOMEM;
+
+	KASSERT(lock_do_i_hold(as->as_lock));
+
+	for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+		npages += rg->rg_npages;
+	}
+
+	/* Two sweeps: the first may only be clearing reference bits */
+	vm_tlbbatch_init(&tb, as);
+	for (n = 0; n < 2 * npages; n++) {
+		vaddr = as_nextpage(as, as->as_rsshand);
+		as->as_rsshand = vaddr;
+
+		pte = pt_lookup(as->as_pt, vaddr, false);
+		if (pte == NULL || !(*pte & PTE_VALID) ||
+		    coremap_refcount(*pte & PTE_FRAME) != 1) {
+			continue;
+		}
+		if (*pte & PTE_REF) {
+			*pte &= ~PTE_REF;
+			vm_tlbbatch_add(&tb, vaddr, 0);
+			continue;
+		}
+		/* A dirty page with no swap to go to; try a clean one */
+		if (vm_pageout(as, vaddr, pte) == 0) {
+			vmstats_inc(VMSTAT_RSS_RECLAIM);
+			result = 0;
+			break;
+		}
+	}
+	vm_tlbbatch_flush(&tb);
+	return result;
+}
+
+/*
+ * Drop AS's ASID, which invalidates all of its TLB entries on every CPU
+ * at once: they can no longer match, and the ASID is not reused before
+ * the next generation flushes them. AS gets a fresh ASID the next time
+ * it is activated.
+ */
+static
+void
+as_retireasid(struct addrspace *as)
+{
+	spinlock_acquire(&asid_lock);
+	as->as_asidgen = 0;
+	as->as_cpus = 0;
+	spinlock_release(&asid_lock);
+}
+
+/*
+ * A mapping of AS, the current address space, has changed in a way that
+ * stale TLB entries must not survive. The caller rewrites the entry on
+ * this CPU; if AS has run anywhere else since it got its ASID, retire
+ * the ASID so the other CPUs' copies die too.
+ */
+static
+void
+as_invalremote(struct addrspace *as)
+{
+	KASSERT(as == curproc_getas());
+
+	if (as->as_cpus & ~((uint32_t)1 << curcpu->c_number)) {
+		as_retireasid(as);
+		as_activate();
+	}
+}
+
+/*
+ * Make the page described by PTE, which maps VADDR in AS, private so it
+ * can be written. If the frame is still shared with another address space
+ * the contents are copied into a new frame; otherwise we are the last
+ * user and simply take it over.
+ */
+static
+int
+vm_cowpage(struct addrspace *as, pte_t *pte, vaddr_t vaddr)
+{
+	paddr_t oldpa, newpa;
+
+	KASSERT(*pte & PTE_VALID);
+	oldpa = *pte & PTE_FRAME;
+
+	/* Writing a merged page splits it off again */
+	if (*pte & PTE_MERGED) {
+		*pte &= ~PTE_MERGED;
+		vmstats_inc(VMSTAT_MERGE_UNMERGED);
+	}
+
+	/*
+	 * Only this process can add references, so this can't change; the
+	 * page merger shares only frames whose owner's as_lock it holds,
+	 * or frames that already have more than one reference.
+	 */
+	if (coremap_refcount(oldpa) == 1) {
+		coremap_setowner(oldpa, as, vaddr);
+		return 0;
+	}
+
+	newpa = vm_getuserpage(as, vaddr, false);
+	if (newpa == 0) {
+		return ENOMEM;
+	}
+	memmove((void *)PADDR_TO_KVADDR(newpa),
+		(const void *)PADDR_TO_KVADDR(oldpa), PAGE_SIZE);
+	*pte = newpa | (*pte & ~PTE_FRAME);
+
+	/* Other CPUs may still map the old frame read-only */
+	as_invalremote(as);
+
+	/* Drop our reference; the last sharer gets to keep the frame */
+	coremap_free(oldpa);
+	return 0;
+}
+
+/*
+ * Get the page cache frame for the page at OFFSET in file VN, to be
+ * mapped at VADDR of AS, reading it from the file if no one has it yet.
+ * Says through KIND whether that took the disk.
+ */
+static
+int
+vm_mappage(struct addrspace *as, struct vnode *vn, off_t offset,
+	   vaddr_t vaddr, paddr_t *ret, unsigned *kind)
+{
+	paddr_t paddr, newpa;
+	int result;
+
+	paddr = pagecache_lookup(vn, offset);
+	if (paddr == 0) {
+		newpa = vm_getuserpage(as, vaddr, true);
+		if (newpa == 0) {
+			return ENOMEM;
+		}
+		result = pagecache_fill(vn, offset, newpa, &paddr);
+		if (result) {
+			coremap_free(newpa);
+			return result;
+		}
+		if (paddr == newpa) {
+			/* Read from the file; counted by the page cache */
+			*ret = paddr;
+			*kind = VMHIST_DISK;
+			return 0;
+		}
+		coremap_free(newpa);
+	}
+
+	/* Already in memory for somebody else */
+	vmstats_inc(VMSTAT_TLB_RELOAD);
+	*ret = paddr;
+	*kind = VMHIST_RELOAD;
+	return 0;
+}
+
+/*
+ * Whether page VADDR of region RG of AS can map the page cache's copy of
+ * its file page instead of a private one, and if so at what file offset.
+ * That needs a read-only page (text, mostly) that is file data from end
+ * to end and sits at a page-aligned offset in the file; the partial pages
+ * at either end of a segment still get private copies.
+ */
+static
+bool
+vm_sharedtext(struct addrspace *as, struct region *rg, vaddr_t vaddr,
+	      off_t *offset)
+{
+	if (rg->rg_vnode == NULL || rg->rg_mmap ||
+	    (as_pageperms(as, vaddr) & PTE_WRITE)) {
+		return false;
+	}
+	if (vaddr < rg->rg_filevaddr ||
+	    vaddr + PAGE_SIZE > rg->rg_filevaddr + rg->rg_filesize) {
+		return false;
+	}
+	*offset = rg->rg_offset + (vaddr - rg->rg_filevaddr);
+	return (*offset & ~(off_t)PAGE_FRAME) == 0;
+}
+
+/*
+ * Take page cache frame PADDR, which holds the page at OFFSET of file
+ * VN, out of every address space that maps it, so that the page cache
+ * can give it up. A mapping touched since the last look gets a second
+ * chance instead: its PTE_REF is cleared and its TLB entry dropped, so
+ * the next touch sets it again. Address spaces whose as_lock is busy are
+ * passed over, so afterwards only the frame's reference count says
+ * whether anybody still maps it. That includes the caller's own, which
+ * may be in the middle of using a page it maps, e.g. to copy it on
+ * write. Sets *DIRTY if a shared mapping wrote the page.
+ */
+void
+vm_unmapcached(struct vnode *vn, off_t offset, paddr_t paddr, bool *dirty)
+{
+	struct addrspace *as;
+	struct region *rg;
+	vaddr_t vaddr;
+	off_t fileoff;
+	pte_t *pte;
+
+	*dirty = false;
+	lock_acquire(as_alllock);
+	for (as = as_all; as != NULL; as = as->as_nextall) {
+		if (lock_do_i_hold(as->as_lock) ||
+		    !lock_tryacquire(as->as_lock)) {
+			continue;
+		}
+		for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+			/* Where the page would be mapped in this region */
+			if (rg->rg_vnode != vn || offset < rg->rg_offset) {
+				continue;
+			}
+			if (rg->rg_mmap) {
+				if (offset - rg->rg_offset >=
+				    (off_t)rg->rg_npages * PAGE_SIZE) {
+					continue;
+				}
+				vaddr = rg->rg_vbase + (offset - rg->rg_offset);
+			}
+			else {
+				if (offset - rg->rg_offset >=
+				    (off_t)rg->rg_filesize) {
+					continue;
+				}
+				vaddr = rg->rg_filevaddr +
+					(offset - rg->rg_offset);
+				if (!vm_sharedtext(as, rg, vaddr, &fileoff) ||
+				    fileoff != offset) {
+					continue;
+				}
+			}
+
+			/* Private copies of the page are left alone */
+			pte = pt_lookup(as->as_pt, vaddr, false);
+			if (pte == NULL || !(*pte & PTE_VALID) ||
+			    (*pte & PTE_FRAME) != paddr) {
+				continue;
+			}
+			vm_tlbinvalidate(as, vaddr);
+			if (*pte & PTE_REF) {
+				*pte &= ~PTE_REF;
+				continue;
+			}
+			if (rg->rg_shared && (*pte & PTE_DIRTY)) {
+				*dirty = true;
+			}
+			*pte = 0;
+			as->as_rss--;
+			coremap_free(paddr);
+			vmstats_inc(VMSTAT_PAGECACHE_UNMAP);
+		}
+		lock_release(as->as_lock);
+	}
+	lock_release(as_alllock);
 }
 
+/*
+ * Drop-behind for a MADV_SEQUENTIAL scan of mapped region RG of AS,
+ * which has just demand-faulted at VADDR: unmap the page before it, if
+ * that maps the page cache's frame, so the page cache can give the frame
+ * up cheaply rather than the scan pushing other pages out. Prefetching
+ * must not do this, or it would drop what it has just read in. The
+ * caller holds as_lock.
+ */
+static
+void
+as_dropbehind(struct addrspace *as, struct region *rg, vaddr_t vaddr)
+{
+	struct tlbbatch tb;
+	pte_t *pte;
+
+	KASSERT(lock_do_i_hold(as->as_lock));
+
+	if (rg->rg_advice != MADV_SEQUENTIAL ||
+	    vaddr < rg->rg_vbase + PAGE_SIZE) {
+		return;
+	}
+	vaddr -= PAGE_SIZE;
+	pte = pt_lookup(as->as_pt, vaddr, false);
+	/* A written private page is our own copy; keep it */
+	if (pte == NULL || !(*pte & PTE_VALID) ||
+	    (!rg->rg_shared && (*pte & PTE_DIRTY))) {
+		return;
+	}
+	vm_tlbbatch_init(&tb, as);
+	as_droppage(as, rg, vaddr, &tb);
+	vm_tlbbatch_flush(&tb);
+}
+
+/*
+ * Make page VADDR of AS, in region RG, resident for a fault of type
+ * FAULTTYPE, and return its frame, whether the TLB entry may be
+ * writeable, and which VMHIST_* kind of fault it was. The caller holds
+ * as_lock.
+ */
+static
+int
+vm_getpage(struct addrspace *as, struct region *rg, int faulttype,
+	   vaddr_t vaddr, paddr_t *ret, bool *writeable, unsigned *kind)
+{
+	pte_t *pte;
+	paddr_t paddr;
+	unsigned slot;
+	off_t offset;
+	bool resident, disk;
+	int result;
+
+	pte = pt_lookup(as->as_pt, vaddr, true);
+	if (pte == NULL) {
+		return ENOMEM;
+	}
+	resident = (*pte & PTE_VALID) != 0;
+
+	/*
+	 * At its RLIMIT_RSS, a process makes room among its own pages
+	 * rather than take frames from everybody else; only when it has
+	 * nothing it can give up does it go over.
+	 */
+	while (!resident && curproc->p_rsscur != RLIM_INFINITY &&
+	       as->as_rss >= curproc->p_rsscur / PAGE_SIZE) {
+		if (as_reclaimpage(as)) {
+			vmstats_inc(VMSTAT_RSS_OVERLIMIT);
+			break;
+		}
+	}
+
+	if (*pte & PTE_SWAPPED) {
+		/* Paged out dirty: read it back and give up the slot */
+		slot = PTE_SWAPSLOT(*pte);
+		paddr = vm_getuserpage(as, vaddr, false);
+		if (paddr == 0) {
+			return ENOMEM;
+		}
+		result = swap_read(slot, paddr, &disk);
+		if (result) {
+			coremap_free(paddr);
+			return result;
+		}
+		swap_free(slot);
+		*pte = paddr | as_pageperms(as, vaddr) | PTE_VALID | PTE_DIRTY;
+		if (disk) {
+			*kind = VMHIST_DISK;
+		}
+		else {
+			/* Still in memory, if compressed */
+			vmstats_inc(VMSTAT_TLB_RELOAD);
+			*kind = VMHIST_RELOAD;
+		}
+	}
+	else if (!(*pte & PTE_VALID) && rg->rg_mmap) {
+		result = vm_mappage(as, rg->rg_vnode,
+				    rg->rg_offset + (vaddr - rg->rg_vbase),
+				    vaddr, &paddr, kind);
+		if (result) {
+			return result;
+		}
+		*pte = paddr | rg->rg_perms | PTE_VALID;
+	}
+	else if (!(*pte & PTE_VALID) &&
+		 vm_sharedtext(as, rg, vaddr, &offset)) {
+		/* vm_fault has already turned away writes */
+		KASSERT(faulttype == VM_FAULT_READ);
+
+		/* Every process running this program maps the same frame */
+		result = vm_mappage(as, rg->rg_vnode, offset, vaddr, &paddr,
+				    kind);
+		if (result) {
+			return result;
+		}
+		*pte = paddr | as_pageperms(as, vaddr) | PTE_VALID;
+	}
+	else if (!(*pte & PTE_VALID)) {
+		/* First touch: get a frame and fill it from the file or zeros */
+		paddr = vm_getuserpage(as, vaddr, true);
+		if (paddr == 0) {
+			return ENOMEM;
+		}
+		result = vm_fillpage(as, vaddr, paddr, kind);
+		if (result) {
+			coremap_free(paddr);
+			return result;
+		}
+		*pte = paddr | as_pageperms(as, vaddr) | PTE_VALID;
+	}
+	else {
+		if (faulttype != VM_FAULT_READONLY) {
+			vmstats_inc(VMSTAT_TLB_RELOAD);
+		}
+		*kind = VMHIST_RELOAD;
+	}
+	if (!resident) {
+		as->as_rss++;
+	}
+	/* A sequential scan is done with a page once it is past it */
+	if (rg->rg_advice != MADV_SEQUENTIAL) {
+		*pte |= PTE_REF | PTE_TLBREF;
+	}
+
+	/*
+	 * Pages are entered without TLBLO_DIRTY until they are known to be
+	 * dirty and unshared, so the first write to a clean page or a
+	 * copy-on-write page comes back as VM_FAULT_READONLY. That keeps
+	 * PTE_DIRTY exact and gives every writer its own copy. Shared file
+	 * mappings are the exception: everybody writes the cached page.
+	 */
+	if (faulttype == VM_FAULT_READ) {
+		*writeable = (*pte & PTE_DIRTY) && (rg->rg_shared ||
+			coremap_refcount(*pte & PTE_FRAME) == 1);
+	}
+	else if (rg->rg_shared) {
+		if (!(*pte & PTE_DIRTY)) {
+			pagecache_markdirty(rg->rg_vnode,
+				rg->rg_offset + (vaddr - rg->rg_vbase));
+		}
+		*pte |= PTE_DIRTY;
+		*writeable = true;
+	}
+	else {
+		result = vm_cowpage(as, pte, vaddr);
+		if (result) {
+			return result;
+		}
+		*pte |= PTE_DIRTY;
+		*writeable = true;
+	}
+	*ret = *pte & PTE_FRAME;
+	return 0;
+}
+
+/*
+ * Pick the TLB slot for a new entry in AS: a free one if there is any,
+ * otherwise a victim chosen by vm_tlbpolicy. Round-robin simply takes
+ * the slot after the one replaced last on this CPU; not-recently-used
+ * starts there too but gives a second chance to entries whose page has
+ * PTE_TLBREF set, clearing the bit as it passes them; it has a bit of its
+ * own so as not to clear PTE_REF under the page-out clock. COUNT says
+ * whether this is a TLB miss to record in the stats. Interrupts must be
+ * off.
+ */
+static
+int
+vm_tlbslot(struct addrspace *as, bool count)
+{
+	uint32_t ehi, elo;
+	pte_t *pte;
+	int i, victim;
+
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_read(&ehi, &elo, i);
+		if (!(elo & TLBLO_VALID)) {
+			if (count) {
+				vmstats_inc(VMSTAT_TLB_FAULT_FREE);
+			}
+			return i;
+		}
+	}
+
+	if (count) {
+		vmstats_inc(VMSTAT_TLB_FAULT_REPLACE);
+	}
+
+	if (vm_tlbpolicy == TLBPOLICY_NRU) {
+		for (i=0; i<NUM_TLB; i++) {
+			victim = curcpu->c_tlbvictim;
+			curcpu->c_tlbvictim = (victim + 1) % NUM_TLB;
+
+			tlb_read(&ehi, &elo, victim);
+			if ((ehi & TLBHI_PID) >> TLBHI_PIDSHIFT != as->as_asid) {
+				/* Left over from another address space */
+				return victim;
+			}
+			pte = pt_lookup(as->as_pt, ehi & TLBHI_VPAGE, false);
+			if (pte == NULL || !(*pte & PTE_TLBREF)) {
+				return victim;
+			}
+			*pte &= ~PTE_TLBREF;
+		}
+		/* Everything was referenced; fall back to round-robin */
+	}
+
+	victim = curcpu->c_tlbvictim;
+	curcpu->c_tlbvictim = (victim + 1) % NUM_TLB;
+	return victim;
+}
+
+/*
+ * Count how many of the pages the last fault-around on AS preloaded were
+ * used, now that AS misses again at VADDR. A sweep only misses again once
+ * it has run past the entries it was given, so the preloaded pages it
+ * has gone past count as used. The hardware keeps no record of TLB hits,
+ * so this is an estimate.
+ */
+static
 void
-vm_tlbshootdown_all(void)
+vm_preload_credit(struct addrspace *as, vaddr_t vaddr)
 {
-	panic("dumbvm tried to do tlb shootdown?!\n");
+	vaddr_t top = as->as_fabase + as->as_fanpages * PAGE_SIZE;
+	unsigned used = 0;
+
+	if (as->as_fadir > 0 && vaddr > as->as_fabase) {
+		used = (vaddr - as->as_fabase) / PAGE_SIZE;
+	}
+	else if (as->as_fadir < 0 && vaddr + PAGE_SIZE < top) {
+		used = (top - (vaddr + PAGE_SIZE)) / PAGE_SIZE;
+	}
+	if (used > as->as_fanpages) {
+		used = as->as_fanpages;
+	}
+	for (; used > 0; used--) {
+		vmstats_inc(VMSTAT_FAULTAROUND_USED);
+	}
+	as->as_fanpages = 0;
+	as->as_fadir = 0;
 }
 
+/*
+ * Fault-around. If the TLB miss at VADDR in region RG of AS continues a
+ * sweep up or down through memory, also enter up to vm_faultaround of the
+ * next pages in that direction, stopping at the first one that is not
+ * resident, is already in the TLB, or is past the end of RG. Entries are
+ * made exactly as a read miss would make them. The caller holds as_lock,
+ * has interrupts off, and has not yet entered VADDR itself, so these
+ * cannot push it out.
+ */
+static
 void
-vm_tlbshootdown(const struct tlbshootdown *ts)
+vm_preload(struct addrspace *as, struct region *rg, vaddr_t vaddr)
 {
-	(void)ts;
-	panic("dumbvm tried to do tlb shootdown?!\n");
+	uint32_t ehi, elo;
+	vaddr_t next;
+	pte_t *pte;
+	int dir, n;
+
+	vm_preload_credit(as, vaddr);
+
+	/* madvise overrides guessing: random never preloads, sequential
+	 * always does, upwards unless it is seen going down */
+	if (rg->rg_advice == MADV_RANDOM) {
+		dir = 0;
+	}
+	else if (vaddr == as->as_fanext) {
+		dir = 1;
+	}
+	else if (vaddr == as->as_faprev) {
+		dir = -1;
+	}
+	else if (rg->rg_advice == MADV_SEQUENTIAL) {
+		dir = 1;
+	}
+	else {
+		dir = 0;
+	}
+
+	next = vaddr;
+	for (n = 0; dir != 0 && n < vm_faultaround; n++) {
+		next = (dir > 0) ? next + PAGE_SIZE : next - PAGE_SIZE;
+		if (!region_contains(rg, next)) {
+			break;
+		}
+		pte = pt_lookup(as->as_pt, next, false);
+		if (pte == NULL || !(*pte & PTE_VALID)) {
+			break;
+		}
+		ehi = next | (as->as_asid << TLBHI_PIDSHIFT);
+		if (tlb_probe(ehi, 0) >= 0) {
+			break;
+		}
+		elo = (*pte & PTE_FRAME) | TLBLO_VALID;
+		if ((*pte & PTE_DIRTY) && (rg->rg_shared ||
+		    coremap_refcount(*pte & PTE_FRAME) == 1)) {
+			elo |= TLBLO_DIRTY;
+		}
+		tlb_write(ehi, elo, vm_tlbslot(as, false));
+		vmstats_inc(VMSTAT_FAULTAROUND_PRELOAD);
+	}
+
+	/* Where the sweep will miss next if it keeps going */
+	as->as_fanext = vaddr + ((dir > 0 ? n : 0) + 1) * PAGE_SIZE;
+	as->as_faprev = vaddr - ((dir < 0 ? n : 0) + 1) * PAGE_SIZE;
+	as->as_fabase = (dir < 0) ? vaddr - n * PAGE_SIZE : vaddr + PAGE_SIZE;
+	as->as_fanpages = n;
+	as->as_fadir = dir;
 }
+#endif /* OPT_A3 */
 
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
+#if OPT_A3
+	struct region *rg;
+	pte_t *pte;
+	bool resident, writeable;
+	unsigned kind;
+	uint32_t start;
+	int result;
+#else
 	vaddr_t vbase1, vtop1, vbase2, vtop2, stackbase, stacktop;
+#endif
 	paddr_t paddr;
 	int i;
 	uint32_t ehi, elo;
@@ -120,8 +1435,13 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 
 	switch (faulttype) {
 	    case VM_FAULT_READONLY:
+#if OPT_A3
+		/* Write to a copy-on-write or read-only page; see below */
+		break;
+#else
 		/* We always create pages read-write, so we can't get this */
 		panic("dumbvm: got VM_FAULT_READONLY\n");
+#endif
 	    case VM_FAULT_READ:
 	    case VM_FAULT_WRITE:
 		break;
@@ -147,6 +1467,66 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		return EFAULT;
 	}
 
+#if OPT_A3
+	/* Regions only change under as_lock, so look them up under it too */
+	lock_acquire(as->as_lock);
+	rg = as_findregion(as, faultaddress);
+	if (rg == NULL) {
+		/* Below the stack: grow it if we may */
+		result = as_growstack(as, faultaddress);
+		if (result) {
+			lock_release(as->as_lock);
+			return result;
+		}
+		rg = as->as_stack;
+	}
+
+	/* Writes to text or any other read-only page kill the process */
+	if (faulttype != VM_FAULT_READ &&
+	    !(as_pageperms(as, faultaddress) & PTE_WRITE)) {
+		lock_release(as->as_lock);
+		return EFAULT;
+	}
+
+	/* A read-only fault is not a TLB miss; the entry is already there */
+	if (faulttype != VM_FAULT_READONLY) {
+		vmstats_inc(VMSTAT_TLB_FAULT);
+	}
+	start = cpu_cycles();
+
+	/*
+	 * Until we held as_lock the pager could take the page away under
+	 * the read-only entry that faulted. Then this is a write to a page
+	 * that is not there, which must be brought in and made private.
+	 */
+	pte = pt_lookup(as->as_pt, faultaddress, false);
+	resident = pte != NULL && (*pte & PTE_VALID);
+	if (faulttype == VM_FAULT_READONLY && !resident) {
+		faulttype = VM_FAULT_WRITE;
+	}
+
+	result = vm_getpage(as, rg, faulttype, faultaddress, &paddr,
+			    &writeable, &kind);
+	if (result) {
+		lock_release(as->as_lock);
+		return result;
+	}
+	/* Only a real demand fault moves a sequential scan along */
+	if (rg->rg_mmap && !resident) {
+		as_dropbehind(as, rg, faultaddress);
+	}
+
+	/* For getrusage; only this process's own thread writes these */
+	if (kind == VMHIST_DISK) {
+		curproc->p_usage.pu_majflt++;
+	}
+	else {
+		curproc->p_usage.pu_minflt++;
+	}
+	if (as->as_rss > curproc->p_usage.pu_maxrss) {
+		curproc->p_usage.pu_maxrss = as->as_rss;
+	}
+#else
 	/* Assert that the address space has been set up properly. */
 	KASSERT(as->as_vbase1 != 0);
 	KASSERT(as->as_pbase1 != 0);
@@ -180,6 +1560,7 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	else {
 		return EFAULT;
 	}
+#endif
 
 	/* make sure it's page-aligned */
 	KASSERT((paddr & PAGE_FRAME) == paddr);
@@ -187,6 +1568,39 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	/* Disable interrupts on this CPU while frobbing the TLB. */
 	spl = splhigh();
 
+#if OPT_A3
+	ehi = faultaddress | (as->as_asid << TLBHI_PIDSHIFT);
+	elo = paddr | TLBLO_VALID;
+	if (writeable) {
+		elo |= TLBLO_DIRTY;
+	}
+
+	if (faulttype != VM_FAULT_READONLY) {
+		vm_preload(as, rg, faultaddress);
+	}
+
+	/* Replace the read-only entry if there is one, never duplicate it */
+	i = tlb_probe(ehi, 0);
+	if (i < 0) {
+		i = vm_tlbslot(as, faulttype != VM_FAULT_READONLY);
+	}
+	DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
+	/* This also leaves our ASID in entryhi */
+	tlb_write(ehi, elo, i);
+	splx(spl);
+	/* Only now may the pager take the page away again */
+	lock_release(as->as_lock);
+
+	/*
+	 * If we slept on the disk we may have moved to another CPU, whose
+	 * counter is close to ours but not the same; that is noise next
+	 * to a disk read.
+	 */
+	if (faulttype != VM_FAULT_READONLY) {
+		vmstats_time(kind, cpu_cycles() - start);
+	}
+	return 0;
+#else
 	for (i=0; i<NUM_TLB; i++) {
 		tlb_read(&ehi, &elo, i);
 		if (elo & TLBLO_VALID) {
@@ -203,6 +1617,7 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	kprintf("dumbvm: Ran out of TLB entries - cannot handle page fault\n");
 	splx(spl);
 	return EFAULT;
+#endif
 }
 
 struct addrspace *
@@ -213,6 +1628,39 @@ as_create(void)
 		return NULL;
 	}
 
+#if OPT_A3
+	as->as_regions = NULL;
+	as->as_stack = NULL;
+	as->as_stackmax = 0;
+	as->as_heap = NULL;
+	as->as_heapbrk = 0;
+	as->as_rss = 0;
+	as->as_rsshand = 0;
+	as->as_pt = pt_create();
+	if (as->as_pt == NULL) {
+		kfree(as);
+		return NULL;
+	}
+	as->as_lock = lock_create("addrspace");
+	if (as->as_lock == NULL) {
+		pt_destroy(as->as_pt);
+		kfree(as);
+		return NULL;
+	}
+	as->as_asid = 0;
+	as->as_asidgen = 0;
+	as->as_cpus = 0;
+	as->as_fanext = 0;
+	as->as_faprev = 0;
+	as->as_fabase = 0;
+	as->as_fanpages = 0;
+	as->as_fadir = 0;
+
+	lock_acquire(as_alllock);
+	as->as_nextall = as_all;
+	as_all = as;
+	lock_release(as_alllock);
+#else
 	as->as_vbase1 = 0;
 	as->as_pbase1 = 0;
 	as->as_npages1 = 0;
@@ -220,6 +1668,7 @@ as_create(void)
 	as->as_pbase2 = 0;
 	as->as_npages2 = 0;
 	as->as_stackpbase = 0;
+#endif
 
 	return as;
 }
@@ -227,6 +1676,44 @@ as_create(void)
 void
 as_destroy(struct addrspace *as)
 {
+#if OPT_A3
+	struct region *rg;
+	struct addrspace **asp;
+
+	/* Nobody else may go looking at our pages from here on */
+	lock_acquire(as_alllock);
+	for (asp = &as_all; *asp != as; asp = &(*asp)->as_nextall) {
+		KASSERT(*asp != NULL);
+	}
+	*asp = as->as_nextall;
+	lock_release(as_alllock);
+
+	/* Implicitly munmap everything, recording what was written */
+	for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+		if (rg->rg_mmap) {
+			as_unmapregion(as, rg);
+			if (rg->rg_shared) {
+				/* Nobody to report a failure to */
+				(void)pagecache_flush(rg->rg_vnode);
+			}
+		}
+	}
+
+	/*
+	 * Give every page we touched back to the coremap. Holding the lock
+	 * waits out a pager that is in the middle of evicting one of them.
+	 */
+	lock_acquire(as->as_lock);
+	pt_destroy(as->as_pt);
+	lock_release(as->as_lock);
+	lock_destroy(as->as_lock);
+
+	while (as->as_regions != NULL) {
+		rg = as->as_regions;
+		as->as_regions = rg->rg_next;
+		region_destroy(rg);
+	}
+#endif
 	kfree(as);
 }
 
@@ -247,9 +1734,55 @@ as_activate(void)
 	/* Disable interrupts on this CPU while frobbing the TLB. */
 	spl = splhigh();
 
+#if OPT_A3
+	(void)i;
+
+	/*
+	 * Switching back to the address space we last ran, e.g. after a
+	 * kernel thread or when the same process is rescheduled: its ASID
+	 * and entries are all still here. The ASID is checked as well in
+	 * case AS is a new address space allocated where the old one was.
+	 * If the generation has moved on meanwhile, AS keeps its old ASID
+	 * until the next switch; nothing else can be given that ASID here
+	 * without this CPU flushing first.
+	 */
+	KASSERT(curcpu->c_number < 32);
+	if (as == curcpu->c_lastas && as->as_asidgen == curcpu->c_asidgen &&
+	    as->as_asid == curcpu->c_lastasid) {
+		vmstats_inc(VMSTAT_TLB_FLUSH_AVOIDED);
+		splx(spl);
+		return;
+	}
+
+	spinlock_acquire(&asid_lock);
+	if (as->as_asidgen != asid_generation) {
+		if (asid_next == NUM_TLBPID) {
+			/* Out of ASIDs; every CPU flushes on its next switch */
+			asid_generation++;
+			asid_next = 1;
+		}
+		as->as_asid = asid_next++;
+		as->as_asidgen = asid_generation;
+		as->as_cpus = 0;
+	}
+	as->as_cpus |= (uint32_t)1 << curcpu->c_number;
+	if (curcpu->c_asidgen != asid_generation) {
+		vm_tlbflush();
+		curcpu->c_asidgen = asid_generation;
+	}
+	else {
+		vmstats_inc(VMSTAT_TLB_FLUSH_AVOIDED);
+	}
+	spinlock_release(&asid_lock);
+
+	curcpu->c_lastas = as;
+	curcpu->c_lastasid = as->as_asid;
+	tlb_setentryhi(as->as_asid << TLBHI_PIDSHIFT);
+#else
 	for (i=0; i<NUM_TLB; i++) {
 		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
 	}
+#endif
 
 	splx(spl);
 }
@@ -275,6 +1808,36 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 
 	npages = sz / PAGE_SIZE;
 
+#if OPT_A3
+	struct region *rg;
+	uint32_t perms = 0;
+
+	/*
+	 * Nothing is copied in through uiomove any more, so check here
+	 * that the region really is in user space.
+	 */
+	if (npages == 0 || vaddr + sz < vaddr || vaddr + sz > USERSPACETOP) {
+		return EFAULT;
+	}
+
+	if (readable) {
+		perms |= PTE_READ;
+	}
+	if (writeable) {
+		perms |= PTE_WRITE;
+	}
+	if (executable) {
+		perms |= PTE_EXEC;
+	}
+
+	/* Any number of regions; their pages live in the page table */
+	rg = region_create(vaddr, npages, perms);
+	if (rg == NULL) {
+		return ENOMEM;
+	}
+	as_addregion(as, rg);
+	return 0;
+#else
 	/* We don't use these - all pages are read-write */
 	(void)readable;
 	(void)writeable;
@@ -297,18 +1860,355 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 	 */
 	kprintf("dumbvm: Warning: too many regions\n");
 	return EUNIMP;
+#endif
+}
+
+#if OPT_A3
+/*
+ * Record that the FILESIZE bytes at VADDR come from vnode V at OFFSET.
+ * The region containing VADDR must already be defined.
+ */
+int
+as_define_backing(struct addrspace *as, struct vnode *v,
+		  off_t offset, vaddr_t vaddr, size_t filesize)
+{
+	struct region *rg;
+
+	/*
+	 * Segments may share a page, so take the first region without a
+	 * file that holds the whole range rather than just any region
+	 * containing VADDR.
+	 */
+	for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+		if (rg->rg_vnode == NULL && region_contains(rg, vaddr) &&
+		    filesize <= rg->rg_vbase + rg->rg_npages * PAGE_SIZE - vaddr) {
+			break;
+		}
+	}
+	if (rg == NULL) {
+		return EFAULT;
+	}
+
+	VOP_INCREF(v);
+	rg->rg_vnode = v;
+	rg->rg_offset = offset;
+	rg->rg_filevaddr = vaddr;
+	rg->rg_filesize = filesize;
+	return 0;
+}
+
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbrk)
+{
+	struct region *rg, *heap = as->as_heap;
+	struct tlbbatch tb;
+	vaddr_t newbrk, oldtop, newtop, va, guard;
+
+	if (heap == NULL) {
+		/* Not loaded from an executable */
+		return EINVAL;
+	}
+
+	/* The break and the regions it is checked against change together */
+	lock_acquire(as->as_lock);
+	if (amount < 0) {
+		if ((vaddr_t)0 - (vaddr_t)amount >
+		    as->as_heapbrk - heap->rg_vbase) {
+			lock_release(as->as_lock);
+			return EINVAL;
+		}
+	}
+	else if ((vaddr_t)amount > USERSPACETOP - as->as_heapbrk) {
+		lock_release(as->as_lock);
+		return ENOMEM;
+	}
+	newbrk = as->as_heapbrk + amount;
+	newtop = ROUNDUP(newbrk, PAGE_SIZE);
+	oldtop = heap->rg_vbase + heap->rg_npages * PAGE_SIZE;
+
+	if (newtop > oldtop) {
+		/* Keep the same gap below the stack as stack growth does */
+		guard = (vaddr_t)vm_stackguard * PAGE_SIZE;
+		for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+			if (rg != heap && rg->rg_vbase >= oldtop &&
+			    newtop + guard > rg->rg_vbase) {
+				lock_release(as->as_lock);
+				return ENOMEM;
+			}
+		}
+	}
+	else if (newtop < oldtop) {
+		/* Give back the pages above the new break */
+		vm_tlbbatch_init(&tb, as);
+		for (va = newtop; va < oldtop; va += PAGE_SIZE) {
+			as_freepage(as, va, &tb);
+		}
+		vm_tlbbatch_flush(&tb);
+	}
+
+	/* New heap pages are zero-filled on first touch */
+	heap->rg_npages = (newtop - heap->rg_vbase) / PAGE_SIZE;
+	*oldbrk = as->as_heapbrk;
+	as->as_heapbrk = newbrk;
+	lock_release(as->as_lock);
+	return 0;
+}
+
+int
+as_mmap(struct addrspace *as, struct vnode *v, off_t offset, size_t len,
+	int prot, bool shared, vaddr_t *addr)
+{
+	struct region *rg;
+	vaddr_t base, top, floor, size, guard;
+	uint32_t perms = PTE_READ;
+
+	if (len > USERSPACETOP) {
+		return ENOMEM;
+	}
+	size = ROUNDUP(len, PAGE_SIZE);
+	guard = (vaddr_t)vm_stackguard * PAGE_SIZE;
+
+	/*
+	 * Search down from below the space the stack may grow into for a
+	 * gap that keeps the guard distance from every region. Mappings
+	 * never go below the heap.
+	 */
+	top = USERSTACK;
+	if (as->as_stack != NULL) {
+		top -= as->as_stackmax * PAGE_SIZE;
+	}
+	floor = (as->as_heap != NULL) ? as->as_heap->rg_vbase : PAGE_SIZE;
+	do {
+		if (top < floor + size + 2 * guard) {
+			return ENOMEM;
+		}
+		base = top - guard - size;
+		for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+			if (rg != as->as_stack &&
+			    rg->rg_vbase < base + size + guard &&
+			    rg->rg_vbase + rg->rg_npages * PAGE_SIZE + guard > base) {
+				/* In the way; try below it */
+				top = rg->rg_vbase;
+				break;
+			}
+		}
+	} while (rg != NULL);
+
+	if (prot & PROT_WRITE) {
+		perms |= PTE_WRITE;
+	}
+	if (prot & PROT_EXEC) {
+		perms |= PTE_EXEC;
+	}
+
+	/* Pages are looked up in the page cache on first touch */
+	rg = region_create(base, size / PAGE_SIZE, perms);
+	if (rg == NULL) {
+		return ENOMEM;
+	}
+	VOP_INCREF(v);
+	rg->rg_vnode = v;
+	rg->rg_offset = offset;
+	rg->rg_filevaddr = base;
+	rg->rg_filesize = len;
+	rg->rg_mmap = true;
+	rg->rg_shared = shared;
+	as_addregion(as, rg);
+
+	*addr = base;
+	return 0;
+}
+
+int
+as_munmap(struct addrspace *as, vaddr_t addr, size_t len)
+{
+	struct region *rg, **rgp;
+	int result = 0;
+
+	for (rgp = &as->as_regions; *rgp != NULL; rgp = &(*rgp)->rg_next) {
+		if ((*rgp)->rg_mmap && (*rgp)->rg_vbase == addr) {
+			break;
+		}
+	}
+	rg = *rgp;
+	if (rg == NULL ||
+	    ROUNDUP(len, PAGE_SIZE) != rg->rg_npages * PAGE_SIZE) {
+		/* Only whole mappings can be removed */
+		return EINVAL;
+	}
+
+	as_unmapregion(as, rg);
+	if (rg->rg_shared) {
+		result = pagecache_flush(rg->rg_vnode);
+	}
+
+	lock_acquire(as->as_lock);
+	*rgp = rg->rg_next;
+	lock_release(as->as_lock);
+	region_destroy(rg);
+	return result;
+}
+
+void
+as_syncfile(struct addrspace *as, struct vnode *v)
+{
+	struct region *rg;
+	vaddr_t vaddr;
+	pte_t *pte;
+
+	lock_acquire(as->as_lock);
+	for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+		if (!rg->rg_shared || rg->rg_vnode != v) {
+			continue;
+		}
+		for (vaddr = rg->rg_vbase;
+		     vaddr < rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+		     vaddr += PAGE_SIZE) {
+			pte = pt_lookup(as->as_pt, vaddr, false);
+			if (pte != NULL && (*pte & PTE_VALID) &&
+			    (*pte & PTE_DIRTY)) {
+				pagecache_markdirty(v,
+					rg->rg_offset + (vaddr - rg->rg_vbase));
+			}
+		}
+	}
+	lock_release(as->as_lock);
+}
+
+/*
+ * Check that the LEN bytes at VADDR of AS start on a page boundary and
+ * lie wholly in regions, and hand back the page-aligned end.
+ */
+static
+int
+as_checkrange(struct addrspace *as, vaddr_t vaddr, size_t len, vaddr_t *top)
+{
+	vaddr_t va;
+
+	if ((vaddr & ~(vaddr_t)PAGE_FRAME) != 0) {
+		return EINVAL;
+	}
+	*top = vaddr + ROUNDUP(len, PAGE_SIZE);
+	if (*top < vaddr || *top > USERSPACETOP) {
+		return ENOMEM;
+	}
+	for (va = vaddr; va < *top; va += PAGE_SIZE) {
+		if (as_findregion(as, va) == NULL) {
+			return ENOMEM;
+		}
+	}
+	return 0;
+}
+
+int
+as_madvise(struct addrspace *as, vaddr_t vaddr, size_t len, int advice)
+{
+	struct region *rg;
+	struct tlbbatch tb;
+	vaddr_t va, top;
+	paddr_t paddr;
+	bool writeable;
+	unsigned kind;
+	pte_t *pte;
+	int result;
+
+	result = as_checkrange(as, vaddr, len, &top);
+	if (result) {
+		return result;
+	}
+
+	switch (advice) {
+	    case MADV_NORMAL:
+	    case MADV_RANDOM:
+	    case MADV_SEQUENTIAL:
+		/* Regions are not split, so this covers all they overlap */
+		for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+			if (rg->rg_vbase < top &&
+			    rg->rg_vbase + rg->rg_npages * PAGE_SIZE > vaddr) {
+				rg->rg_advice = advice;
+			}
+		}
+		return 0;
+
+	    case MADV_WILLNEED:
+		/* Page in whatever is missing, as a read fault would */
+		for (va = vaddr; va < top; va += PAGE_SIZE) {
+			rg = as_findregion(as, va);
+			lock_acquire(as->as_lock);
+			pte = pt_lookup(as->as_pt, va, false);
+			if (pte != NULL && (*pte & PTE_VALID)) {
+				lock_release(as->as_lock);
+				continue;
+			}
+			result = vm_getpage(as, rg, VM_FAULT_READ, va, &paddr,
+					    &writeable, &kind);
+			lock_release(as->as_lock);
+			if (result == ENOMEM) {
+				/* It was only advice; leave the rest */
+				break;
+			}
+			if (result) {
+				return result;
+			}
+			vmstats_inc(VMSTAT_PAGE_PREFETCH);
+			if (as->as_rss > curproc->p_usage.pu_maxrss) {
+				curproc->p_usage.pu_maxrss = as->as_rss;
+			}
+		}
+		return 0;
+
+	    case MADV_DONTNEED:
+		vm_tlbbatch_init(&tb, as);
+		lock_acquire(as->as_lock);
+		for (va = vaddr; va < top; va += PAGE_SIZE) {
+			as_droppage(as, as_findregion(as, va), va, &tb);
+		}
+		vm_tlbbatch_flush(&tb);
+		lock_release(as->as_lock);
+		return 0;
+	}
+	return EINVAL;
 }
 
+int
+as_mincore(struct addrspace *as, vaddr_t vaddr, size_t npages,
+	   unsigned char *vec)
+{
+	vaddr_t top;
+	pte_t *pte;
+	size_t i;
+	int result;
+
+	result = as_checkrange(as, vaddr, npages * PAGE_SIZE, &top);
+	if (result) {
+		return result;
+	}
+
+	lock_acquire(as->as_lock);
+	for (i = 0; i < npages; i++) {
+		pte = pt_lookup(as->as_pt, vaddr + i * PAGE_SIZE, false);
+		vec[i] = (pte != NULL && (*pte & PTE_VALID)) ? 1 : 0;
+	}
+	lock_release(as->as_lock);
+	return 0;
+}
+#else
 static
 void
 as_zero_region(paddr_t paddr, unsigned npages)
 {
 	bzero((void *)PADDR_TO_KVADDR(paddr), npages * PAGE_SIZE);
 }
+#endif
 
 int
 as_prepare_load(struct addrspace *as)
 {
+#if OPT_A3
+	/* Nothing to do: pages are allocated and filled in vm_fault */
+	(void)as;
+	return 0;
+#else
 	KASSERT(as->as_pbase1 == 0);
 	KASSERT(as->as_pbase2 == 0);
 	KASSERT(as->as_stackpbase == 0);
@@ -333,19 +2233,61 @@ as_prepare_load(struct addrspace *as)
 	as_zero_region(as->as_stackpbase, DUMBVM_STACKPAGES);
 
 	return 0;
+#endif
 }
 
 int
 as_complete_load(struct addrspace *as)
 {
+#if OPT_A3
+	struct region *rg;
+	vaddr_t top = 0;
+
+	KASSERT(as->as_heap == NULL);
+
+	/* The heap starts out empty, just above the highest segment */
+	for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+		if (rg->rg_vbase + rg->rg_npages * PAGE_SIZE > top) {
+			top = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+		}
+	}
+	rg = region_create(top, 0, PTE_READ | PTE_WRITE);
+	if (rg == NULL) {
+		return ENOMEM;
+	}
+	as_addregion(as, rg);
+	as->as_heap = rg;
+	as->as_heapbrk = top;
+#else
 	(void)as;
+#endif
 	return 0;
 }
 
 int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {
+#if OPT_A3
+	struct region *rg;
+
+	KASSERT(as->as_stack == NULL);
+
+	/*
+	 * Stack pages are zero-filled on first touch, and the region grows
+	 * down in vm_fault as they are touched. The limit is fixed now so a
+	 * later vmtune does not change it under a running process.
+	 */
+	rg = region_create(USERSTACK - DUMBVM_STACKINIT * PAGE_SIZE,
+			   DUMBVM_STACKINIT, PTE_READ | PTE_WRITE);
+	if (rg == NULL) {
+		return ENOMEM;
+	}
+	as_addregion(as, rg);
+	as->as_stack = rg;
+	as->as_stackmax = vm_stackmax;
+#else
 	KASSERT(as->as_stackpbase != 0);
+#endif
 
 	*stackptr = USERSTACK;
 	return 0;
@@ -361,6 +2303,46 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 		return ENOMEM;
 	}
 
+#if OPT_A3
+	struct region *rg, *newrg;
+	int result;
+
+	for (rg = old->as_regions; rg != NULL; rg = rg->rg_next) {
+		newrg = region_copy(rg);
+		if (newrg == NULL) {
+			as_destroy(new);
+			return ENOMEM;
+		}
+		as_addregion(new, newrg);
+		if (rg == old->as_stack) {
+			new->as_stack = newrg;
+		}
+		if (rg == old->as_heap) {
+			new->as_heap = newrg;
+		}
+	}
+	new->as_stackmax = old->as_stackmax;
+	new->as_heapbrk = old->as_heapbrk;
+
+	/* Share every resident page copy-on-write */
+	lock_acquire(old->as_lock);
+	result = pt_copy(old->as_pt, new->as_pt);
+	new->as_rss = old->as_rss;
+	lock_release(old->as_lock);
+	if (result) {
+		as_destroy(new);
+		return result;
+	}
+
+	/*
+	 * We are running on the parent, and any CPU it ran on may still
+	 * hold writable entries for the pages just shared. Drop them all
+	 * by giving the parent a new ASID; it faults them back in
+	 * read-only.
+	 */
+	as_retireasid(old);
+	as_activate();
+#else
 	new->as_vbase1 = old->as_vbase1;
 	new->as_npages1 = old->as_npages1;
 	new->as_vbase2 = old->as_vbase2;
@@ -387,6 +2369,7 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	memmove((void *)PADDR_TO_KVADDR(new->as_stackpbase),
 		(const void *)PADDR_TO_KVADDR(old->as_stackpbase),
 		DUMBVM_STACKPAGES*PAGE_SIZE);
+#endif
 	
 	*ret = new;
 	return 0;
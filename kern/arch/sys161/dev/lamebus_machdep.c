@@ -30,6 +30,7 @@
 #include <types.h>
 #include <kern/unistd.h>
 #include <lib.h>
+#include <mips/specialreg.h>
 #include <mips/trapframe.h>
 #include <cpu.h>
 #include <spl.h>
@@ -41,6 +42,11 @@
 #include <sys161/bus.h>
 #include <lamebus/lamebus.h>
 #include "autoconf.h"
+#include "opt-A3.h"
+
+#if OPT_A3
+#include <proc.h>
+#endif
 
 /*
  * CPU frequency used by the on-chip timer.
@@ -270,6 +276,10 @@ mainbus_interrupt(struct trapframe *tf)
 	else if (cause & MIPS_TIMER_BIT) {
 		/* Reset the timer (this clears the interrupt) */
 		mips_timer_set(CPU_FREQUENCY / HZ);
+#if OPT_A3
+		/* Charge the tick to whatever it interrupted */
+		proc_chargetick((tf->tf_status & CST_KUp) != 0);
+#endif
 		/* and call hardclock */
 		hardclock();
 	}
@@ -53,6 +53,7 @@
 #include <vfs.h>
 #include <emufs.h>
 #include "autoconf.h"
+#include "opt-A3.h"
 
 /* Register offsets */
 #define REG_HANDLE    0
@@ -843,7 +844,12 @@ int
 emufs_mmap(struct vnode *v)
 {
 	(void)v;
+#if OPT_A3
+	/* The VM system pages through VOP_READ and VOP_WRITE */
+	return 0;
+#else
 	return EUNIMP;
+#endif
 }
 
 //////////////////////////////
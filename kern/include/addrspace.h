@@ -36,8 +36,10 @@
 
 
 #include <vm.h>
+#include "opt-A3.h"
 
 struct vnode;
+struct lock;
 
 
 /* 
@@ -47,6 +49,63 @@ struct vnode;
  * You write this.
  */
 
+#if OPT_A3
+/*
+ * A page-aligned range of user virtual memory. Pages are allocated on
+ * first touch: the bytes [rg_filevaddr, rg_filevaddr + rg_filesize) are
+ * read from rg_vnode starting at rg_offset, everything else in the region
+ * is zero-filled. Which pages are resident, and where, is kept in the
+ * address space's page table. Whole pages of read-only file data, which
+ * is most of a program's text, are mapped from the page cache instead,
+ * so every process running the same executable shares them.
+ *
+ * Regions made by mmap instead map pages of the page cache, so every
+ * process mapping a file sees the same frames. Writes to a private
+ * mapping go to a copy-on-write copy; writes to a shared one go to the
+ * cached page and from there back to the file.
+ */
+struct region {
+  vaddr_t rg_vbase;       // first page of the region
+  size_t rg_npages;
+  uint32_t rg_perms;      // PTE_READ/PTE_WRITE/PTE_EXEC for its pages
+
+  struct vnode *rg_vnode; // file backing the region, NULL if anonymous
+  off_t rg_offset;        // file offset of rg_filevaddr
+  vaddr_t rg_filevaddr;   // (unaligned) address of the file-backed bytes
+  size_t rg_filesize;
+
+  bool rg_mmap;           // pages come from the page cache
+  bool rg_shared;         // MAP_SHARED: writes reach the file
+  int rg_advice;          // MADV_NORMAL, MADV_RANDOM or MADV_SEQUENTIAL
+
+  struct region *rg_next;
+};
+
+struct addrspace {
+  struct region *as_regions; // every region, including the stack
+  struct region *as_stack;   // grows down on faults below it
+  unsigned as_stackmax;      // most pages as_stack may grow to
+  struct region *as_heap;    // grows and shrinks with sbrk, may be empty
+  vaddr_t as_heapbrk;        // the break; as_heap covers it rounded up
+  struct pagetable *as_pt;
+  unsigned as_rss;           // resident pages in as_pt, shared ones too
+  vaddr_t as_rsshand;        // last page looked at to keep under RLIMIT_RSS
+  struct lock *as_lock;      // held to change as_pt; the pager takes it
+                             // to evict one of our pages
+
+  uint32_t as_asid;          // TLB address space ID, valid if as_asidgen
+  uint32_t as_asidgen;       // is the current ASID generation (never 0)
+  uint32_t as_cpus;          // CPUs that may hold entries for as_asid
+
+  vaddr_t as_fanext;         // pages a sweep up or down would miss on
+  vaddr_t as_faprev;         // next, for fault-around
+  vaddr_t as_fabase;         // lowest page the last fault-around preloaded
+  unsigned as_fanpages;      // how many it preloaded
+  int as_fadir;              // 1 if above the fault, -1 if below
+
+  struct addrspace *as_nextall; // on the list of every address space
+};
+#else
 struct addrspace {
   vaddr_t as_vbase1;
   paddr_t as_pbase1;
@@ -56,6 +115,7 @@ struct addrspace {
   size_t as_npages2;
   paddr_t as_stackpbase;
 };
+#endif
 
 /*
  * Functions in addrspace.c:
@@ -91,6 +151,29 @@ struct addrspace {
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
+ *
+ *    as_define_backing - record that part of a region previously set up
+ *                with as_define_region is loaded from a file on demand,
+ *                rather than being read in by the loader.
+ *
+ *    as_sbrk   - move the end of the heap, which starts out empty just
+ *                above the loaded segments. Hands back the old break.
+ *
+ *    as_mmap   - map part of a file below the stack's reserved space.
+ *                Hands back the address of the mapping.
+ *
+ *    as_munmap - remove a whole mapping made by as_mmap, writing back
+ *                the pages it dirtied.
+ *
+ *    as_syncfile - note every page of a file the address space has
+ *                dirtied through shared mappings, so that the page
+ *                cache writes them back.
+ *
+ *    as_madvise - take madvise advice about a page-aligned range: record
+ *                an access pattern for the regions it overlaps, or page
+ *                its pages in or drop them now.
+ *
+ *    as_mincore - report which of a run of pages are resident.
  */
 
 struct addrspace *as_create(void);
@@ -107,6 +190,22 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+#if OPT_A3
+int               as_define_backing(struct addrspace *as, struct vnode *v,
+                                    off_t offset, vaddr_t vaddr,
+                                    size_t filesize);
+int               as_sbrk(struct addrspace *as, intptr_t amount,
+                          vaddr_t *oldbrk);
+int               as_mmap(struct addrspace *as, struct vnode *v,
+                          off_t offset, size_t len, int prot, bool shared,
+                          vaddr_t *addr);
+int               as_munmap(struct addrspace *as, vaddr_t addr, size_t len);
+void              as_syncfile(struct addrspace *as, struct vnode *v);
+int               as_madvise(struct addrspace *as, vaddr_t vaddr,
+                             size_t len, int advice);
+int               as_mincore(struct addrspace *as, vaddr_t vaddr,
+                             size_t npages, unsigned char *vec);
+#endif
 
 
 /*
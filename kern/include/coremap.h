@@ -0,0 +1,82 @@
+#ifndef _COREMAP_H_
+#define _COREMAP_H_
+
+/*
+ * Coremap - physical frame table.
+ *
+ * One entry per physical page of RAM, from paddr 0 up to the top of
+ * memory reported by ram_getsize(). Frames below the first free page
+ * (kernel image, exception vectors, early ram_stealmem allocations and
+ * the coremap itself) are marked fixed and are never handed out.
+ *
+ * Free frames live on doubly-linked free lists threaded through the
+ * entries, so single page allocations and frees are O(1). Multi-page
+ * (contiguous) allocations scan for a run of free frames starting at a
+ * rotating hint.
+ *
+ * There are two free lists: frames with stale contents, and frames that
+ * an idle CPU has already zeroed (see coremap_zeroidle). Pages that are
+ * about to be overwritten take stale frames first, so the zeroed ones are
+ * left for zero-fill faults.
+ *
+ * User frames are reference counted so that fork can share them
+ * copy-on-write. A frame with more than one reference has no single
+ * owner, so cme_as is only meaningful while the count is one.
+ *
+ * When memory runs low, a clock hand sweeps the user frames with a known
+ * owner to find one to page out, giving a second chance to pages whose
+ * PTE_REF bit is set. Clearing the bit drops the page's TLB entry, so the
+ * next touch faults and sets it again. Shared frames are never paged out.
+ *
+ * The page merger sweeps the same frames in address order, looking for
+ * single-owner pages with the same contents (see pagemerge).
+ */
+
+#include <types.h>
+
+struct addrspace;
+
+/* Frame states */
+#define CME_FREE    0   // on the free list
+#define CME_FIXED   1   // kernel image or stolen before bootstrap, never freed
+#define CME_KERNEL  2   // part of a kernel allocation (alloc_kpages)
+#define CME_USER    3   // user page, owned by cme_as
+
+/* Terminator for the free list links */
+#define CM_NONE ((unsigned)-1)
+
+struct coremap_entry {
+  struct addrspace *cme_as; // owning address space (CME_USER only)
+  vaddr_t cme_vaddr;        // user page mapped by this frame (CME_USER only)
+  unsigned cme_npages;      // length of the run this frame heads, 0 otherwise
+  unsigned cme_next;        // free list links (CME_FREE only)
+  unsigned cme_prev;
+  unsigned cme_refcount;    // number of mappings of this frame (CME_USER only)
+  uint8_t cme_state;
+  bool cme_busy;            // being paged out
+  bool cme_zeroed;          // on the zeroed free list (CME_FREE only)
+};
+
+void coremap_bootstrap(void);
+bool coremap_isready(void);
+
+paddr_t coremap_alloc(unsigned npages, struct addrspace *as, vaddr_t vaddr);
+paddr_t coremap_alloczero(struct addrspace *as, vaddr_t vaddr);
+bool coremap_zeroidle(void);
+void coremap_free(paddr_t paddr);
+
+void coremap_share(paddr_t paddr);
+unsigned coremap_refcount(paddr_t paddr);
+void coremap_setowner(paddr_t paddr, struct addrspace *as, vaddr_t vaddr);
+
+void coremap_getstats(unsigned *nfree, unsigned *ntotal);
+
+paddr_t coremap_pickvictim(struct addrspace **as, vaddr_t *vaddr, bool *locked);
+void coremap_unbusy(paddr_t paddr);
+
+bool coremap_lockowner(paddr_t paddr, struct addrspace **as, vaddr_t *vaddr,
+                       bool *locked);
+paddr_t coremap_nextowned(struct addrspace **as, vaddr_t *vaddr,
+                          bool *locked);
+
+#endif /* _COREMAP_H_ */
@@ -34,6 +34,7 @@
 #include <spinlock.h>
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
+#include "opt-A3.h"
 
 
 /*
@@ -60,6 +61,12 @@ struct cpu {
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+#if OPT_A3
+	unsigned c_tlbvictim;		/* Next TLB slot to replace */
+	struct addrspace *c_lastas;	/* Address space last activated */
+	uint32_t c_lastasid;		/* ...and the ASID it had */
+	uint32_t c_asidgen;		/* ASID generation in our TLB */
+#endif
 
 	/*
 	 * Accessed by other cpus.
@@ -139,6 +146,14 @@ void cpu_irqon(void);
 void cpu_idle(void);
 void cpu_halt(void);
 
+#if OPT_A3
+/*
+ * Read the current CPU's cycle counter. It wraps, so only differences
+ * between two reads on the same CPU mean anything.
+ */
+uint32_t cpu_cycles(void);
+#endif
+
 /*
  * Interprocessor interrupts.
  *
@@ -152,6 +167,8 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_mask sends it to every other CPU whose number is set
+ * in a bit mask, and returns how many that was.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -166,6 +183,10 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+#if OPT_A3
+unsigned ipi_tlbshootdown_mask(uint32_t cpumask,
+			       const struct tlbshootdown *mapping);
+#endif
 
 void interprocessor_interrupt(void);
 
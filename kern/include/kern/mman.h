@@ -0,0 +1,30 @@
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/*
+ * Definitions for mmap().
+ */
+
+/* Page protections for mmap(); PROT_READ is always granted. */
+#define PROT_NONE    0
+#define PROT_READ    1
+#define PROT_WRITE   2
+#define PROT_EXEC    4
+
+/* Mapping type for mmap(): exactly one must be given. */
+#define MAP_SHARED   1	/* Writes go to the file and are seen by others. */
+#define MAP_PRIVATE  2	/* Writes go to a private copy of the page. */
+
+/* Returned by mmap() on error. */
+#define MAP_FAILED   ((void *)-1)
+
+/* Advice for madvise(). The first three describe how a range will be
+ * used from now on; the last two act on its pages right away. */
+#define MADV_NORMAL      0	/* No particular pattern. */
+#define MADV_RANDOM      1	/* Don't load neighbouring pages on faults. */
+#define MADV_SEQUENTIAL  2	/* Load ahead; pages behind go out first. */
+#define MADV_WILLNEED    3	/* Page the range in now. */
+#define MADV_DONTNEED    4	/* Free the pages now. Private pages are */
+				/* refilled from the file or with zeros. */
+
+#endif /* _KERN_MMAN_H_ */
@@ -59,8 +59,8 @@
 #define SYS_mmap         8
 #define SYS_munmap       9
 #define SYS_mprotect     10
-//#define SYS_madvise    11
-//#define SYS_mincore    12
+#define SYS_madvise      11
+#define SYS_mincore      12
 //#define SYS_mlock      13
 //#define SYS_munlock    14
 //#define SYS_munlockall 15
@@ -86,10 +86,10 @@
 //#define SYS_sigaltstack 33
 //                              (resource tracking and usage)
 //#define SYS_wait4      34
-//#define SYS_getrusage  35
+#define SYS_getrusage    35
 //                              (resource limits)
-//#define SYS_getrlimit  36
-//#define SYS_setrlimit  37
+#define SYS_getrlimit    36
+#define SYS_setrlimit    37
 //                              (process priority control)
 //#define SYS_getpriority 38
 //#define SYS_setpriority 39
@@ -0,0 +1,68 @@
+#ifndef _KMEM_CACHE_H_
+#define _KMEM_CACHE_H_
+
+/*
+ * Object caches - slab allocation of fixed-size kernel structures.
+ *
+ * A cache hands out objects of one size from slabs, pages of their own
+ * taken straight from alloc_kpages. Objects are packed at the cache's
+ * alignment instead of being rounded up to kmalloc's next power of two.
+ *
+ * The optional constructor runs on every object when its slab is made,
+ * and the destructor when the slab is given back; in between, objects
+ * keep their constructed state across kmem_cache_free and
+ * kmem_cache_alloc. So whatever a structure sets up the same way every
+ * time (its wait channel, spinlock, list nodes, arrays) is set up once,
+ * and kmem_cache_free must only be given objects in that state.
+ *
+ * Each slab starts with a header, so the slab an object belongs to is
+ * found by rounding its address down. Free objects are linked through a
+ * word past the end of the object, which leaves the object untouched.
+ * Objects come from partly used slabs before empty ones, so that empty
+ * slabs can be given back; a cache keeps at most one.
+ *
+ * Caches can be declared statically with KMEM_CACHE_INITIALIZER, which
+ * makes them usable before anything else is set up (for the boot thread,
+ * say), or made with kmem_cache_create.
+ */
+
+#include <types.h>
+#include <spinlock.h>
+
+struct kmem_slab;
+
+struct kmem_cache {
+  const char *kc_name;
+  size_t kc_size;                 // object size
+  size_t kc_align;                // object alignment, a power of 2
+  int (*kc_ctor)(void *obj);      // may be NULL; returns an error code
+  void (*kc_dtor)(void *obj);     // may be NULL
+  bool kc_dynamic;                // made by kmem_cache_create
+
+  struct spinlock kc_lock;
+  size_t kc_stride;               // bytes per object, 0 until first use
+  size_t kc_first;                // offset of the first object in a slab
+  unsigned kc_perslab;            // objects per slab
+  struct kmem_slab *kc_partial;   // slabs with some objects free
+  struct kmem_slab *kc_empty;     // slabs with every object free
+  unsigned kc_nslabs;             // all slabs, full ones too
+  unsigned kc_nempty;             // slabs on kc_empty
+  unsigned kc_ninuse;             // objects handed out
+  struct kmem_cache *kc_next;     // on the list of caches, once used
+};
+
+#define KMEM_CACHE_INITIALIZER(name, size, align, ctor, dtor) \
+  { name, size, align, ctor, dtor, false, SPINLOCK_INITIALIZER, \
+    0, 0, 0, NULL, NULL, 0, 0, 0, NULL }
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+                                     size_t align, int (*ctor)(void *),
+                                     void (*dtor)(void *));
+void kmem_cache_destroy(struct kmem_cache *kc);
+
+void *kmem_cache_alloc(struct kmem_cache *kc);
+void kmem_cache_free(struct kmem_cache *kc, void *obj);
+
+void kmem_cache_printstats(void);
+
+#endif /* _KMEM_CACHE_H_ */
@@ -127,6 +127,17 @@ void *kmalloc(size_t size);
 void kfree(void *ptr);
 void kheap_printstats(void);
 
+/*
+ * Which way kfree goes, for comparing them with "km2 -t": through the
+ * per-CPU magazines (the default), straight to the page found in the
+ * page map, or to the page found by walking every page of the heap, as
+ * kfree did before there was a page map.
+ */
+#define KFREE_MAG   0
+#define KFREE_MAP   1
+#define KFREE_WALK  2
+extern int kfree_path;
+
 /*
  * C string functions. 
  *
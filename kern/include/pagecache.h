@@ -0,0 +1,36 @@
+#ifndef _PAGECACHE_H_
+#define _PAGECACHE_H_
+
+/*
+ * Page cache - file pages shared between mmap()s.
+ *
+ * Each cached page is a user frame keyed by (vnode, file offset). The
+ * cache holds one coremap reference on the frame and every page table
+ * entry mapping it holds another, so a frame stays put while anybody has
+ * it mapped. pagecache_reclaim gives back frames once the cache's is the
+ * last reference; pagecache_reclaimmapped first takes pages away from
+ * the address spaces mapping them, found by vm_unmapcached from the
+ * regions that map the file, with a second chance for pages in use.
+ *
+ * Dirty pages are recorded when a shared mapping first writes them and
+ * again when such a mapping goes away, and are written back on munmap,
+ * fsync, reclaim and at shutdown. Write-back never extends the file.
+ */
+
+#include <types.h>
+
+struct vnode;
+
+void pagecache_bootstrap(void);
+
+paddr_t pagecache_lookup(struct vnode *vn, off_t offset);
+int pagecache_fill(struct vnode *vn, off_t offset, paddr_t paddr,
+                   paddr_t *ret);
+void pagecache_markdirty(struct vnode *vn, off_t offset);
+
+int pagecache_flush(struct vnode *vn);
+int pagecache_reclaim(void);
+int pagecache_reclaimmapped(void);
+void pagecache_purge(void);
+
+#endif /* _PAGECACHE_H_ */
@@ -0,0 +1,29 @@
+#ifndef _PAGEMERGE_H_
+#define _PAGEMERGE_H_
+
+/*
+ * Page merger - shares identical private pages between processes.
+ *
+ * A kernel thread sweeps the single-owner user frames in address order,
+ * vm_mergerate of them a second, and hashes each page's contents. A page
+ * that is byte for byte the same as one already merged is remapped onto
+ * that frame; one that matches a page seen earlier in the same sweep is
+ * merged with it into a new merged frame. Otherwise the page is
+ * remembered as a candidate until the sweep ends.
+ *
+ * Merged frames are shared just like the pages fork shares: every mapping
+ * is read-only, and a write to one copies it (see vm_cowpage), which
+ * splits it off again. The merger holds a coremap reference on each
+ * merged frame, so its contents can't change while it is in the table,
+ * and gives the frame back once nobody else maps it, from
+ * pagemerge_reclaim or at the end of each sweep.
+ *
+ * Like other shared frames, merged ones are never paged out.
+ */
+
+#include <types.h>
+
+void pagemerge_bootstrap(void);
+int pagemerge_reclaim(void);
+
+#endif /* _PAGEMERGE_H_ */
@@ -0,0 +1,51 @@
+#ifndef _PAGETABLE_H_
+#define _PAGETABLE_H_
+
+/*
+ * Two-level page table.
+ *
+ * A virtual address is split into a 10 bit directory index, a 10 bit
+ * leaf index and the 12 bit page offset. The directory is a single page
+ * of pointers to leaf pages, and leaves are only allocated once some page
+ * they describe is touched, so a sparse address space costs a directory
+ * plus one leaf per 4MB actually in use. Page table pages are the only
+ * physically contiguous memory an address space needs.
+ */
+
+#include <types.h>
+
+typedef uint32_t pte_t;
+
+/* PTE layout: frame number in the top 20 bits, flags below */
+#define PTE_FRAME   0xfffff000
+#define PTE_VALID   0x00000001  // page is resident in PTE_FRAME
+#define PTE_READ    0x00000002
+#define PTE_WRITE   0x00000004
+#define PTE_EXEC    0x00000008
+#define PTE_DIRTY   0x00000010  // written since it was loaded
+#define PTE_REF     0x00000020  // touched since the bit was last cleared
+#define PTE_SWAPPED 0x00000040  // not resident; swap slot in the frame bits
+#define PTE_MERGED  0x00000080  // frame was shared by the page merger
+#define PTE_TLBREF  0x00000100  // like PTE_REF, but for TLB replacement
+
+#define PTE_PERMS   (PTE_READ | PTE_WRITE | PTE_EXEC)
+
+#define PTE_SWAPSLOT(pte)   ((pte) >> 12)
+#define PTE_FROMSLOT(slot)  ((pte_t)(slot) << 12)
+
+#define PT_NDIR     1024
+#define PT_NLEAF    1024
+#define PT_DIRINDEX(vaddr)  ((vaddr) >> 22)
+#define PT_LEAFINDEX(vaddr) (((vaddr) >> 12) & (PT_NLEAF - 1))
+
+struct pagetable {
+  pte_t *pt_dir[PT_NDIR]; // leaf pages, NULL until needed
+};
+
+struct pagetable *pt_create(void);
+void pt_destroy(struct pagetable *pt);
+
+pte_t *pt_lookup(struct pagetable *pt, vaddr_t vaddr, bool create);
+int pt_copy(struct pagetable *old, struct pagetable *new);
+
+#endif /* _PAGETABLE_H_ */
@@ -38,7 +38,9 @@
 
 #include <spinlock.h>
 #include <thread.h> /* required for struct threadarray */
+#include <limits.h>
 #include "opt-A2.h"
+#include "opt-A3.h"
 
 #if OPT_A2
 #include "array.h"
@@ -50,6 +52,24 @@ struct vnode;
 struct semaphore;
 #endif // UW
 
+#if OPT_A3
+/*
+ * Resource usage counters, reported by getrusage(). Only the process's
+ * own thread updates them, on its faults, its context switches and the
+ * clock ticks that interrupt it, so they need no lock.
+ */
+struct proc_usage {
+	unsigned pu_uticks;	/* clock ticks spent in user mode */
+	unsigned pu_sticks;	/* ... and in the kernel */
+	unsigned pu_rssticks;	/* resident pages, summed over those ticks */
+	unsigned pu_maxrss;	/* peak resident pages */
+	unsigned pu_minflt;	/* faults that needed no I/O */
+	unsigned pu_majflt;	/* faults that read a page in */
+	unsigned pu_nvcsw;	/* switches because we went to sleep */
+	unsigned pu_nivcsw;	/* switches because we were preempted */
+};
+#endif
+
 /*
  * Process structure.
  */
@@ -77,6 +97,28 @@ struct proc {
   struct vnode *console;                /* a vnode for the console device */
 #endif
 
+#if OPT_A3
+	/*
+	 * Files opened with open(). Descriptors 0-2 are the console and
+	 * are never in here. Each descriptor has its own offset for
+	 * read() and write(); fork gives the child a copy of it.
+	 */
+	struct vnode *p_files[OPEN_MAX];
+	int p_fileflags[OPEN_MAX];	/* flags given to open() */
+	off_t p_fileoffs[OPEN_MAX];	/* where read/write go next */
+
+	struct proc_usage p_usage;	/* our own resource usage */
+	struct proc_usage p_cusage;	/* that of reaped children */
+
+	/*
+	 * RLIMIT_RSS, in bytes. Past the soft limit, the process's page
+	 * faults page out its own pages to make room. Kept across exec
+	 * and inherited by fork.
+	 */
+	__rlim_t p_rsscur;
+	__rlim_t p_rssmax;
+#endif
+
 	/* add more material here as needed */
 };
 
@@ -109,5 +151,13 @@ struct addrspace *curproc_getas(void);
 /* Change the address space of the current process, and return the old one. */
 struct addrspace *curproc_setas(struct addrspace *);
 
+#if OPT_A3
+/* Charge a clock tick, taken in user mode or not, to the current process. */
+void proc_chargetick(bool user);
+
+/* Add one set of usage counters to another, as when reaping a child. */
+void proc_usage_add(struct proc_usage *to, const struct proc_usage *from);
+#endif
+
 
 #endif /* _PROC_H_ */
@@ -5,6 +5,7 @@
 #include <proc.h>
 #include <synch.h>
 #include "array.h"
+#include "opt-A3.h"
 
 struct proc_table_entry {
   volatile struct proc *proc;
@@ -12,6 +13,10 @@ struct proc_table_entry {
   volatile unsigned numref;
   volatile bool isdead; // condition of cv
   volatile int exitcode; // value of cv
+#if OPT_A3
+  volatile int exitsig; // nonzero if killed by a fatal trap
+  struct proc_usage usage; // ours and our reaped children's, once dead
+#endif
   volatile struct cv *exitcode_cv;
   volatile struct proc_table_entry *parent;
   volatile struct array *children;
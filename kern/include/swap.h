@@ -0,0 +1,31 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Swap space.
+ *
+ * Pages evicted from memory are written to page-sized slots on a raw
+ * disk. Slots are allocated from a bitmap and reference counted, since
+ * fork can leave a swapped out page shared by parent and child.
+ *
+ * Pages that compress well are kept in a compressed cache in memory
+ * instead, and only reach their slot on disk once the cache needs the
+ * room (see zswap).
+ */
+
+#include <types.h>
+
+/* Raw device holding the swap space */
+#define SWAP_DEVICE "lhd1raw:"
+
+int swap_bootstrap(void);
+
+int swap_alloc(unsigned *slot);
+void swap_share(unsigned slot);
+void swap_free(unsigned slot);
+
+int swap_write(unsigned slot, paddr_t paddr);
+int swap_writeout(unsigned slot, paddr_t paddr);
+int swap_read(unsigned slot, paddr_t paddr, bool *disk);
+
+#endif /* _SWAP_H_ */
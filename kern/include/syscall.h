@@ -31,6 +31,7 @@
 #define _SYSCALL_H_
 
 #include "opt-A2.h"
+#include "opt-A3.h"
 
 struct trapframe; /* from <machine/trapframe.h> */
 
@@ -69,4 +70,23 @@ int sys_waitpid(pid_t pid, userptr_t status, int options, pid_t *retval);
 
 int sys_fork(struct trapframe *tf, pid_t *retval);
 
+#if OPT_A3
+void sys__exitsig(int sig);
+int sys_getrusage(int who, userptr_t usage);
+int sys_getrlimit(int resource, userptr_t rlp);
+int sys_setrlimit(int resource, const_userptr_t rlp);
+
+int sys_read(int fdesc, userptr_t ubuf, unsigned int nbytes, int *retval);
+int sys_open(userptr_t path, int flags, int *retval);
+int sys_close(int fdesc);
+int sys_fsync(int fdesc);
+
+int sys_sbrk(intptr_t amount, vaddr_t *retval);
+int sys_mmap(userptr_t addr, size_t len, int prot, int flags,
+	     userptr_t moreargs, vaddr_t *retval);
+int sys_munmap(userptr_t addr, size_t len);
+int sys_madvise(userptr_t addr, size_t len, int advice);
+int sys_mincore(userptr_t addr, size_t len, userptr_t vec);
+#endif
+
 #endif /* _SYSCALL_H_ */
@@ -36,7 +36,37 @@
 #define VMSTAT_ELF_FILE_READ          (7)
 #define VMSTAT_SWAP_FILE_READ         (8)
 #define VMSTAT_SWAP_FILE_WRITE        (9)
-#define VMSTAT_COUNT                 (10)
+#define VMSTAT_TLB_FLUSH_AVOIDED     (10)
+#define VMSTAT_ZERO_POOL_HIT         (11)
+#define VMSTAT_ZERO_POOL_MISS        (12)
+#define VMSTAT_TLB_SHOOTDOWN         (13)
+#define VMSTAT_TLB_SHOOTDOWN_INVAL   (14)
+#define VMSTAT_FAULTAROUND_PRELOAD   (15)
+#define VMSTAT_FAULTAROUND_USED      (16)
+#define VMSTAT_PAGE_PREFETCH         (17)
+#define VMSTAT_MERGE_SCANNED         (18)
+#define VMSTAT_MERGE_MERGED          (19)
+#define VMSTAT_MERGE_UNMERGED        (20)
+#define VMSTAT_ZSWAP_STORE           (21)
+#define VMSTAT_ZSWAP_BYTES           (22)
+#define VMSTAT_ZSWAP_HIT             (23)
+#define VMSTAT_ZSWAP_SPILL           (24)
+#define VMSTAT_ZSWAP_REJECT          (25)
+#define VMSTAT_RSS_RECLAIM           (26)
+#define VMSTAT_RSS_OVERLIMIT         (27)
+#define VMSTAT_PAGECACHE_UNMAP       (28)
+#define VMSTAT_COUNT                 (29)
+
+#include "opt-A3.h"
+
+#if OPT_A3
+/* Kinds of TLB fault with a latency histogram, see vmstats_time */
+#define VMHIST_RELOAD                 (0)
+#define VMHIST_ZERO                   (1)
+#define VMHIST_DISK                   (2)
+#define VMHIST_COUNT                  (3)
+#define VMHIST_NBUCKETS              (16)
+#endif
 
 /* ----------------------------------------------------------------------- */
 
@@ -55,4 +85,24 @@ void _vmstats_inc(unsigned int index);   /* atomicity must be ensured elsewhere
 /* Print the statistics: assumes that at least vmstats_init has been called */
 void vmstats_print(void);                    /* Does NOT use locking */
 
+#if OPT_A3
+/* Zero the statistics without reinitializing the lock, e.g. between runs */
+void vmstats_reset(void);                    /* Does NOT use locking */
+
+/* Add to the specified count, for counts that aren't of events
+ * Example use:
+ *   vmstats_add(VMSTAT_ZSWAP_BYTES, len);
+ */
+void vmstats_add(unsigned int index, unsigned int n); /* uses no lock */
+
+/* Record how many cycles a TLB fault of the given kind took
+ * Example use:
+ *   vmstats_time(VMHIST_DISK, cpu_cycles() - start);
+ */
+void vmstats_time(unsigned int kind, uint32_t cycles); /* uses no lock */
+
+/* Print the latency histograms, summed over all CPUs */
+void vmstats_printhist(void);                /* Does NOT use locking */
+#endif
+
 #endif /* VM_STATS_H */
@@ -38,6 +38,7 @@
 
 
 #include <machine/vm.h>
+#include "opt-A3.h"
 
 /* Fault-type arguments to vm_fault() */
 #define VM_FAULT_READ        0    /* A read was attempted */
@@ -59,5 +60,17 @@ void free_kpages(vaddr_t addr);
 void vm_tlbshootdown_all(void);
 void vm_tlbshootdown(const struct tlbshootdown *);
 
+#if OPT_A3
+struct addrspace;
+
+/* Drop every CPU's TLB entry for one user page */
+void vm_tlbinvalidate(struct addrspace *as, vaddr_t vaddr);
+
+/* Take a page cache frame out of the address spaces that map it */
+struct vnode;
+void vm_unmapcached(struct vnode *vn, off_t offset, paddr_t paddr,
+		    bool *dirty);
+#endif
+
 
 #endif /* _VM_H_ */
@@ -0,0 +1,36 @@
+#ifndef _VMTUNE_H_
+#define _VMTUNE_H_
+
+/*
+ * VM tunables.
+ *
+ * Knobs for comparing VM policies without rebuilding the kernel. Each is
+ * a plain int read by the VM code and can be changed at the kernel menu
+ * with "vmtune <name> <value>"; "vmtune" alone lists them.
+ */
+
+/* TLB replacement policy, see vm_fault */
+#define TLBPOLICY_RR   0 // round-robin victim pointer per cpu
+#define TLBPOLICY_NRU  1 // round-robin, skipping recently referenced pages
+extern int vm_tlbpolicy;
+
+/* Most free frames idle CPUs keep zeroed ahead of time, see coremap */
+extern int vm_zeropool;
+
+/* User stack growth, in pages, see as_define_stack */
+extern int vm_stackmax;   // limit for processes started from now on
+extern int vm_stackguard; // unmapped pages kept below the stack
+
+/* Most neighbouring pages a sequential TLB miss preloads, see vm_fault */
+extern int vm_faultaround;
+
+/* Pages the page merger looks at per second, see pagemerge */
+extern int vm_mergerate;
+
+/* Most pages of compressed data kept in memory in front of swap, see zswap */
+extern int vm_zswap;
+
+int vmtune_set(const char *name, int value);
+void vmtune_print(void);
+
+#endif /* _VMTUNE_H_ */
@@ -137,7 +137,9 @@ struct vnode {
  *
  *    vop_mmap        - Map file into memory. If you implement this
  *                      feature, you're responsible for choosing the
- *                      arguments for this operation.
+ *                      arguments for this operation. (With A3 this
+ *                      just says whether the file may be mapped; the
+ *                      VM system reads and writes its pages itself.)
  *
  *    vop_truncate    - Forcibly set size of file to the length passed
  *                      in, discarding any excess blocks.
@@ -34,6 +34,7 @@
  * Wait channel.
  */
 
+#include "opt-A3.h"
 
 struct wchan; /* Opaque */
 
@@ -49,6 +50,13 @@ struct wchan *wchan_create(const char *name);
  */
 void wchan_destroy(struct wchan *wc);
 
+#if OPT_A3
+/*
+ * Change the name given to wchan_create; the same rules apply to it.
+ */
+void wchan_setname(struct wchan *wc, const char *name);
+#endif
+
 /*
  * Return nonzero if there are no threads sleeping on the channel.
  * This is meant to be used only for diagnostic purposes.
@@ -0,0 +1,29 @@
+#ifndef _ZSWAP_H_
+#define _ZSWAP_H_
+
+/*
+ * Compressed swap cache.
+ *
+ * Pages on their way out to swap are first compressed into kernel memory,
+ * keyed by the swap slot they were given, so paging out and back in a
+ * page that compresses well costs part of a frame and no disk I/O. The
+ * pool holds at most vm_zswap pages' worth of compressed data; to make
+ * room, the least recently used page is spilled to its slot on disk,
+ * which swap_alloc set aside for it all along. Pages that don't compress
+ * to half a page are written straight to disk.
+ *
+ * The compressor is a greedy LZ77 with a one-entry hash table per bucket,
+ * writing the LZ4 block format: each sequence is a token byte holding the
+ * literal and match lengths, the literals, then a 16 bit offset back to
+ * the match; the last sequence is literals only.
+ */
+
+#include <types.h>
+
+int zswap_bootstrap(unsigned nslots);
+
+int zswap_store(unsigned slot, paddr_t paddr);
+int zswap_load(unsigned slot, paddr_t paddr);
+void zswap_drop(unsigned slot);
+
+#endif /* _ZSWAP_H_ */
@@ -52,6 +52,13 @@
 #include <kern/fcntl.h>
 #include <proc_table.h>
 #include "opt-A2.h"
+#include "opt-A3.h"
+
+#if OPT_A3
+#include <kern/time.h>
+#include <kern/resource.h>
+#include <kmem_cache.h>
+#endif
 
 /*
  * The process for the kernel; this holds all the kernel-only threads.
@@ -72,6 +79,37 @@ struct semaphore *no_proc_sem;
 #endif  // UW
 
 
+#if OPT_A3
+/*
+ * Procs come from an object cache; the thread array (with whatever
+ * space it has grown) and p_lock stay set up while cached.
+ */
+static
+int
+proc_ctor(void *obj)
+{
+	struct proc *proc = obj;
+
+	threadarray_init(&proc->p_threads);
+	spinlock_init(&proc->p_lock);
+	return 0;
+}
+
+static
+void
+proc_dtor(void *obj)
+{
+	struct proc *proc = obj;
+
+	threadarray_cleanup(&proc->p_threads);
+	spinlock_cleanup(&proc->p_lock);
+}
+
+static struct kmem_cache proc_cache =
+	KMEM_CACHE_INITIALIZER("proc", sizeof(struct proc), 0,
+			       proc_ctor, proc_dtor);
+#endif
+
 /*
  * Create a proc structure.
  */
@@ -80,19 +118,33 @@ struct proc *
 proc_create(const char *name)
 {
 	struct proc *proc;
+#if OPT_A3
+	int i;
+#endif
 
+#if OPT_A3
+	proc = kmem_cache_alloc(&proc_cache);
+#else
 	proc = kmalloc(sizeof(*proc));
+#endif
 	if (proc == NULL) {
 		return NULL;
 	}
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
+#if OPT_A3
+		kmem_cache_free(&proc_cache, proc);
+#else
 		kfree(proc);
+#endif
 		return NULL;
 	}
 
+#if !OPT_A3
+	/* (done once by proc_ctor) */
 	threadarray_init(&proc->p_threads);
 	spinlock_init(&proc->p_lock);
+#endif
 
 	/* VM fields */
 	proc->p_addrspace = NULL;
@@ -108,6 +160,18 @@ proc_create(const char *name)
 	proc->pid = 0;
 #endif
 
+#if OPT_A3
+	for (i = 0; i < OPEN_MAX; i++) {
+		proc->p_files[i] = NULL;
+		proc->p_fileflags[i] = 0;
+		proc->p_fileoffs[i] = 0;
+	}
+	bzero(&proc->p_usage, sizeof(proc->p_usage));
+	bzero(&proc->p_cusage, sizeof(proc->p_cusage));
+	proc->p_rsscur = RLIM_INFINITY;
+	proc->p_rssmax = RLIM_INFINITY;
+#endif
+
 	return proc;
 }
 
@@ -126,6 +190,10 @@ proc_destroy(struct proc *proc)
          * from the process.
 	 */
 
+#if OPT_A3
+	int i;
+#endif
+
 	KASSERT(proc != NULL);
 	KASSERT(proc != kproc);
 
@@ -168,11 +236,28 @@ proc_destroy(struct proc *proc)
 	}
 #endif // UW
 
+#if OPT_A3
+	for (i = 0; i < OPEN_MAX; i++) {
+		if (proc->p_files[i] != NULL) {
+			vfs_close(proc->p_files[i]);
+		}
+	}
+#endif
+
+#if OPT_A3
+	/* Left set up for the next proc; proc_dtor cleans them up */
+	KASSERT(threadarray_num(&proc->p_threads) == 0);
+	KASSERT(proc->p_lock.lk_holder == NULL);
+
+	kfree(proc->p_name);
+	kmem_cache_free(&proc_cache, proc);
+#else
 	threadarray_cleanup(&proc->p_threads);
 	spinlock_cleanup(&proc->p_lock);
 
 	kfree(proc->p_name);
 	kfree(proc);
+#endif
 
 #ifdef UW
 	/* decrement the process count */
@@ -389,3 +474,50 @@ curproc_setas(struct addrspace *newas)
 	spinlock_release(&proc->p_lock);
 	return oldas;
 }
+
+#if OPT_A3
+/*
+ * Charge a clock tick to the current process, if it is a user process,
+ * as time in user mode if USER and in the kernel otherwise. Called from
+ * the timer interrupt, which can only have interrupted this process's own
+ * thread, so the counters need no lock; that thread cannot be halfway
+ * through changing p_addrspace either, as it holds p_lock to do that.
+ */
+void
+proc_chargetick(bool user)
+{
+	struct proc *proc = curthread->t_proc;
+
+	if (proc == NULL || proc == kproc) {
+		return;
+	}
+
+	if (user) {
+		proc->p_usage.pu_uticks++;
+	}
+	else {
+		proc->p_usage.pu_sticks++;
+	}
+	if (proc->p_addrspace != NULL) {
+		proc->p_usage.pu_rssticks += proc->p_addrspace->as_rss;
+	}
+}
+
+/*
+ * Add the usage in FROM to TO. Peaks don't add up; TO keeps the larger.
+ */
+void
+proc_usage_add(struct proc_usage *to, const struct proc_usage *from)
+{
+	to->pu_uticks += from->pu_uticks;
+	to->pu_sticks += from->pu_sticks;
+	to->pu_rssticks += from->pu_rssticks;
+	if (from->pu_maxrss > to->pu_maxrss) {
+		to->pu_maxrss = from->pu_maxrss;
+	}
+	to->pu_minflt += from->pu_minflt;
+	to->pu_majflt += from->pu_majflt;
+	to->pu_nvcsw += from->pu_nvcsw;
+	to->pu_nivcsw += from->pu_nivcsw;
+}
+#endif
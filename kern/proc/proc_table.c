@@ -7,6 +7,11 @@
 #include <proc_table.h>
 #include "array.h"
 #include "opt-A2.h"
+#include "opt-A3.h"
+
+#if OPT_A3
+#include <kmem_cache.h>
+#endif
 
 static struct array *proc_table; // Key: pid, Val: proc
 static struct lock *proc_table_lock;
@@ -14,6 +19,15 @@ static struct lock *proc_table_lock;
 // Helper functions
 int entry_create(struct proc_table_entry **retval);
 void entry_destroy(struct proc_table_entry *entry);
+#if OPT_A3
+static int entry_ctor(void *obj);
+static void entry_dtor(void *obj);
+
+// Entries keep their cv and children array while cached
+static struct kmem_cache entry_cache =
+  KMEM_CACHE_INITIALIZER("proc_table_entry", sizeof(struct proc_table_entry),
+                         0, entry_ctor, entry_dtor);
+#endif
 
 /**
  * adds the given process to process table
@@ -202,7 +216,7 @@ void proc_table_init(void) {
   }
 
   // Add kernel proc
-  struct proc_table_entry *entry;
+  struct proc_table_entry *entry = NULL;
   int x = entry_create(&entry);
   if (x) panic("entry_create for proc_table_init failed\n");
   entry->proc = kproc;
@@ -245,7 +259,11 @@ int entry_create(struct proc_table_entry **retval) {
 
   struct proc_table_entry *entry;
 
+#if OPT_A3
+  entry = kmem_cache_alloc(&entry_cache);
+#else
   entry = kmalloc(sizeof(*entry));
+#endif
   if (entry == NULL) return ENOMEM;
 
   entry->proc = NULL;
@@ -253,7 +271,11 @@ int entry_create(struct proc_table_entry **retval) {
   entry->numref = 0;
   entry->isdead = false;
   entry->exitcode = 0;
-
+#if OPT_A3
+  entry->exitsig = 0;
+  bzero(&entry->usage, sizeof(entry->usage));
+  entry->parent = NULL;
+#else
   entry->exitcode_cv = cv_create("proc_table_entry_cv");
   if (entry->exitcode_cv == NULL) {
     kfree(entry);
@@ -268,6 +290,7 @@ int entry_create(struct proc_table_entry **retval) {
     kfree(entry);
     return ENOMEM;
   }
+#endif
 
   *retval = entry;
   return 0; // Success
@@ -279,12 +302,52 @@ int entry_create(struct proc_table_entry **retval) {
  */
 void entry_destroy(struct proc_table_entry *entry) {
   if (entry != NULL) {
+#if !OPT_A3
     cv_destroy((struct cv*)entry->exitcode_cv);
+#endif
     unsigned size = array_num((struct array*)entry->children);
     for (unsigned i = 0; i < size; i++) {
       array_remove((struct array*)entry->children, 0);
     }
+#if OPT_A3
+    // The cv and the now empty array go back with it
+    kmem_cache_free(&entry_cache, entry);
+#else
     array_destroy((struct array*)entry->children);
     kfree(entry);
+#endif
+  }
+}
+
+#if OPT_A3
+/**
+ * object cache constructor: gives an entry its cv and children array
+ * @param  obj entry
+ * @return     0 on success, ENOMEM otherwise
+ */
+static int entry_ctor(void *obj) {
+  struct proc_table_entry *entry = obj;
+
+  entry->exitcode_cv = cv_create("proc_table_entry_cv");
+  if (entry->exitcode_cv == NULL) {
+    return ENOMEM;
+  }
+  entry->children = array_create();
+  if (entry->children == NULL) {
+    cv_destroy((struct cv*)entry->exitcode_cv);
+    return ENOMEM;
   }
+  return 0; // Success
+}
+
+/**
+ * object cache destructor
+ * @param obj entry
+ */
+static void entry_dtor(void *obj) {
+  struct proc_table_entry *entry = obj;
+
+  cv_destroy((struct cv*)entry->exitcode_cv);
+  array_destroy((struct array*)entry->children);
 }
+#endif
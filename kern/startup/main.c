@@ -50,6 +50,12 @@
 #include <test.h>
 #include <version.h>
 #include "autoconf.h"  // for pseudoconfig
+#include "opt-A3.h"
+
+#if OPT_A3
+#include <uw-vmstats.h>
+#include <pagecache.h>
+#endif
 
 
 /*
@@ -147,6 +153,13 @@ shutdown(void)
 
 	kprintf("Shutting down.\n");
 
+#if OPT_A3
+	vmstats_print();
+
+	/* Write back mapped file pages and let go of their vnodes */
+	pagecache_purge();
+#endif
+
 	vfs_clearbootfs();
 	vfs_clearcurdir();
 	vfs_unmountall();
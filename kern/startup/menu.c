@@ -45,6 +45,13 @@
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-A3.h"
+
+#if OPT_A3
+#include <vmtune.h>
+#include <uw-vmstats.h>
+#include <kmem_cache.h>
+#endif
 
 /*
  * In-kernel menu and command dispatcher.
@@ -392,10 +399,56 @@ cmd_kheapstats(int nargs, char **args)
 	(void)args;
 
 	kheap_printstats();
+#if OPT_A3
+	kmem_cache_printstats();
+#endif
 
 	return 0;
 }
 
+#if OPT_A3
+/*
+ * Command for viewing and changing VM tunables.
+ */
+static
+int
+cmd_vmtune(int nargs, char **args)
+{
+	if (nargs == 1) {
+		vmtune_print();
+		return 0;
+	}
+	if (nargs != 3) {
+		kprintf("Usage: vmtune [name value]\n");
+		return EINVAL;
+	}
+
+	return vmtune_set(args[1], atoi(args[2]));
+}
+
+/*
+ * Command for printing the VM statistics and fault latencies, or
+ * clearing them between runs.
+ */
+static
+int
+cmd_vmstats(int nargs, char **args)
+{
+	if (nargs == 2 && !strcmp(args[1], "reset")) {
+		vmstats_reset();
+		return 0;
+	}
+	if (nargs != 1) {
+		kprintf("Usage: vmstats [reset]\n");
+		return EINVAL;
+	}
+
+	vmstats_print();
+	vmstats_printhist();
+	return 0;
+}
+#endif
+
 /*
  * Command for enabling threads debugging messages
  */
@@ -452,6 +505,10 @@ static const char *opsmenu[] = {
 	"[sync]    Sync filesystems          ",
 	"[panic]   Intentional panic         ",
 	"[q]       Quit and shut down        ",
+#if OPT_A3
+	"[vmtune]  View/set VM tunables      ",
+	"[vmstats] View/reset VM statistics  ",
+#endif
 	NULL
 };
 
@@ -565,6 +622,10 @@ static struct {
 	{ "exit",	cmd_quit },
 	{ "halt",	cmd_quit },
 	{ "dth", cmd_dbthreads },
+#if OPT_A3
+	{ "vmtune",	cmd_vmtune },
+	{ "vmstats",	cmd_vmstats },
+#endif
 
 #if OPT_SYNCHPROBS
 	/* in-kernel synchronization problem(s) */
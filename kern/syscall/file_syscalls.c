@@ -1,6 +1,8 @@
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/fcntl.h>
 #include <kern/unistd.h>
+#include <limits.h>
 #include <lib.h>
 #include <uio.h>
 #include <syscall.h>
@@ -8,16 +10,87 @@
 #include <vfs.h>
 #include <current.h>
 #include <proc.h>
+#include <copyinout.h>
+#include "opt-A3.h"
+#if OPT_A3
+#include <kern/stat.h>
+#include <addrspace.h>
+#include <pagecache.h>
+#endif
+
+#if OPT_A3
+/*
+ * Reads or writes a file opened with open(), at the descriptor's offset,
+ * and moves the offset past what was transferred.
+ *
+ * n.b.
+ * This goes straight to the file system, not through the page cache:
+ * stores made through a shared mmap() show up once fsync() or munmap()
+ * has written them back, and pages already cached for a mapping do not
+ * see a later write().
+ */
+static
+int
+file_rw(int fdesc, userptr_t ubuf, unsigned int nbytes, enum uio_rw rw,
+        int *retval)
+{
+  struct proc *p = curproc;
+  struct iovec iov;
+  struct uio u;
+  struct stat st;
+  int how, res;
+
+  if (fdesc < 0 || fdesc >= OPEN_MAX || p->p_files[fdesc] == NULL) {
+    return EBADF;
+  }
+  how = p->p_fileflags[fdesc] & O_ACCMODE;
+  if ((rw == UIO_READ && how == O_WRONLY) ||
+      (rw == UIO_WRITE && how == O_RDONLY)) {
+    return EBADF;
+  }
+
+  if (rw == UIO_WRITE && (p->p_fileflags[fdesc] & O_APPEND)) {
+    res = VOP_STAT(p->p_files[fdesc], &st);
+    if (res) {
+      return res;
+    }
+    p->p_fileoffs[fdesc] = st.st_size;
+  }
+
+  iov.iov_ubase = ubuf;
+  iov.iov_len = nbytes;
+  u.uio_iov = &iov;
+  u.uio_iovcnt = 1;
+  u.uio_offset = p->p_fileoffs[fdesc];
+  u.uio_resid = nbytes;
+  u.uio_segflg = UIO_USERSPACE;
+  u.uio_rw = rw;
+  u.uio_space = p->p_addrspace;
+
+  if (rw == UIO_READ) {
+    res = VOP_READ(p->p_files[fdesc], &u);
+  }
+  else {
+    res = VOP_WRITE(p->p_files[fdesc], &u);
+  }
+  if (res) {
+    return res;
+  }
+
+  p->p_fileoffs[fdesc] = u.uio_offset;
+  *retval = nbytes - u.uio_resid;
+  KASSERT(*retval >= 0);
+  return 0;
+}
+#endif
 
 /* handler for write() system call                  */
 /*
  * n.b.
- * This implementation handles only writes to standard output 
- * and standard error, both of which go to the console.
+ * Writes to standard output and standard error go to the console;
+ * other descriptors must come from open().
  * Also, it does not provide any synchronization, so writes
  * are not atomic.
- *
- * You will need to improve this implementation
  */
 
 int
@@ -29,9 +102,13 @@ sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval)
 
   DEBUG(DB_SYSCALL,"Syscall: write(%d,%x,%d)\n",fdesc,(unsigned int)ubuf,nbytes);
   
-  /* only stdout and stderr writes are currently implemented */
+  /* only stdout and stderr go to the console */
   if (!((fdesc==STDOUT_FILENO)||(fdesc==STDERR_FILENO))) {
+#if OPT_A3
+    return file_rw(fdesc, ubuf, nbytes, UIO_WRITE, retval);
+#else
     return EUNIMP;
+#endif
   }
   KASSERT(curproc != NULL);
   KASSERT(curproc->console != NULL);
@@ -58,3 +135,116 @@ sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval)
   KASSERT(*retval >= 0);
   return 0;
 }
+
+#if OPT_A3
+/* handler for read() system call                   */
+/*
+ * n.b.
+ * Standard input reads from the console; other descriptors must
+ * come from open().
+ */
+int
+sys_read(int fdesc, userptr_t ubuf, unsigned int nbytes, int *retval)
+{
+  struct iovec iov;
+  struct uio u;
+  int res;
+
+  DEBUG(DB_SYSCALL,"Syscall: read(%d,%x,%d)\n",fdesc,(unsigned int)ubuf,nbytes);
+
+  if (fdesc != STDIN_FILENO) {
+    return file_rw(fdesc, ubuf, nbytes, UIO_READ, retval);
+  }
+  KASSERT(curproc->console != NULL);
+
+  iov.iov_ubase = ubuf;
+  iov.iov_len = nbytes;
+  u.uio_iov = &iov;
+  u.uio_iovcnt = 1;
+  u.uio_offset = 0;  /* not needed for the console */
+  u.uio_resid = nbytes;
+  u.uio_segflg = UIO_USERSPACE;
+  u.uio_rw = UIO_READ;
+  u.uio_space = curproc->p_addrspace;
+
+  res = VOP_READ(curproc->console, &u);
+  if (res) {
+    return res;
+  }
+  *retval = nbytes - u.uio_resid;
+  KASSERT(*retval >= 0);
+  return 0;
+}
+
+/* handler for open() system call                   */
+int
+sys_open(userptr_t upath, int flags, int *retval)
+{
+  char path[PATH_MAX];
+  struct vnode *vn;
+  int fd, res;
+
+  res = copyinstr(upath, path, sizeof(path), NULL);
+  if (res) {
+    return res;
+  }
+
+  /* the console keeps descriptors 0 to 2 */
+  for (fd = STDERR_FILENO + 1; fd < OPEN_MAX; fd++) {
+    if (curproc->p_files[fd] == NULL) {
+      break;
+    }
+  }
+  if (fd == OPEN_MAX) {
+    return EMFILE;
+  }
+
+  res = vfs_open(path, flags, 0, &vn);
+  if (res) {
+    return res;
+  }
+  curproc->p_files[fd] = vn;
+  curproc->p_fileflags[fd] = flags;
+  curproc->p_fileoffs[fd] = 0;
+  *retval = fd;
+  return 0;
+}
+
+/* handler for close() system call                  */
+int
+sys_close(int fdesc)
+{
+  if (fdesc < 0 || fdesc >= OPEN_MAX || curproc->p_files[fdesc] == NULL) {
+    return EBADF;
+  }
+  /* mappings keep their own reference to the file */
+  vfs_close(curproc->p_files[fdesc]);
+  curproc->p_files[fdesc] = NULL;
+  curproc->p_fileflags[fdesc] = 0;
+  return 0;
+}
+
+/* handler for fsync() system call                  */
+/*
+ * Writes back pages of the file that were written through mmap(), then
+ * asks the file system to do the same for its own buffers.
+ */
+int
+sys_fsync(int fdesc)
+{
+  struct vnode *vn;
+  int res;
+
+  if (fdesc < 0 || fdesc >= OPEN_MAX || curproc->p_files[fdesc] == NULL) {
+    return EBADF;
+  }
+  vn = curproc->p_files[fdesc];
+
+  as_syncfile(curproc_getas(), vn);
+  res = pagecache_flush(vn);
+  if (res) {
+    return res;
+  }
+  return VOP_FSYNC(vn);
+}
+#endif
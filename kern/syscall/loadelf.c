@@ -59,6 +59,11 @@
 #include <addrspace.h>
 #include <vnode.h>
 #include <elf.h>
+#include "opt-A3.h"
+
+#if OPT_A3
+#include <kern/stat.h>
+#endif
 
 /*
  * Load a segment at virtual address VADDR. The segment in memory
@@ -74,6 +79,7 @@
  * change this code to not use uiomove, be sure to check for this case
  * explicitly.
  */
+#if !OPT_A3
 static
 int
 load_segment(struct addrspace *as, struct vnode *v,
@@ -144,6 +150,7 @@ load_segment(struct addrspace *as, struct vnode *v,
 	
 	return result;
 }
+#endif /* !OPT_A3 */
 
 /*
  * Load an ELF executable user program into the current address space.
@@ -159,9 +166,20 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 	struct iovec iov;
 	struct uio ku;
 	struct addrspace *as;
+#if OPT_A3
+	struct stat st;
+#endif
 
 	as = curproc_getas();
 
+#if OPT_A3
+	/* Segments are paged in later, so check them against the file now */
+	result = VOP_STAT(v, &st);
+	if (result) {
+		return result;
+	}
+#endif
+
 	/*
 	 * Read the executable header from offset 0 in the file.
 	 */
@@ -288,9 +306,31 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return ENOEXEC;
 		}
 
+#if OPT_A3
+		/*
+		 * Don't read anything yet; just tell the address space
+		 * where the segment's contents are and let vm_fault
+		 * bring pages in as they are touched.
+		 */
+		if (ph.p_filesz > ph.p_memsz) {
+			kprintf("ELF: warning: segment filesize > segment memsize\n");
+			ph.p_filesz = ph.p_memsz;
+		}
+		if (ph.p_offset + ph.p_filesz > st.st_size) {
+			kprintf("ELF: segment past end of file - file truncated?\n");
+			return ENOEXEC;
+		}
+		if (ph.p_filesz == 0) {
+			continue;
+		}
+
+		result = as_define_backing(as, v, ph.p_offset, ph.p_vaddr,
+					   ph.p_filesz);
+#else
 		result = load_segment(as, v, ph.p_offset, ph.p_vaddr, 
 				      ph.p_memsz, ph.p_filesz,
 				      ph.p_flags & PF_X);
+#endif
 		if (result) {
 			return result;
 		}
@@ -8,11 +8,19 @@
 #include <proc.h>
 #include <thread.h>
 #include <addrspace.h>
+#include <vnode.h>
 #include <copyinout.h>
 #include <proc_table.h>
 #include <machine/trapframe.h>
 #include "array.h"
 #include "opt-A2.h"
+#include "opt-A3.h"
+
+#if OPT_A3
+#include <kern/time.h>
+#include <kern/resource.h>
+#include <clock.h>
+#endif
 
 #if OPT_A2
 int
@@ -29,14 +37,10 @@ sys_fork(struct trapframe *tf,
   if (child == NULL) return ENOMEM;
 
   // Create and copy address space (and data) from parent to child
-  struct addrspace *c_as = as_create();
-  if (c_as == NULL) {
-    proc_destroy(child);
-    return ENOMEM;
-  }
+  // (as_copy creates the new address space itself and cleans up on failure)
+  struct addrspace *c_as;
   int x = as_copy(parent->p_addrspace, &c_as);
   if (x) {
-    as_destroy(c_as);
     proc_destroy(child);
     return x;
   }
@@ -44,6 +48,20 @@ sys_fork(struct trapframe *tf,
   // Attach the newly created address space to the child process structure
   child->p_addrspace = c_as;
 
+#if OPT_A3
+  // The child shares the parent's open files
+  for (int i = 0; i < OPEN_MAX; i++) {
+    if (parent->p_files[i] != NULL) {
+      VOP_INCREF(parent->p_files[i]);
+      child->p_files[i] = parent->p_files[i];
+      child->p_fileflags[i] = parent->p_fileflags[i];
+      child->p_fileoffs[i] = parent->p_fileoffs[i];
+    }
+  }
+  child->p_rsscur = parent->p_rsscur;
+  child->p_rssmax = parent->p_rssmax;
+#endif
+
   // Create the parent/child relationship
   proc_table_lock_acquire();
 
@@ -147,6 +165,11 @@ void sys__exit(int exitcode) {
   // Self update
   entry->isdead = true;
   entry->exitcode = exitcode;
+#if OPT_A3
+  // What our parent adds to its children's usage when it reaps us
+  entry->usage = p->p_usage;
+  proc_usage_add(&entry->usage, &p->p_cusage);
+#endif
   proc_table_broadcastfor(p->pid);
   // Check cleanup
   if (entry->numref == 0) {
@@ -205,6 +228,117 @@ void sys__exit(int exitcode) {
 #endif
 }
 
+#if OPT_A3
+/**
+ * ends the current process after a fatal trap, so that waitpid reports it
+ * as killed by a signal rather than exited
+ * @param sig signal the trap corresponds to
+ */
+void sys__exitsig(int sig) {
+  struct proc_table_entry *entry;
+
+    KASSERT(sig != 0);
+
+  proc_table_lock_acquire();
+  proc_table_get(curproc->pid, &entry);
+    KASSERT(entry != NULL);
+  entry->exitsig = sig;
+  proc_table_lock_release();
+
+  sys__exit(0);
+}
+#endif
+
+#if OPT_A3
+/**
+ * reports the resource usage of the calling process or of its children
+ * @param  who   RUSAGE_SELF, or RUSAGE_CHILDREN for every child reaped by
+ *               waitpid (and the children those reaped, and so on)
+ * @param  usage user destination for the struct rusage
+ * @return       0 on success, EINVAL for a bad who, EFAULT for a bad usage
+ */
+int sys_getrusage(int who, userptr_t usage) {
+  struct proc_usage *pu;
+  struct rusage ru;
+
+  switch (who) {
+    case RUSAGE_SELF:
+      pu = &curproc->p_usage;
+      break;
+    case RUSAGE_CHILDREN:
+      pu = &curproc->p_cusage;
+      break;
+    default:
+      return EINVAL;
+  }
+
+  bzero(&ru, sizeof(ru));
+  ru.ru_utime.tv_sec = pu->pu_uticks / HZ;
+  ru.ru_utime.tv_usec = (pu->pu_uticks % HZ) * (1000000 / HZ);
+  ru.ru_stime.tv_sec = pu->pu_sticks / HZ;
+  ru.ru_stime.tv_usec = (pu->pu_sticks % HZ) * (1000000 / HZ);
+  ru.ru_maxrss = pu->pu_maxrss * (PAGE_SIZE / 1024);
+  ru.ru_idrss = (__counter_t)pu->pu_rssticks * (PAGE_SIZE / 1024);
+  ru.ru_minflt = pu->pu_minflt;
+  ru.ru_majflt = pu->pu_majflt;
+  ru.ru_nvcsw = pu->pu_nvcsw;
+  ru.ru_nivcsw = pu->pu_nivcsw;
+
+  return copyout(&ru, usage, sizeof(ru));
+}
+
+/**
+ * reports a resource limit of the calling process; only RLIMIT_RSS is
+ * supported
+ * @param  resource RLIMIT_RSS
+ * @param  rlp      user destination for the struct rlimit
+ * @return          0 on success, EINVAL for another resource, EFAULT for
+ *                  a bad rlp
+ */
+int sys_getrlimit(int resource, userptr_t rlp) {
+  struct rlimit rl;
+
+  if (resource != RLIMIT_RSS) {
+    return EINVAL;
+  }
+  rl.rlim_cur = curproc->p_rsscur;
+  rl.rlim_max = curproc->p_rssmax;
+  return copyout(&rl, rlp, sizeof(rl));
+}
+
+/**
+ * changes a resource limit of the calling process; only RLIMIT_RSS is
+ * supported. A lower soft limit takes effect at the next page fault
+ * @param  resource RLIMIT_RSS
+ * @param  rlp      user pointer to the new struct rlimit
+ * @return          0 on success, EINVAL for another resource or a soft
+ *                  limit above the hard one, EPERM to raise the hard
+ *                  limit, EFAULT for a bad rlp
+ */
+int sys_setrlimit(int resource, const_userptr_t rlp) {
+  struct rlimit rl;
+  int result;
+
+  if (resource != RLIMIT_RSS) {
+    return EINVAL;
+  }
+  result = copyin(rlp, &rl, sizeof(rl));
+  if (result) {
+    return result;
+  }
+  if (rl.rlim_cur > rl.rlim_max) {
+    return EINVAL;
+  }
+  // There are no privileged users to raise it again
+  if (rl.rlim_max > curproc->p_rssmax) {
+    return EPERM;
+  }
+  curproc->p_rsscur = rl.rlim_cur;
+  curproc->p_rssmax = rl.rlim_max;
+  return 0; // Success
+}
+#endif
+
 
 /* stub handler for getpid() system call                */
 int
@@ -267,7 +401,18 @@ sys_waitpid(pid_t pid,
   }
 
   // encode and set status
+#if OPT_A3
+  proc_usage_add(&curproc->p_cusage, &ce->usage);
+
+  if (ce->exitsig != 0) {
+    exitstatus = _MKWAIT_SIG(ce->exitsig);
+  }
+  else {
+    exitstatus = _MKWAIT_EXIT(ce->exitcode);
+  }
+#else
   exitstatus = _MKWAIT_EXIT(ce->exitcode);
+#endif
 
   proc_table_lock_release();
 
@@ -0,0 +1,154 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/mman.h>
+#include <limits.h>
+#include <lib.h>
+#include <syscall.h>
+#include <current.h>
+#include <proc.h>
+#include <vnode.h>
+#include <copyinout.h>
+#include <addrspace.h>
+
+#define MINCORE_CHUNK 128 // pages sys_mincore looks up per as_lock hold
+
+/**
+ * moves the end of the calling process's heap
+ * @param  amount bytes to grow the heap by, negative to shrink it
+ * @param  retval destination for the old break
+ * @return        0 on success, EINVAL if the heap would shrink below its
+ *                start, ENOMEM if it would run into the stack
+ */
+int sys_sbrk(intptr_t amount, vaddr_t *retval) {
+  struct addrspace *as = curproc_getas();
+
+    KASSERT(as != NULL);
+
+  return as_sbrk(as, amount, retval);
+}
+
+/**
+ * maps part of an open file into the calling process
+ * @param  addr     placement hint, ignored
+ * @param  len      bytes to map
+ * @param  prot     PROT_ flags
+ * @param  flags    MAP_SHARED or MAP_PRIVATE
+ * @param  moreargs user stack holding the file descriptor and, 64-bit
+ *                  aligned after it, the page aligned file offset
+ * @param  retval   destination for the address of the mapping
+ * @return          0 on success, EBADF for a bad descriptor, EACCES for a
+ *                  shared writable mapping of a file not opened for
+ *                  writing, ENODEV if the file can't be mapped, EINVAL for
+ *                  bad arguments, ENOMEM if there is no room
+ */
+int sys_mmap(userptr_t addr, size_t len, int prot, int flags,
+             userptr_t moreargs, vaddr_t *retval) {
+  struct proc *p = curproc;
+  struct vnode *vn;
+  off_t offset;
+  int fd, result;
+
+  (void)addr;
+
+  result = copyin(moreargs, &fd, sizeof(fd));
+  if (result) {
+    return result;
+  }
+  result = copyin((userptr_t)((vaddr_t)moreargs + 8), &offset,
+                  sizeof(offset));
+  if (result) {
+    return result;
+  }
+
+  if (fd < 0 || fd >= OPEN_MAX || p->p_files[fd] == NULL) {
+    return EBADF;
+  }
+  vn = p->p_files[fd];
+
+  if (len == 0 || offset < 0 || (offset & ~(off_t)PAGE_FRAME) != 0) {
+    return EINVAL;
+  }
+  if (flags != MAP_SHARED && flags != MAP_PRIVATE) {
+    return EINVAL;
+  }
+  if ((p->p_fileflags[fd] & O_ACCMODE) == O_WRONLY) {
+    return EACCES;
+  }
+  if (flags == MAP_SHARED && (prot & PROT_WRITE) &&
+      (p->p_fileflags[fd] & O_ACCMODE) != O_RDWR) {
+    return EACCES;
+  }
+
+  // Ask the file system whether this kind of file can be mapped at all
+  result = VOP_MMAP(vn);
+  if (result) {
+    return (result == EUNIMP || result == EISDIR) ? ENODEV : result;
+  }
+
+  return as_mmap(p->p_addrspace, vn, offset, len, prot,
+                 flags == MAP_SHARED, retval);
+}
+
+/**
+ * removes a mapping made by mmap, writing back what it dirtied
+ * @param  addr address returned by mmap
+ * @param  len  length given to mmap
+ * @return      0 on success, EINVAL if that is not exactly one mapping
+ */
+int sys_munmap(userptr_t addr, size_t len) {
+  return as_munmap(curproc_getas(), (vaddr_t)addr, len);
+}
+
+/**
+ * takes advice about how the calling process will use a range of memory
+ * @param  addr   page aligned start of the range
+ * @param  len    bytes in the range
+ * @param  advice one MADV_ value
+ * @return        0 on success, EINVAL for an unaligned address or unknown
+ *                advice, ENOMEM if part of the range is not mapped
+ */
+int sys_madvise(userptr_t addr, size_t len, int advice) {
+  return as_madvise(curproc_getas(), (vaddr_t)addr, len, advice);
+}
+
+/**
+ * reports which pages of a range of the calling process are resident
+ * @param  addr page aligned start of the range
+ * @param  len  bytes in the range
+ * @param  vec  user array getting one byte per page, 1 if resident
+ * @return      0 on success, EINVAL for an unaligned address, ENOMEM if
+ *              part of the range is not mapped, EFAULT for a bad vec
+ */
+int sys_mincore(userptr_t addr, size_t len, userptr_t vec) {
+  struct addrspace *as = curproc_getas();
+  unsigned char buf[MINCORE_CHUNK];
+  vaddr_t vaddr = (vaddr_t)addr;
+  size_t npages, n;
+  int result;
+
+  if ((vaddr & ~(vaddr_t)PAGE_FRAME) != 0) {
+    return EINVAL;
+  }
+  if (len > USERSPACETOP) {
+    return ENOMEM;
+  }
+
+  // A chunk at a time, so vec can be copied out without holding as_lock
+  npages = ROUNDUP(len, PAGE_SIZE) / PAGE_SIZE;
+  while (npages > 0) {
+    n = (npages < MINCORE_CHUNK) ? npages : MINCORE_CHUNK;
+    result = as_mincore(as, vaddr, n, buf);
+    if (result) {
+      return result;
+    }
+    result = copyout(buf, vec, n);
+    if (result) {
+      return result;
+    }
+    vaddr += n * PAGE_SIZE;
+    vec = (userptr_t)((vaddr_t)vec + n);
+    npages -= n;
+  }
+  return 0; // Success
+}
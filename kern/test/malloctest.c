@@ -35,6 +35,13 @@
 #include <thread.h>
 #include <synch.h>
 #include <test.h>
+#include "opt-A3.h"
+
+#if OPT_A3
+#include <kern/errno.h>
+#include <spl.h>
+#include <cpu.h>
+#endif
 
 /*
  * Test kmalloc; allocate ITEMSIZE bytes NTRIES times, freeing
@@ -45,11 +52,18 @@
  *
  * mallocstress does the same thing, but from NTHREADS different
  * threads at once.
+ *
+ * "km2 -t" is a benchmark instead: each thread keeps its last NHELD
+ * items, so the heap spans a few hundred pages, and times every kfree.
+ * "km2 -t map" makes kfree skip the per-CPU magazines and "km2 -t walk"
+ * makes it find pages the old way, by walking the whole heap, so the
+ * three can be compared.
  */
 
 #define NTRIES   1200
 #define ITEMSIZE  997
 #define NTHREADS  8
+#define NHELD     128
 
 static
 void
@@ -90,6 +104,48 @@ mallocthread(void *sm, unsigned long num)
 	}
 }
 
+#if OPT_A3
+static uint64_t freecycles[NTHREADS];
+static unsigned nfrees[NTHREADS];
+static void *held[NTHREADS][NHELD];	/* too big for a thread's stack */
+
+static
+void
+mallocbenchthread(void *sm, unsigned long num)
+{
+	struct semaphore *sem = sm;
+	void **mine = held[num];
+	uint32_t start;
+	int i, spl;
+
+	for (i=0; i<NHELD; i++) {
+		mine[i] = NULL;
+	}
+
+	for (i=0; i<NTRIES; i++) {
+		if (mine[i % NHELD] != NULL) {
+			/* Stay on one CPU so the cycle counts are comparable */
+			spl = splhigh();
+			start = cpu_cycles();
+			kfree(mine[i % NHELD]);
+			freecycles[num] += cpu_cycles() - start;
+			splx(spl);
+			nfrees[num]++;
+		}
+		mine[i % NHELD] = kmalloc(ITEMSIZE);
+		if (mine[i % NHELD] == NULL) {
+			kprintf("thread %lu: kmalloc returned NULL\n", num);
+			break;
+		}
+	}
+
+	for (i=0; i<NHELD; i++) {
+		kfree(mine[i]);
+	}
+	V(sem);
+}
+#endif
+
 int
 malloctest(int nargs, char **args)
 {
@@ -108,9 +164,32 @@ mallocstress(int nargs, char **args)
 {
 	struct semaphore *sem;
 	int i, result;
-
+#if OPT_A3
+	bool bench;
+	uint64_t cycles;
+	unsigned n;
+
+	bench = nargs > 1 && !strcmp(args[1], "-t");
+	if (bench && nargs > 2) {
+		if (!strcmp(args[2], "map")) {
+			kfree_path = KFREE_MAP;
+		}
+		else if (!strcmp(args[2], "walk")) {
+			kfree_path = KFREE_WALK;
+		}
+		else {
+			kprintf("Usage: km2 [-t [map|walk]]\n");
+			return EINVAL;
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		freecycles[i] = 0;
+		nfrees[i] = 0;
+	}
+#else
 	(void)nargs;
 	(void)args;
+#endif
 
 	sem = sem_create("mallocstress", 0);
 	if (sem == NULL) {
@@ -120,8 +199,14 @@ mallocstress(int nargs, char **args)
 	kprintf("Starting kmalloc stress test...\n");
 
 	for (i=0; i<NTHREADS; i++) {
+#if OPT_A3
+		result = thread_fork("mallocstress", NULL,
+				     bench ? mallocbenchthread : mallocthread,
+				     sem, i);
+#else
 		result = thread_fork("mallocstress", NULL,
 				     mallocthread, sem, i);
+#endif
 		if (result) {
 			panic("mallocstress: thread_fork failed: %s\n",
 			      strerror(result));
@@ -135,5 +220,21 @@ mallocstress(int nargs, char **args)
 	sem_destroy(sem);
 	kprintf("kmalloc stress test done\n");
 
+#if OPT_A3
+	if (bench) {
+		cycles = 0;
+		n = 0;
+		for (i=0; i<NTHREADS; i++) {
+			cycles += freecycles[i];
+			n += nfrees[i];
+		}
+		if (n > 0) {
+			kprintf("%u kfrees, %u cycles each on average\n",
+				n, (unsigned)(cycles / n));
+		}
+		kfree_path = KFREE_MAG;
+	}
+#endif
+
 	return 0;
 }
@@ -33,12 +33,33 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <spinlock.h>
 #include <wchan.h>
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include "opt-A3.h"
+
+#if OPT_A3
+#include <kmem_cache.h>
+
+/*
+ * Locks and CVs come from object caches, each keeping its wait channel
+ * (and spinlock) while cached; only the name changes.
+ */
+static int lock_ctor(void *obj);
+static void lock_dtor(void *obj);
+static int cv_ctor(void *obj);
+static void cv_dtor(void *obj);
+
+static struct kmem_cache lock_cache =
+	KMEM_CACHE_INITIALIZER("lock", sizeof(struct lock), 0,
+			       lock_ctor, lock_dtor);
+static struct kmem_cache cv_cache =
+	KMEM_CACHE_INITIALIZER("cv", sizeof(struct cv), 0, cv_ctor, cv_dtor);
+#endif
 
 ////////////////////////////////////////////////////////////
 //
@@ -147,13 +168,43 @@ V(struct semaphore *sem)
 //
 // Lock.
 
+#if OPT_A3
+static
+int
+lock_ctor(void *obj)
+{
+        struct lock *lock = obj;
+
+        lock->lk_wchan = wchan_create("lock");
+        if (lock->lk_wchan == NULL) {
+                return ENOMEM;
+        }
+        spinlock_init(&lock->lk_lock);
+        return 0;
+}
+
+static
+void
+lock_dtor(void *obj)
+{
+        struct lock *lock = obj;
+
+        spinlock_cleanup(&lock->lk_lock);
+        wchan_destroy(lock->lk_wchan);
+}
+#endif
+
 struct lock *
 lock_create(const char *name)
 {
         struct lock *lock;
 
         // Allocate lock
+#if OPT_A3
+        lock = kmem_cache_alloc(&lock_cache);
+#else
         lock = kmalloc(sizeof(struct lock));
+#endif
         if (lock == NULL) {
                 return NULL;
         }
@@ -161,10 +212,18 @@ lock_create(const char *name)
         // Allocate name
         lock->lk_name = kstrdup(name);
         if (lock->lk_name == NULL) {
+#if OPT_A3
+                kmem_cache_free(&lock_cache, lock);
+#else
                 kfree(lock);
+#endif
                 return NULL;
         }
 
+#if OPT_A3
+        // The wchan and spinlock come with it
+        wchan_setname(lock->lk_wchan, lock->lk_name);
+#else
         // Create wchan
         lock->lk_wchan = wchan_create(lock->lk_name);
       	if (lock->lk_wchan == NULL) {
@@ -172,12 +231,15 @@ lock_create(const char *name)
       		kfree(lock);
       		return NULL;
       	}
+#endif
 
         // Set initial lock-holding thread to NULL
         lock->lk_thread = NULL;
 
+#if !OPT_A3
         // Create spinlock
       	spinlock_init(&lock->lk_lock);
+#endif
 
         // Set initial lock state
         lock->lk_is_locked = false;
@@ -190,16 +252,26 @@ lock_destroy(struct lock *lock)
 {
         KASSERT(lock != NULL);
 
+#if OPT_A3
+        // Keep the spinlock and wchan for the next lock
+        KASSERT(wchan_isempty(lock->lk_wchan));
+        wchan_setname(lock->lk_wchan, "lock");
+#else
         // Clean up spinlock and wchan
         spinlock_cleanup(&lock->lk_lock);
       	wchan_destroy(lock->lk_wchan);
+#endif
 
         // Set lock-holding thread to NULL
         lock->lk_thread = NULL;
 
         // Free name and lock
         kfree(lock->lk_name);
+#if OPT_A3
+        kmem_cache_free(&lock_cache, lock);
+#else
         kfree(lock);
+#endif
 }
 
 void
@@ -228,6 +300,28 @@ lock_acquire(struct lock *lock)
   spinlock_release(&lock->lk_lock);
 }
 
+bool
+lock_tryacquire(struct lock *lock)
+{
+    KASSERT(lock != NULL);
+  bool acquired = false;
+
+  // Acquire spinlock to check
+  spinlock_acquire(&lock->lk_lock);
+
+  // Take the lock only if it is free; never block
+  if (lock->lk_is_locked == false) {
+    lock->lk_thread = curthread;
+    lock->lk_is_locked = true;
+    acquired = true;
+  }
+
+  // Release spinlock
+  spinlock_release(&lock->lk_lock);
+
+  return acquired;
+}
+
 void
 lock_release(struct lock *lock)
 {
@@ -263,28 +357,65 @@ lock_do_i_hold(struct lock *lock)
 // CV
 
 
+#if OPT_A3
+static
+int
+cv_ctor(void *obj)
+{
+        struct cv *cv = obj;
+
+        cv->cv_wchan = wchan_create("cv");
+        if (cv->cv_wchan == NULL) {
+                return ENOMEM;
+        }
+        return 0;
+}
+
+static
+void
+cv_dtor(void *obj)
+{
+        struct cv *cv = obj;
+
+        wchan_destroy(cv->cv_wchan);
+}
+#endif
+
 struct cv *
 cv_create(const char *name)
 {
         struct cv *cv;
 
+#if OPT_A3
+        cv = kmem_cache_alloc(&cv_cache);
+#else
         cv = kmalloc(sizeof(struct cv));
+#endif
         if (cv == NULL) {
                 return NULL;
         }
 
         cv->cv_name = kstrdup(name);
         if (cv->cv_name == NULL) {
+#if OPT_A3
+                kmem_cache_free(&cv_cache, cv);
+#else
                 kfree(cv);
+#endif
                 return NULL;
         }
 
+#if OPT_A3
+        // The wchan comes with it
+        wchan_setname(cv->cv_wchan, cv->cv_name);
+#else
         cv->cv_wchan = wchan_create(cv->cv_name);
       	if (cv->cv_wchan == NULL) {
       		kfree(cv->cv_name);
       		kfree(cv);
       		return NULL;
       	}
+#endif
 
         return cv;
 }
@@ -294,10 +425,20 @@ cv_destroy(struct cv *cv)
 {
         KASSERT(cv != NULL);
 
+#if OPT_A3
+        // Keep the wchan for the next cv
+        KASSERT(wchan_isempty(cv->cv_wchan));
+        wchan_setname(cv->cv_wchan, "cv");
+#else
         wchan_destroy(cv->cv_wchan);
+#endif
 
         kfree(cv->cv_name);
+#if OPT_A3
+        kmem_cache_free(&cv_cache, cv);
+#else
         kfree(cv);
+#endif
 }
 
 void
@@ -52,6 +52,11 @@
 #include <vnode.h>
 
 #include "opt-synchprobs.h"
+#include "opt-A3.h"
+#if OPT_A3
+#include <coremap.h>
+#include <kmem_cache.h>
+#endif
 
 
 /* Magic number used as a guard value on kernel thread stacks. */
@@ -72,6 +77,24 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+#if OPT_A3
+/*
+ * Threads and wait channels come from object caches; what never changes
+ * between uses (list nodes, wchan lock and queue) is set up once.
+ */
+static int thread_ctor(void *obj);
+static void thread_dtor(void *obj);
+static int wchan_ctor(void *obj);
+static void wchan_dtor(void *obj);
+
+static struct kmem_cache thread_cache =
+	KMEM_CACHE_INITIALIZER("thread", sizeof(struct thread), 0,
+			       thread_ctor, thread_dtor);
+static struct kmem_cache wchan_cache =
+	KMEM_CACHE_INITIALIZER("wchan", sizeof(struct wchan), 0,
+			       wchan_ctor, wchan_dtor);
+#endif
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -111,6 +134,32 @@ thread_checkstack(struct thread *thread)
 	}
 }
 
+#if OPT_A3
+/*
+ * Object cache constructor and destructor for threads.
+ */
+static
+int
+thread_ctor(void *obj)
+{
+	struct thread *thread = obj;
+
+	thread_machdep_init(&thread->t_machdep);
+	threadlistnode_init(&thread->t_listnode, thread);
+	return 0;
+}
+
+static
+void
+thread_dtor(void *obj)
+{
+	struct thread *thread = obj;
+
+	threadlistnode_cleanup(&thread->t_listnode);
+	thread_machdep_cleanup(&thread->t_machdep);
+}
+#endif
+
 /*
  * Create a thread. This is used both to create a first thread
  * for each CPU and to create subsequent forked threads.
@@ -123,22 +172,33 @@ thread_create(const char *name)
 
 	DEBUGASSERT(name != NULL);
 
+#if OPT_A3
+	thread = kmem_cache_alloc(&thread_cache);
+#else
 	thread = kmalloc(sizeof(*thread));
+#endif
 	if (thread == NULL) {
 		return NULL;
 	}
 
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
+#if OPT_A3
+		kmem_cache_free(&thread_cache, thread);
+#else
 		kfree(thread);
+#endif
 		return NULL;
 	}
 	thread->t_wchan_name = "NEW";
 	thread->t_state = S_READY;
 
 	/* Thread subsystem fields */
+#if !OPT_A3
+	/* (done once by thread_ctor) */
 	thread_machdep_init(&thread->t_machdep);
 	threadlistnode_init(&thread->t_listnode, thread);
+#endif
 	thread->t_stack = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
@@ -180,6 +240,12 @@ cpu_create(unsigned hardware_number)
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
+#if OPT_A3
+	c->c_tlbvictim = 0;
+	c->c_lastas = NULL;
+	c->c_lastasid = 0;
+	c->c_asidgen = 0;
+#endif
 
 	c->c_isidle = false;
 	threadlist_init(&c->c_runqueue);
@@ -252,14 +318,25 @@ thread_destroy(struct thread *thread)
 	if (thread->t_stack != NULL) {
 		kfree(thread->t_stack);
 	}
+#if OPT_A3
+	/* Left set up for the next thread; thread_dtor cleans them up */
+	KASSERT(thread->t_listnode.tln_prev == NULL);
+	KASSERT(thread->t_listnode.tln_next == NULL);
+	KASSERT(thread->t_machdep.tm_badfaultfunc == NULL);
+#else
 	threadlistnode_cleanup(&thread->t_listnode);
 	thread_machdep_cleanup(&thread->t_machdep);
+#endif
 
 	/* sheer paranoia */
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
+#if OPT_A3
+	kmem_cache_free(&thread_cache, thread);
+#else
 	kfree(thread);
+#endif
 }
 
 /*
@@ -580,6 +657,18 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		return;
 	}
 
+#if OPT_A3
+	/* Count the switch against a user process; only we write these */
+	if (cur->t_proc != NULL && cur->t_proc != kproc) {
+		if (newstate == S_READY) {
+			cur->t_proc->p_usage.pu_nivcsw++;
+		}
+		else if (newstate == S_SLEEP) {
+			cur->t_proc->p_usage.pu_nvcsw++;
+		}
+	}
+#endif
+
 	/* Put the thread in the right place. */
 	switch (newstate) {
 	    case S_RUN:
@@ -635,7 +724,23 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		next = threadlist_remhead(&curcpu->c_runqueue);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
+#if OPT_A3
+			/*
+			 * Zero free pages for later page faults rather
+			 * than sleep, a piece of a page at a time,
+			 * letting any pending interrupts in before
+			 * looking at the runqueue again.
+			 */
+			if (coremap_zeroidle()) {
+				cpu_irqon();
+				cpu_irqoff();
+			}
+			else {
+				cpu_idle();
+			}
+#else
 			cpu_idle();
+#endif
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
@@ -976,12 +1081,19 @@ wchan_create(const char *name)
 {
 	struct wchan *wc;
 
+#if OPT_A3
+	wc = kmem_cache_alloc(&wchan_cache);
+	if (wc == NULL) {
+		return NULL;
+	}
+#else
 	wc = kmalloc(sizeof(*wc));
 	if (wc == NULL) {
 		return NULL;
 	}
 	spinlock_init(&wc->wc_lock);
 	threadlist_init(&wc->wc_threads);
+#endif
 	wc->wc_name = name;
 	return wc;
 }
@@ -993,11 +1105,55 @@ wchan_create(const char *name)
 void
 wchan_destroy(struct wchan *wc)
 {
+#if OPT_A3
+	/* Left set up for the next wchan; wchan_dtor cleans them up */
+	KASSERT(threadlist_isempty(&wc->wc_threads));
+	KASSERT(wc->wc_lock.lk_holder == NULL);
+	kmem_cache_free(&wchan_cache, wc);
+#else
 	spinlock_cleanup(&wc->wc_lock);
 	threadlist_cleanup(&wc->wc_threads);
 	kfree(wc);
+#endif
+}
+
+#if OPT_A3
+/*
+ * Change a wait channel's name, for objects that keep theirs while
+ * cached and get a new name each time they're handed out.
+ */
+void
+wchan_setname(struct wchan *wc, const char *name)
+{
+	wc->wc_name = name;
+}
+
+/*
+ * Object cache constructor and destructor for wait channels.
+ */
+static
+int
+wchan_ctor(void *obj)
+{
+	struct wchan *wc = obj;
+
+	spinlock_init(&wc->wc_lock);
+	threadlist_init(&wc->wc_threads);
+	wc->wc_name = NULL;
+	return 0;
 }
 
+static
+void
+wchan_dtor(void *obj)
+{
+	struct wchan *wc = obj;
+
+	spinlock_cleanup(&wc->wc_lock);
+	threadlist_cleanup(&wc->wc_threads);
+}
+#endif
+
 /*
  * Lock and unlock a wait channel, respectively.
  */
@@ -1162,6 +1318,29 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 	spinlock_release(&target->c_ipi_lock);
 }
 
+#if OPT_A3
+/*
+ * Send a TLB shootdown to each CPU, other than this one, in CPUMASK.
+ */
+unsigned
+ipi_tlbshootdown_mask(uint32_t cpumask, const struct tlbshootdown *mapping)
+{
+	unsigned i, n;
+	struct cpu *c;
+
+	n = 0;
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != curcpu->c_self &&
+		    (cpumask & ((uint32_t)1 << c->c_number))) {
+			ipi_tlbshootdown(c, mapping);
+			n++;
+		}
+	}
+	return n;
+}
+#endif
+
 void
 interprocessor_interrupt(void)
 {
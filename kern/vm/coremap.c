@@ -0,0 +1,675 @@
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <vm.h>
+#include <addrspace.h>
+#include <pagetable.h>
+#include <coremap.h>
+#include <vmtune.h>
+#include <uw-vmstats.h>
+
+static struct coremap_entry *coremap;
+static unsigned cm_nframes;    // number of frames described by the coremap
+static unsigned cm_firstframe; // first frame that is not fixed
+static unsigned cm_nfree;      // number of frames on both free lists
+static unsigned cm_freehead;   // head of the stale free list
+static unsigned cm_zerohead;   // head of the zeroed free list
+static unsigned cm_nzeroed;    // number of frames on the zeroed free list
+static unsigned cm_zeroframe;  // stale free frame coremap_zeroidle is on
+static unsigned cm_zerodone;   // how many of its bytes are zeroed so far
+static unsigned cm_runhint;    // where the next contiguous run search starts
+static unsigned cm_clockhand;  // next frame the page-out clock looks at
+static unsigned cm_scanhand;   // next frame coremap_nextowned looks at
+static bool cm_ready = false;
+
+static struct spinlock coremap_lock = SPINLOCK_INITIALIZER;
+
+// Most frames a sweep looks at per hold of coremap_lock, which keeps
+// interrupts off
+#define CM_SCANBATCH 32
+// Most bytes coremap_zeroidle zeroes per hold of coremap_lock
+#define CM_ZEROCHUNK 512
+
+// Helper functions
+static void freelist_push(unsigned i);
+static void freelist_remove(unsigned i);
+static unsigned coremap_findrun(unsigned npages);
+static void coremap_take(unsigned i, struct addrspace *as, vaddr_t vaddr);
+static bool coremap_trylockowner(unsigned i, struct addrspace **as,
+                                 vaddr_t *vaddr, bool *held);
+static bool coremap_ismapped(unsigned i, struct addrspace *as, vaddr_t vaddr,
+                             bool held);
+
+/**
+ * builds the coremap over all of physical memory; must be called once, after
+ * which ram_stealmem may no longer be used
+ */
+void coremap_bootstrap(void) {
+  paddr_t lo, hi;
+  size_t cmsize;
+  unsigned i;
+
+    KASSERT(!cm_ready);
+
+  ram_getsize(&lo, &hi);
+    KASSERT((lo & PAGE_FRAME) == lo);
+    KASSERT((hi & PAGE_FRAME) == hi);
+
+  // The coremap itself lives in the first free pages
+  cm_nframes = hi / PAGE_SIZE;
+  cmsize = ROUNDUP(cm_nframes * sizeof(struct coremap_entry), PAGE_SIZE);
+  coremap = (struct coremap_entry *)PADDR_TO_KVADDR(lo);
+  cm_firstframe = (lo + cmsize) / PAGE_SIZE;
+  if (cm_firstframe >= cm_nframes) {
+    panic("coremap_bootstrap: no memory left after the coremap\n");
+  }
+
+  for (i = 0; i < cm_nframes; i++) {
+    coremap[i].cme_as = NULL;
+    coremap[i].cme_vaddr = 0;
+    coremap[i].cme_npages = 0;
+    coremap[i].cme_next = CM_NONE;
+    coremap[i].cme_prev = CM_NONE;
+    coremap[i].cme_refcount = 0;
+    coremap[i].cme_state = CME_FIXED;
+    coremap[i].cme_busy = false;
+    coremap[i].cme_zeroed = false;
+  }
+
+  // Push in increasing order so the list head is the top of memory: single
+  // pages are then taken from high memory, runs are found low down
+  cm_freehead = CM_NONE;
+  cm_zerohead = CM_NONE;
+  cm_nfree = 0;
+  cm_nzeroed = 0;
+  cm_zeroframe = CM_NONE;
+  cm_zerodone = 0;
+  for (i = cm_firstframe; i < cm_nframes; i++) {
+    coremap[i].cme_state = CME_FREE;
+    freelist_push(i);
+  }
+  cm_runhint = cm_firstframe;
+  cm_clockhand = cm_firstframe;
+  cm_scanhand = cm_firstframe;
+
+  cm_ready = true;
+}
+
+/**
+ * checks whether the coremap has taken over from ram_stealmem
+ * @return true once coremap_bootstrap has run
+ */
+bool coremap_isready(void) {
+  return cm_ready;
+}
+
+/**
+ * allocates a physically contiguous run of frames
+ * @param  npages number of frames
+ * @param  as     owning address space, or NULL for a kernel allocation
+ * @param  vaddr  user virtual address mapped by the first frame
+ * @return        physical address of the first frame, 0 if out of memory
+ */
+paddr_t coremap_alloc(unsigned npages, struct addrspace *as, vaddr_t vaddr) {
+  unsigned i, start;
+
+    KASSERT(cm_ready);
+    KASSERT(npages > 0);
+
+  spinlock_acquire(&coremap_lock);
+
+  if (npages > cm_nfree) {
+    spinlock_release(&coremap_lock);
+    return 0;
+  }
+
+  if (npages == 1) {
+    // Leave zeroed frames for coremap_alloczero while there are others,
+    // and the one being zeroed for coremap_zeroidle
+    start = cm_freehead;
+    if (start != CM_NONE && start == cm_zeroframe &&
+        coremap[start].cme_next != CM_NONE) {
+      start = coremap[start].cme_next;
+    }
+    if (start == CM_NONE) {
+      start = cm_zerohead;
+    }
+      KASSERT(start != CM_NONE);
+  }
+  else {
+    start = coremap_findrun(npages);
+    if (start == CM_NONE) {
+      spinlock_release(&coremap_lock);
+      return 0;
+    }
+  }
+
+  for (i = start; i < start + npages; i++) {
+    coremap_take(i, as, (as == NULL) ? 0 : vaddr + (i - start) * PAGE_SIZE);
+  }
+  coremap[start].cme_npages = npages;
+
+  spinlock_release(&coremap_lock);
+
+  return (paddr_t)start * PAGE_SIZE;
+}
+
+/**
+ * allocates a single zero-filled user frame, from the zeroed free list if
+ * an idle CPU has got to one, otherwise by zeroing a stale frame here
+ * @param  as    owning address space
+ * @param  vaddr user virtual address mapped by the frame
+ * @return       physical address of the frame, 0 if out of memory
+ */
+paddr_t coremap_alloczero(struct addrspace *as, vaddr_t vaddr) {
+  paddr_t paddr;
+  unsigned i;
+
+    KASSERT(cm_ready);
+    KASSERT(as != NULL);
+
+  spinlock_acquire(&coremap_lock);
+
+  i = cm_zerohead;
+  if (i != CM_NONE) {
+    coremap_take(i, as, vaddr);
+    coremap[i].cme_npages = 1;
+    spinlock_release(&coremap_lock);
+    vmstats_inc(VMSTAT_ZERO_POOL_HIT);
+    return (paddr_t)i * PAGE_SIZE;
+  }
+
+  spinlock_release(&coremap_lock);
+
+  vmstats_inc(VMSTAT_ZERO_POOL_MISS);
+  paddr = coremap_alloc(1, as, vaddr);
+  if (paddr != 0) {
+    bzero((void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+  }
+  return paddr;
+}
+
+/**
+ * zeroes the next CM_ZEROCHUNK bytes of a stale free frame, moving it to
+ * the zeroed free list once it is all zero; called by a CPU with nothing
+ * to run, which lets interrupts in between calls. The frame stays on the
+ * stale free list meanwhile, so it still counts as free and an allocation
+ * may take it, in which case zeroing starts over on another one
+ * @return true if some zeroing was done, false if there is nothing to do
+ */
+bool coremap_zeroidle(void) {
+  unsigned i;
+
+  COMPILE_ASSERT(PAGE_SIZE % CM_ZEROCHUNK == 0);
+
+  if (!cm_ready) {
+    return false;
+  }
+
+  spinlock_acquire(&coremap_lock);
+  if (cm_zeroframe == CM_NONE) {
+    if (cm_freehead == CM_NONE || cm_nzeroed >= (unsigned)vm_zeropool) {
+      spinlock_release(&coremap_lock);
+      return false;
+    }
+    cm_zeroframe = cm_freehead;
+    cm_zerodone = 0;
+  }
+  i = cm_zeroframe;
+    KASSERT(coremap[i].cme_state == CME_FREE && !coremap[i].cme_zeroed);
+
+  bzero((void *)(PADDR_TO_KVADDR((paddr_t)i * PAGE_SIZE) + cm_zerodone),
+        CM_ZEROCHUNK);
+  cm_zerodone += CM_ZEROCHUNK;
+  if (cm_zerodone == PAGE_SIZE) {
+    freelist_remove(i);
+    coremap[i].cme_zeroed = true;
+    freelist_push(i);
+    cm_zeroframe = CM_NONE;
+  }
+  spinlock_release(&coremap_lock);
+  return true;
+}
+
+/**
+ * frees the run of frames starting at the given frame; a shared user frame
+ * just loses one reference and is freed when the last one goes
+ * @param paddr physical address returned by coremap_alloc
+ */
+void coremap_free(paddr_t paddr) {
+  unsigned i, start, npages;
+
+    KASSERT((paddr & PAGE_FRAME) == paddr);
+
+  if (!cm_ready) {
+    // Stolen before the coremap existed; there is no record of it
+    return;
+  }
+
+  start = paddr / PAGE_SIZE;
+    KASSERT(start < cm_nframes);
+
+  spinlock_acquire(&coremap_lock);
+
+  if (coremap[start].cme_state == CME_FIXED) {
+    // Early ram_stealmem allocation; these were never tracked, leak them
+    spinlock_release(&coremap_lock);
+    return;
+  }
+
+    KASSERT(coremap[start].cme_state == CME_KERNEL ||
+            coremap[start].cme_state == CME_USER);
+    KASSERT(coremap[start].cme_npages > 0);
+
+  if (coremap[start].cme_refcount > 1) {
+      KASSERT(coremap[start].cme_state == CME_USER);
+    coremap[start].cme_refcount--;
+    spinlock_release(&coremap_lock);
+    return;
+  }
+
+  npages = coremap[start].cme_npages;
+  for (i = start; i < start + npages; i++) {
+      KASSERT(i < cm_nframes);
+      KASSERT(coremap[i].cme_state != CME_FREE &&
+              coremap[i].cme_state != CME_FIXED);
+    coremap[i].cme_state = CME_FREE;
+    coremap[i].cme_as = NULL;
+    coremap[i].cme_vaddr = 0;
+    coremap[i].cme_npages = 0;
+    coremap[i].cme_refcount = 0;
+    coremap[i].cme_busy = false;
+    freelist_push(i);
+  }
+
+  spinlock_release(&coremap_lock);
+}
+
+/**
+ * adds a reference to a single user frame, e.g. for a copy-on-write fork;
+ * the frame no longer has a single owner
+ * @param paddr physical address of the frame
+ */
+void coremap_share(paddr_t paddr) {
+  unsigned i = paddr / PAGE_SIZE;
+
+    KASSERT((paddr & PAGE_FRAME) == paddr);
+    KASSERT(cm_ready && i < cm_nframes);
+
+  spinlock_acquire(&coremap_lock);
+    KASSERT(coremap[i].cme_state == CME_USER);
+    KASSERT(coremap[i].cme_npages == 1);
+    KASSERT(coremap[i].cme_refcount > 0);
+  coremap[i].cme_refcount++;
+  coremap[i].cme_as = NULL;
+  coremap[i].cme_vaddr = 0;
+  spinlock_release(&coremap_lock);
+}
+
+/**
+ * gets the number of mappings of a user frame
+ * @param  paddr physical address of the frame
+ * @return       reference count
+ */
+unsigned coremap_refcount(paddr_t paddr) {
+  unsigned i = paddr / PAGE_SIZE;
+  unsigned refcount;
+
+    KASSERT((paddr & PAGE_FRAME) == paddr);
+    KASSERT(cm_ready && i < cm_nframes);
+
+  spinlock_acquire(&coremap_lock);
+  refcount = coremap[i].cme_refcount;
+  spinlock_release(&coremap_lock);
+  return refcount;
+}
+
+/**
+ * records the owner of an unshared user frame, once a copy-on-write fault
+ * finds it is the last one mapping it
+ * @param paddr physical address of the frame
+ * @param as    owning address space
+ * @param vaddr user virtual address mapped by the frame
+ */
+void coremap_setowner(paddr_t paddr, struct addrspace *as, vaddr_t vaddr) {
+  unsigned i = paddr / PAGE_SIZE;
+
+    KASSERT((paddr & PAGE_FRAME) == paddr);
+    KASSERT(cm_ready && i < cm_nframes);
+
+  spinlock_acquire(&coremap_lock);
+    KASSERT(coremap[i].cme_state == CME_USER);
+    KASSERT(coremap[i].cme_refcount == 1);
+  coremap[i].cme_as = as;
+  coremap[i].cme_vaddr = vaddr;
+  spinlock_release(&coremap_lock);
+}
+
+/**
+ * runs the clock over the user frames to choose one to page out; frames
+ * that are shared, busy, or whose owner's address space is locked by some
+ * other thread are passed over, and referenced ones get a second chance
+ * @param  as     destination for the owning address space, whose as_lock
+ *                is held on return
+ * @param  vaddr  destination for the user page the frame maps
+ * @param  locked destination for whether as_lock was taken here (false if
+ *                the caller already held it) and must be released
+ * @return        the victim, marked busy, or 0 if there is none
+ */
+paddr_t coremap_pickvictim(struct addrspace **as, vaddr_t *vaddr, bool *locked) {
+  struct addrspace *owner;
+  vaddr_t va;
+  pte_t *pte;
+  unsigned i, n, batch, nsweep;
+  bool held, found;
+
+    KASSERT(cm_ready);
+
+  // Two sweeps: the first may only be clearing reference bits
+  nsweep = 2 * (cm_nframes - cm_firstframe);
+  n = 0;
+  while (n < nsweep) {
+    spinlock_acquire(&coremap_lock);
+    found = false;
+    for (batch = 0; batch < CM_SCANBATCH && n < nsweep && !found; batch++) {
+      i = cm_clockhand;
+      cm_clockhand = (i + 1 < cm_nframes) ? i + 1 : cm_firstframe;
+      n++;
+      found = coremap_trylockowner(i, &owner, &va, &held);
+    }
+    spinlock_release(&coremap_lock);
+    if (!found || !coremap_ismapped(i, owner, va, held)) {
+      continue;
+    }
+
+    // Holding the owner's lock keeps the frame mapped from here on
+    pte = pt_lookup(owner->as_pt, va, false);
+    if (*pte & PTE_REF) {
+      // A page that stays in the TLB never faults, which is what sets
+      // PTE_REF, so drop its entry for the bit to mean something
+      *pte &= ~PTE_REF;
+      vm_tlbinvalidate(owner, va);
+      if (!held) {
+        lock_release(owner->as_lock);
+      }
+      continue;
+    }
+
+    spinlock_acquire(&coremap_lock);
+      KASSERT(coremap[i].cme_state == CME_USER && !coremap[i].cme_busy);
+    coremap[i].cme_busy = true;
+    spinlock_release(&coremap_lock);
+
+    *as = owner;
+    *vaddr = va;
+    *locked = !held;
+    return (paddr_t)i * PAGE_SIZE;
+  }
+
+  return 0;
+}
+
+/**
+ * locks the owner of a user frame, if it has exactly one and the frame is
+ * mapped, so that the mapping can be looked at and changed
+ * @param  paddr  physical address of the frame
+ * @param  as     destination for the owning address space, whose as_lock
+ *                is held on return
+ * @param  vaddr  destination for the user page the frame maps
+ * @param  locked destination for whether as_lock was taken here and must
+ *                be released
+ * @return        true if the owner is locked, false if the frame is not a
+ *                single-owner user frame or its owner is busy
+ */
+bool coremap_lockowner(paddr_t paddr, struct addrspace **as, vaddr_t *vaddr,
+                       bool *locked) {
+  unsigned i = paddr / PAGE_SIZE;
+  bool held;
+
+    KASSERT((paddr & PAGE_FRAME) == paddr);
+    KASSERT(cm_ready && i < cm_nframes);
+
+  spinlock_acquire(&coremap_lock);
+  if (!coremap_trylockowner(i, as, vaddr, &held)) {
+    spinlock_release(&coremap_lock);
+    return false;
+  }
+  spinlock_release(&coremap_lock);
+  if (!coremap_ismapped(i, *as, *vaddr, held)) {
+    return false;
+  }
+  *locked = !held;
+  return true;
+}
+
+/**
+ * finds the next user frame, in address order, whose single owner can be
+ * locked as with coremap_lockowner, for a sweep over every user page
+ * @param  as     destination for the owning address space, whose as_lock
+ *                is held on return
+ * @param  vaddr  destination for the user page the frame maps
+ * @param  locked destination for whether as_lock was taken here and must
+ *                be released
+ * @return        the frame, or 0 once the sweep reaches the end of memory;
+ *                the next call starts over from the bottom
+ */
+paddr_t coremap_nextowned(struct addrspace **as, vaddr_t *vaddr,
+                          bool *locked) {
+  unsigned i, batch;
+  bool held, found;
+
+    KASSERT(cm_ready);
+
+  for (;;) {
+    spinlock_acquire(&coremap_lock);
+    if (cm_scanhand >= cm_nframes) {
+      cm_scanhand = cm_firstframe;
+      spinlock_release(&coremap_lock);
+      return 0;
+    }
+    found = false;
+    for (batch = 0; batch < CM_SCANBATCH && cm_scanhand < cm_nframes &&
+                    !found; batch++) {
+      i = cm_scanhand++;
+      found = coremap_trylockowner(i, as, vaddr, &held);
+    }
+    spinlock_release(&coremap_lock);
+    if (found && coremap_ismapped(i, *as, *vaddr, held)) {
+      *locked = !held;
+      return (paddr_t)i * PAGE_SIZE;
+    }
+  }
+}
+
+/**
+ * gives up on paging out a frame picked by coremap_pickvictim
+ * @param paddr the victim
+ */
+void coremap_unbusy(paddr_t paddr) {
+  unsigned i = paddr / PAGE_SIZE;
+
+    KASSERT((paddr & PAGE_FRAME) == paddr);
+    KASSERT(cm_ready && i < cm_nframes);
+
+  spinlock_acquire(&coremap_lock);
+    KASSERT(coremap[i].cme_busy);
+  coremap[i].cme_busy = false;
+  spinlock_release(&coremap_lock);
+}
+
+/**
+ * reports frame usage
+ * @param nfree  destination for the number of free frames
+ * @param ntotal destination for the number of allocatable frames
+ */
+void coremap_getstats(unsigned *nfree, unsigned *ntotal) {
+  spinlock_acquire(&coremap_lock);
+  *nfree = cm_nfree;
+  *ntotal = cm_nframes - cm_firstframe;
+  spinlock_release(&coremap_lock);
+}
+
+/**
+ * pushes a frame onto the head of the free list given by its cme_zeroed
+ * @param i frame number
+ */
+static void freelist_push(unsigned i) {
+  unsigned *head = coremap[i].cme_zeroed ? &cm_zerohead : &cm_freehead;
+
+  coremap[i].cme_prev = CM_NONE;
+  coremap[i].cme_next = *head;
+  if (*head != CM_NONE) {
+    coremap[*head].cme_prev = i;
+  }
+  *head = i;
+  cm_nfree++;
+  if (coremap[i].cme_zeroed) {
+    cm_nzeroed++;
+  }
+}
+
+/**
+ * unlinks a frame from anywhere in whichever free list it is on
+ * @param i frame number
+ */
+static void freelist_remove(unsigned i) {
+  unsigned *head = coremap[i].cme_zeroed ? &cm_zerohead : &cm_freehead;
+
+  if (coremap[i].cme_prev != CM_NONE) {
+    coremap[coremap[i].cme_prev].cme_next = coremap[i].cme_next;
+  }
+  else {
+      KASSERT(*head == i);
+    *head = coremap[i].cme_next;
+  }
+  if (coremap[i].cme_next != CM_NONE) {
+    coremap[coremap[i].cme_next].cme_prev = coremap[i].cme_prev;
+  }
+  coremap[i].cme_next = CM_NONE;
+  coremap[i].cme_prev = CM_NONE;
+    KASSERT(cm_nfree > 0);
+  cm_nfree--;
+  if (coremap[i].cme_zeroed) {
+      KASSERT(cm_nzeroed > 0);
+    cm_nzeroed--;
+  }
+}
+
+/**
+ * takes a free frame off its free list for a new allocation
+ * @param i     frame number
+ * @param as    owning address space, or NULL for a kernel allocation
+ * @param vaddr user virtual address mapped by the frame
+ */
+static void coremap_take(unsigned i, struct addrspace *as, vaddr_t vaddr) {
+    KASSERT(spinlock_do_i_hold(&coremap_lock));
+    KASSERT(coremap[i].cme_state == CME_FREE);
+
+  freelist_remove(i);
+  if (i == cm_zeroframe) {
+    // Half zeroed is no use to coremap_zeroidle once it has been used
+    cm_zeroframe = CM_NONE;
+  }
+  coremap[i].cme_zeroed = false;
+  coremap[i].cme_state = (as == NULL) ? CME_KERNEL : CME_USER;
+  coremap[i].cme_as = as;
+  coremap[i].cme_vaddr = vaddr;
+  coremap[i].cme_npages = 0;
+  coremap[i].cme_refcount = 1;
+}
+
+/**
+ * tries to lock the owner of a frame for coremap_pickvictim and friends;
+ * the caller holds coremap_lock, and must check the frame with
+ * coremap_ismapped once it has let go of it
+ * @param  i     frame number
+ * @param  as    destination for the owning address space
+ * @param  vaddr destination for the user page the frame maps
+ * @param  held  destination for whether the caller already held as_lock
+ * @return       true if the frame is an idle user frame with a single
+ *               owner, and that owner's as_lock is held
+ */
+static bool coremap_trylockowner(unsigned i, struct addrspace **as,
+                                 vaddr_t *vaddr, bool *held) {
+  struct coremap_entry *cme = &coremap[i];
+  struct addrspace *owner;
+
+    KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+  if (cme->cme_state != CME_USER || cme->cme_refcount != 1 ||
+      cme->cme_as == NULL || cme->cme_busy) {
+    return false;
+  }
+
+  // The owner can't go away while it still has this frame, and its
+  // lock is only tried, so holding the spinlock here is safe
+  owner = cme->cme_as;
+  *held = lock_do_i_hold(owner->as_lock);
+  if (!*held && !lock_tryacquire(owner->as_lock)) {
+    return false;
+  }
+  *as = owner;
+  *vaddr = cme->cme_vaddr;
+  return true;
+}
+
+/**
+ * checks that the owner locked by coremap_trylockowner maps the frame,
+ * which it may not yet, e.g. while it is still being filled; if not, lets
+ * go of the owner again. The owner can't go away while its lock is held,
+ * and the caller holds no spinlock, since releasing it may wake a thread
+ * @param  i     frame number
+ * @param  as    owning address space, whose as_lock is held
+ * @param  vaddr user page the frame was given for
+ * @param  held  whether the caller held as_lock before
+ * @return       true if the frame is mapped and as_lock is still held
+ */
+static bool coremap_ismapped(unsigned i, struct addrspace *as, vaddr_t vaddr,
+                             bool held) {
+  pte_t *pte;
+
+  pte = pt_lookup(as->as_pt, vaddr, false);
+  if (pte == NULL || !(*pte & PTE_VALID) ||
+      (*pte & PTE_FRAME) != (paddr_t)i * PAGE_SIZE) {
+    if (!held) {
+      lock_release(as->as_lock);
+    }
+    return false;
+  }
+  return true;
+}
+
+/**
+ * next-fit search for a run of free frames, wrapping around once
+ * @param  npages length of the run
+ * @return        first frame of the run, CM_NONE if there is none
+ */
+static unsigned coremap_findrun(unsigned npages) {
+  unsigned i, n, run;
+
+    KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+  i = cm_runhint;
+  run = 0;
+  for (n = 0; n < (cm_nframes - cm_firstframe) + npages; n++) {
+    if (i >= cm_nframes) {
+      // Runs cannot wrap around the end of memory
+      i = cm_firstframe;
+      run = 0;
+    }
+    if (coremap[i].cme_state == CME_FREE) {
+      run++;
+      if (run == npages) {
+        cm_runhint = i + 1;
+        return i + 1 - npages;
+      }
+    }
+    else {
+      run = 0;
+    }
+    i++;
+  }
+
+  return CM_NONE;
+}
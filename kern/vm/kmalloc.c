@@ -31,6 +31,16 @@
 #include <lib.h>
 #include <spinlock.h>
 #include <vm.h>
+#include "opt-A3.h"
+#include "opt-kmprof.h"
+
+#if OPT_A3
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <mainbus.h>
+#include <platform/maxcpus.h>
+#endif
 
 /*
  * Kernel malloc.
@@ -83,8 +93,24 @@ fill_deadbeef(void *vptr, size_t len)
 
 #if PAGE_SIZE == 4096
 
+#if OPT_A3
+/*
+ * Steps of about 1.5 instead of 2, so rounding up wastes at most a third
+ * of a block rather than half: a 40 byte structure gets 48 bytes, not
+ * 64. To tune the table to the kernel's actual requests, build with
+ * "options kmprof" and run the kh menu command, which prints a table of
+ * NSIZES classes that would have wasted the least on what was asked for.
+ * Sizes must be increasing multiples of 8, at least SMALLEST_SUBPAGE_SIZE,
+ * and the last must be LARGEST_SUBPAGE_SIZE.
+ */
+#define NSIZES 14
+static const size_t sizes[NSIZES] = {
+	16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 2048
+};
+#else
 #define NSIZES 8
 static const size_t sizes[NSIZES] = { 16, 32, 64, 128, 256, 512, 1024, 2048 };
+#endif
 
 #define SMALLEST_SUBPAGE_SIZE 16
 #define LARGEST_SUBPAGE_SIZE 2048
@@ -117,6 +143,98 @@ struct pageref {
 
 ////////////////////////////////////////
 
+#if OPT_A3
+/*
+ * Pagerefs live in pages of their own, allocated as the heap grows, so
+ * the heap can use as much of memory as it needs. Each page of pagerefs
+ * starts with a header holding its in-use bitmap; since the pages are
+ * page aligned, freepageref finds the header by rounding down.
+ *
+ * The pages aren't given back; there is one for every NPAGEREFS pages
+ * of heap the kernel has had at once.
+ */
+
+#define NPAGEREFS ((PAGE_SIZE - 64) / sizeof(struct pageref))
+#define INUSE_WORDS ((NPAGEREFS + 31) / 32)
+
+struct pagerefpage {
+	struct pagerefpage *next;
+	unsigned nfree;
+	uint32_t inuse[INUSE_WORDS];
+	struct pageref refs[NPAGEREFS];
+};
+
+static struct pagerefpage *pagerefpages;
+static unsigned npagerefpages;
+
+/*
+ * Find the lowest clear bit in a word that has one. MIPS-I has no
+ * count-leading/trailing-zeros instruction, so halve the search each
+ * step instead.
+ */
+static
+unsigned
+findzero(uint32_t k)
+{
+	unsigned j = 0;
+
+	k = ~k;
+	KASSERT(k != 0);
+	if ((k & 0xffff) == 0) { k >>= 16; j += 16; }
+	if ((k & 0xff) == 0)   { k >>= 8;  j += 8;  }
+	if ((k & 0xf) == 0)    { k >>= 4;  j += 4;  }
+	if ((k & 0x3) == 0)    { k >>= 2;  j += 2;  }
+	if ((k & 0x1) == 0)    {           j += 1;  }
+	return j;
+}
+
+static
+struct pageref *
+allocpageref(void)
+{
+	struct pagerefpage *prp;
+	unsigned i, j;
+
+	for (prp = pagerefpages; prp != NULL; prp = prp->next) {
+		if (prp->nfree == 0) {
+			continue;
+		}
+		for (i=0; i<INUSE_WORDS; i++) {
+			if (prp->inuse[i]==0xffffffff) {
+				/* full */
+				continue;
+			}
+			j = i*32 + findzero(prp->inuse[i]);
+			KASSERT(j < NPAGEREFS);
+			prp->inuse[i] |= ((uint32_t)1) << (j%32);
+			prp->nfree--;
+			return &prp->refs[j];
+		}
+		KASSERT(0);
+	}
+
+	/* ran out */
+	return NULL;
+}
+
+static
+void
+freepageref(struct pageref *p)
+{
+	struct pagerefpage *prp;
+	size_t i, j;
+	uint32_t k;
+
+	prp = (struct pagerefpage *)((vaddr_t)p & PAGE_FRAME);
+	j = p-prp->refs;
+	KASSERT(j < NPAGEREFS);  /* note: j is unsigned, don't test < 0 */
+	i = j/32;
+	k = ((uint32_t)1) << (j%32);
+	KASSERT((prp->inuse[i] & k) != 0);
+	prp->inuse[i] &= ~k;
+	prp->nfree++;
+}
+#else
 /*
  * This is cheesy. 
  *
@@ -181,6 +299,8 @@ freepageref(struct pageref *p)
 	pagerefs_inuse[i] &= ~k;
 }
 
+#endif /* OPT_A3 */
+
 ////////////////////////////////////////
 
 static struct pageref *sizebases[NSIZES];
@@ -189,16 +309,222 @@ static struct pageref *allbase;
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * One spinlock covers the pagerefs and the lists of pages. The per-cpu
+ * magazines below keep the common case off it.
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
 
 ////////////////////////////////////////
 
+#if OPT_A3
+/*
+ * Most allocations don't need the spinlock, though. Each CPU keeps a
+ * magazine of free objects of each size, linked through their first
+ * words like a page's freelist. kmalloc takes from its CPU's magazine
+ * and kfree puts back into it with nothing but interrupts off, so an
+ * allocation and free on the same CPU never touch the spinlock. An
+ * empty magazine is refilled from the page the allocation comes from,
+ * and a full one is drained back to the pages half a magazine at a
+ * time, in both cases while we hold the spinlock anyway.
+ *
+ * Objects in a magazine still count as allocated in their page's
+ * pageref, so the page isn't released while any of them are cached.
+ *
+ * kfree finds an object's pageref, and so its size, in pagerefmap[],
+ * which holds the pageref of every page the subpage allocator owns,
+ * indexed by physical page number; it's NULL for other pages. That
+ * makes kfree's cost independent of the size of the heap, and lets it
+ * find the right magazine without the spinlock: an entry and its
+ * pageref's block type only change while no object on the page is
+ * allocated, so reading them for an object being freed is safe.
+ */
+
+#define MAG_BYTES (PAGE_SIZE/2)	/* most memory a magazine holds */
+#define MAG_MAX   32		/* most objects a magazine holds */
+
+struct magazine {
+	struct freelist *head;
+	unsigned count;
+};
+
+struct kmcpu {
+	struct magazine mags[NSIZES];
+	unsigned hits;		/* allocations from the magazine */
+	unsigned misses;	/* allocations that took the spinlock */
+};
+
+static struct kmcpu kmcpus[MAXCPUS];
+
+static struct pageref **pagerefmap;	/* set before the first subpage */
+static unsigned npagerefmap;
+
+/*
+ * How kfree finds an object's page, one of the KFREE_* in <lib.h>. Only
+ * "km2 -t" changes it, to time the paths against each other; objects
+ * already in magazines stay there whichever is chosen.
+ */
+int kfree_path = KFREE_MAG;
+
+static
+unsigned
+mag_limit(unsigned blktype)
+{
+	unsigned n;
+
+	n = MAG_BYTES / sizes[blktype];
+	if (n > MAG_MAX) {
+		n = MAG_MAX;
+	}
+	if (n < 2) {
+		n = 2;
+	}
+	return n;
+}
+
+/*
+ * Add a page of pagerefs. Called without the spinlock, since
+ * alloc_kpages may need to come back here.
+ */
+static
+int
+morepagerefs(void)
+{
+	struct pagerefpage *prp;
+	unsigned i;
+
+	COMPILE_ASSERT(sizeof(struct pagerefpage) <= PAGE_SIZE);
+
+	prp = (struct pagerefpage *)alloc_kpages(1);
+	if (prp == NULL) {
+		return -1;
+	}
+	prp->nfree = NPAGEREFS;
+	for (i=0; i<INUSE_WORDS; i++) {
+		prp->inuse[i] = 0;
+	}
+	/* Mark the bits past the end in use so they're never handed out. */
+	for (i=NPAGEREFS; i<INUSE_WORDS*32; i++) {
+		prp->inuse[i/32] |= ((uint32_t)1) << (i%32);
+	}
+
+	spinlock_acquire(&kmalloc_spinlock);
+	prp->next = pagerefpages;
+	pagerefpages = prp;
+	npagerefpages++;
+	spinlock_release(&kmalloc_spinlock);
+
+	return 0;
+}
+
+/*
+ * Allocate pagerefmap[], big enough for every page of RAM. Called
+ * without the spinlock before the first subpage is made.
+ */
+static
+int
+pagerefmap_create(void)
+{
+	unsigned n, npages;
+	vaddr_t table;
+
+	/* While we're setting up, check the size table is usable. */
+	KASSERT(sizes[0] >= SMALLEST_SUBPAGE_SIZE);
+	KASSERT(sizes[NSIZES-1] == LARGEST_SUBPAGE_SIZE);
+	for (n=0; n<NSIZES; n++) {
+		KASSERT(sizes[n] % 8 == 0);
+		KASSERT(n == 0 || sizes[n] > sizes[n-1]);
+	}
+
+	n = mainbus_ramsize() / PAGE_SIZE;
+	npages = (n * sizeof(struct pageref *) + PAGE_SIZE - 1) / PAGE_SIZE;
+	table = alloc_kpages(npages);
+	if (table == 0) {
+		return -1;
+	}
+	bzero((void *)table, npages * PAGE_SIZE);
+
+	spinlock_acquire(&kmalloc_spinlock);
+	if (pagerefmap != NULL) {
+		/* Somebody beat us to it. */
+		spinlock_release(&kmalloc_spinlock);
+		free_kpages(table);
+		return 0;
+	}
+	npagerefmap = n;
+	pagerefmap = (struct pageref **)table;
+	spinlock_release(&kmalloc_spinlock);
+	return 0;
+}
+
+/*
+ * Look up the pageref of the subpage ADDR is on; NULL if it isn't on
+ * one. Needs no lock if ADDR is an allocated object.
+ */
+static
+struct pageref *
+pagerefmap_get(vaddr_t addr)
+{
+	unsigned pn;
+
+	if (pagerefmap == NULL || addr < MIPS_KSEG0 || addr >= MIPS_KSEG1) {
+		return NULL;
+	}
+	pn = KVADDR_TO_PADDR(addr) / PAGE_SIZE;
+	if (pn >= npagerefmap) {
+		return NULL;
+	}
+	return pagerefmap[pn];
+}
+
+static
+void
+pagerefmap_set(vaddr_t prpage, struct pageref *pr)
+{
+	unsigned pn;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	pn = KVADDR_TO_PADDR(prpage) / PAGE_SIZE;
+	KASSERT(pn < npagerefmap);
+	pagerefmap[pn] = pr;
+}
+
+/*
+ * Take an object from this CPU's magazine, or return NULL if it's empty.
+ */
+static
+void *
+mag_get(unsigned blktype)
+{
+	struct kmcpu *kc;
+	struct magazine *mag;
+	struct freelist *fl;
+	int spl;
+
+	if (!CURCPU_EXISTS()) {
+		return NULL;
+	}
+
+	spl = splhigh();
+	kc = &kmcpus[curcpu->c_number];
+	mag = &kc->mags[blktype];
+	fl = mag->head;
+	if (fl != NULL) {
+		mag->head = fl->next;
+		mag->count--;
+		kc->hits++;
+	}
+	else {
+		kc->misses++;
+	}
+	splx(spl);
+
+	return fl;
+}
+#endif
+
+////////////////////////////////////////
+
 /* SLOWER implies SLOW */
 #ifdef SLOWER
 #ifndef SLOW
@@ -247,6 +573,12 @@ checksubpage(struct pageref *pr)
 #endif
 
 #ifdef SLOWER
+#if OPT_A3
+#define MAXPAGEREFS (npagerefpages * NPAGEREFS)
+#else
+#define MAXPAGEREFS NPAGEREFS
+#endif
+
 static
 void
 checksubpages(void)
@@ -260,14 +592,17 @@ checksubpages(void)
 	for (i=0; i<NSIZES; i++) {
 		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
 			checksubpage(pr);
-			KASSERT(sc < NPAGEREFS);
+			KASSERT(sc < MAXPAGEREFS);
 			sc++;
 		}
 	}
 
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
 		checksubpage(pr);
-		KASSERT(ac < NPAGEREFS);
+#if OPT_A3
+		KASSERT(pagerefmap_get(PR_PAGEADDR(pr)) == pr);
+#endif
+		KASSERT(ac < MAXPAGEREFS);
 		ac++;
 	}
 
@@ -330,10 +665,17 @@ dumpsubpage(struct pageref *pr)
 	kprintf("\n");
 }
 
+#if OPT_KMPROF
+static void kmprof_print(void);
+#endif
+
 void
 kheap_printstats(void)
 {
 	struct pageref *pr;
+#if OPT_A3
+	unsigned i, j, cached;
+#endif
 
 	/* print the whole thing with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
@@ -344,7 +686,29 @@ kheap_printstats(void)
 		dumpsubpage(pr);
 	}
 
+#if OPT_A3
+	kprintf("%u pages of pagerefs\n", npagerefpages);
+
+	/* Other CPUs' counts may be a little out of date; that's fine. */
+	for (i=0; i<MAXCPUS; i++) {
+		if (kmcpus[i].hits == 0 && kmcpus[i].misses == 0) {
+			continue;
+		}
+		cached = 0;
+		for (j=0; j<NSIZES; j++) {
+			cached += kmcpus[i].mags[j].count;
+		}
+		kprintf("cpu%u magazines: %u hits, %u misses, %u objects "
+			"cached\n", i, kmcpus[i].hits, kmcpus[i].misses,
+			cached);
+	}
+#endif
+
 	spinlock_release(&kmalloc_spinlock);
+
+#if OPT_KMPROF
+	kmprof_print();
+#endif
 }
 
 ////////////////////////////////////////
@@ -392,6 +756,73 @@ int blocktype(size_t sz)
 	return 0;
 }
 
+/*
+ * Take the first object off a subpage's freelist, which must not be
+ * empty.
+ */
+static
+void *
+subpage_take(struct pageref *pr)
+{
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *fl;	// free list entry
+	void *retptr;		// our result
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(pr->nfree > 0);
+	KASSERT(pr->freelist_offset < PAGE_SIZE);
+
+	prpage = PR_PAGEADDR(pr);
+	fla = prpage + pr->freelist_offset;
+	fl = (struct freelist *)fla;
+
+	retptr = fl;
+	fl = fl->next;
+	pr->nfree--;
+
+	if (fl != NULL) {
+		KASSERT(pr->nfree > 0);
+		fla = (vaddr_t)fl;
+		KASSERT(fla - prpage < PAGE_SIZE);
+		pr->freelist_offset = fla - prpage;
+	}
+	else {
+		KASSERT(pr->nfree == 0);
+		pr->freelist_offset = INVALID_OFFSET;
+	}
+
+	return retptr;
+}
+
+#if OPT_A3
+/*
+ * Fill this CPU's magazine halfway from a subpage, as far as the page
+ * goes. Holding the spinlock keeps us on this CPU.
+ */
+static
+void
+mag_refill(struct pageref *pr, unsigned blktype)
+{
+	struct magazine *mag;
+	struct freelist *fl;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	if (!CURCPU_EXISTS()) {
+		return;
+	}
+
+	mag = &kmcpus[curcpu->c_number].mags[blktype];
+	while (mag->count < mag_limit(blktype) / 2 && pr->nfree > 0) {
+		fl = subpage_take(pr);
+		fl->next = mag->head;
+		mag->head = fl;
+		mag->count++;
+	}
+}
+#endif
+
 static
 void *
 subpage_kmalloc(size_t sz)
@@ -409,6 +840,13 @@ subpage_kmalloc(size_t sz)
 	blktype = blocktype(sz);
 	sz = sizes[blktype];
 
+#if OPT_A3
+	retptr = mag_get(blktype);
+	if (retptr != NULL) {
+		return retptr;
+	}
+#endif
+
 	spinlock_acquire(&kmalloc_spinlock);
 
 	checksubpages();
@@ -423,25 +861,11 @@ subpage_kmalloc(size_t sz)
 
 		doalloc: /* comes here after getting a whole fresh page */
 
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
-			prpage = PR_PAGEADDR(pr);
-			fla = prpage + pr->freelist_offset;
-			fl = (struct freelist *)fla;
-
-			retptr = fl;
-			fl = fl->next;
-			pr->nfree--;
-
-			if (fl != NULL) {
-				KASSERT(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
-				pr->freelist_offset = fla - prpage;
-			}
-			else {
-				KASSERT(pr->nfree == 0);
-				pr->freelist_offset = INVALID_OFFSET;
-			}
+			retptr = subpage_take(pr);
+#if OPT_A3
+			/* While we have the lock, stock up. */
+			mag_refill(pr, blktype);
+#endif
 
 			checksubpages();
 
@@ -460,6 +884,12 @@ subpage_kmalloc(size_t sz)
 	 */
 
 	spinlock_release(&kmalloc_spinlock);
+#if OPT_A3
+	if (pagerefmap == NULL && pagerefmap_create()) {
+		kprintf("kmalloc: Subpage allocator couldn't get pagerefmap\n");
+		return NULL;
+	}
+#endif
 	prpage = alloc_kpages(1);
 	if (prpage==0) {
 		/* Out of memory. */
@@ -469,6 +899,19 @@ subpage_kmalloc(size_t sz)
 	spinlock_acquire(&kmalloc_spinlock);
 
 	pr = allocpageref();
+#if OPT_A3
+	while (pr==NULL) {
+		/* Get another page of pagerefs, again without the lock. */
+		spinlock_release(&kmalloc_spinlock);
+		if (morepagerefs()) {
+			free_kpages(prpage);
+			kprintf("kmalloc: Subpage allocator couldn't get pageref\n"); 
+			return NULL;
+		}
+		spinlock_acquire(&kmalloc_spinlock);
+		pr = allocpageref();
+	}
+#else
 	if (pr==NULL) {
 		/* Couldn't allocate accounting space for the new page. */
 		spinlock_release(&kmalloc_spinlock);
@@ -476,9 +919,13 @@ subpage_kmalloc(size_t sz)
 		kprintf("kmalloc: Subpage allocator couldn't get pageref\n"); 
 		return NULL;
 	}
+#endif
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
 	pr->nfree = PAGE_SIZE / sizes[blktype];
+#if OPT_A3
+	pagerefmap_set(prpage, pr);
+#endif
 
 	/*
 	 * Note: fl is volatile because the MIPS toolchain we were
@@ -508,23 +955,20 @@ subpage_kmalloc(size_t sz)
 	goto doalloc;
 }
 
+/*
+ * Find the pageref of the page PTRADDR is on by walking every page of
+ * the heap, checking each for corruption on the way. NULL if it is on
+ * none of them. Called with the spinlock held.
+ */
 static
-int
-subpage_kfree(void *ptr)
+struct pageref *
+subpage_find(vaddr_t ptraddr)
 {
-	int blktype;		// index into sizes[] that we're using
-	vaddr_t ptraddr;	// same as ptr
-	struct pageref *pr;	// pageref for page we're freeing in
-	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t fla;		// free list entry address
-	struct freelist *fl;	// free list entry
-	vaddr_t offset;		// offset into page
-
-	ptraddr = (vaddr_t)ptr;
-
-	spinlock_acquire(&kmalloc_spinlock);
+	struct pageref *pr;
+	vaddr_t prpage;
+	int blktype;
 
-	checksubpages();
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
 	for (pr = allbase; pr; pr = pr->next_all) {
 		prpage = PR_PAGEADDR(pr);
@@ -538,17 +982,69 @@ subpage_kfree(void *ptr)
 			break;
 		}
 	}
+	return pr;
+}
+
+/*
+ * Return an object to its subpage's freelist, with the spinlock held,
+ * clearing it first if FILL is set. Returns -1 if PTR isn't on any of
+ * our pages. If that left the page entirely free, it is taken off the
+ * lists and its address is handed back in FREEPAGE for the caller to
+ * free_kpages once it has released the spinlock; otherwise FREEPAGE is
+ * set to 0.
+ */
+static
+int
+subpage_release(void *ptr, bool fill, vaddr_t *freepage)
+{
+	int blktype;		// index into sizes[] that we're using
+	vaddr_t ptraddr;	// same as ptr
+	struct pageref *pr;	// pageref for page we're freeing in
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *fl;	// free list entry
+	vaddr_t offset;		// offset into page
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	ptraddr = (vaddr_t)ptr;
+	*freepage = 0;
+
+#if OPT_A3
+	if (kfree_path == KFREE_WALK) {
+		pr = subpage_find(ptraddr);
+	}
+	else {
+		pr = pagerefmap_get(ptraddr);
+		if (pr != NULL) {
+			checksubpage(pr);
+		}
+	}
+#else
+	pr = subpage_find(ptraddr);
+#endif
 
 	if (pr==NULL) {
 		/* Not on any of our pages - not a subpage allocation */
-		spinlock_release(&kmalloc_spinlock);
 		return -1;
 	}
 
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+
+	/* check for corruption */
+	KASSERT(blktype>=0 && blktype<NSIZES);
+	KASSERT(ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE);
+
 	offset = ptraddr - prpage;
 
-	/* Check for proper positioning and alignment */
-	if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
+	/*
+	 * Check for proper positioning and alignment. With sizes that
+	 * don't divide the page, the tail past the last block is not a
+	 * block either.
+	 */
+	if (offset % sizes[blktype] != 0 ||
+	    offset / sizes[blktype] >= PAGE_SIZE / sizes[blktype]) {
 		panic("kfree: subpage free of invalid addr %p\n", ptr);
 	}
 
@@ -556,7 +1052,9 @@ subpage_kfree(void *ptr)
 	 * Clear the block to 0xdeadbeef to make it easier to detect
 	 * uses of dangling pointers.
 	 */
-	fill_deadbeef(ptr, sizes[blktype]);
+	if (fill) {
+		fill_deadbeef(ptr, sizes[blktype]);
+	}
 
 	/*
 	 * We probably ought to check for free twice by seeing if the block
@@ -578,12 +1076,135 @@ subpage_kfree(void *ptr)
 		/* Whole page is free. */
 		remove_lists(pr, blktype);
 		freepageref(pr);
-		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
+#if OPT_A3
+		pagerefmap_set(prpage, NULL);
+#endif
+		*freepage = prpage;
 	}
-	else {
-		spinlock_release(&kmalloc_spinlock);
+
+	return 0;
+}
+
+#if OPT_A3
+/*
+ * Return a list of objects from a magazine to their pages, all under
+ * one acquisition of the spinlock. They were cleared going into the
+ * magazine.
+ */
+static
+void
+subpage_drain(struct freelist *fl)
+{
+	vaddr_t freepages[MAG_MAX];
+	struct freelist *next;
+	unsigned i, n;
+	int result;
+
+	n = 0;
+	spinlock_acquire(&kmalloc_spinlock);
+	checksubpages();
+	for (; fl != NULL; fl = next) {
+		next = fl->next;
+		KASSERT(n < MAG_MAX);
+		result = subpage_release(fl, false, &freepages[n]);
+		KASSERT(result == 0);
+		if (freepages[n] != 0) {
+			n++;
+		}
+	}
+	checksubpages();
+	spinlock_release(&kmalloc_spinlock);
+
+	/* Call free_kpages without kmalloc_spinlock. */
+	for (i=0; i<n; i++) {
+		free_kpages(freepages[i]);
+	}
+}
+
+/*
+ * Put a cleared object in this CPU's magazine. If the magazine is full,
+ * the older half of it goes back to the pages first.
+ */
+static
+void
+mag_put(void *ptr, unsigned blktype)
+{
+	struct magazine *mag;
+	struct freelist *fl, *drain, **tail;
+	unsigned keep;
+	int spl;
+
+	KASSERT(CURCPU_EXISTS());
+
+	fl = ptr;
+	drain = NULL;
+
+	spl = splhigh();
+	mag = &kmcpus[curcpu->c_number].mags[blktype];
+	if (mag->count >= mag_limit(blktype)) {
+		/* Keep the most recently freed half; it's likely in cache. */
+		keep = mag_limit(blktype) / 2;
+		for (tail = &mag->head; keep > 0; keep--) {
+			tail = &(*tail)->next;
+		}
+		drain = *tail;
+		*tail = NULL;
+		mag->count = mag_limit(blktype) / 2;
+	}
+	fl->next = mag->head;
+	mag->head = fl;
+	mag->count++;
+	splx(spl);
+
+	if (drain != NULL) {
+		subpage_drain(drain);
+	}
+}
+#endif
+
+static
+int
+subpage_kfree(void *ptr)
+{
+	vaddr_t freepage;	// page that is now entirely free, if any
+	int result;
+#if OPT_A3
+	struct pageref *pr;
+	int blktype;
+	vaddr_t offset;
+
+	if (kfree_path == KFREE_MAG && CURCPU_EXISTS()) {
+		pr = pagerefmap_get((vaddr_t)ptr);
+		if (pr == NULL) {
+			/* Not on any of our pages - not a subpage allocation */
+			return -1;
+		}
+		blktype = PR_BLOCKTYPE(pr);
+		offset = (vaddr_t)ptr - PR_PAGEADDR(pr);
+		if (offset % sizes[blktype] != 0 ||
+		    offset / sizes[blktype] >= PAGE_SIZE / sizes[blktype]) {
+			panic("kfree: subpage free of invalid addr %p\n", ptr);
+		}
+		fill_deadbeef(ptr, sizes[blktype]);
+		mag_put(ptr, blktype);
+		return 0;
+	}
+#endif
+
+	spinlock_acquire(&kmalloc_spinlock);
+
+	checksubpages();
+
+	result = subpage_release(ptr, true, &freepage);
+
+	spinlock_release(&kmalloc_spinlock);
+
+	if (result) {
+		return result;
+	}
+	if (freepage != 0) {
+		/* Call free_kpages without kmalloc_spinlock. */
+		free_kpages(freepage);
 	}
 
 #ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
@@ -598,9 +1219,301 @@ subpage_kfree(void *ptr)
 //
 ////////////////////////////////////////////////////////////
 
+#if OPT_KMPROF
+/*
+ * Profiling: what sizes kmalloc is asked for, and by whom.
+ *
+ * Requests for subpages are counted in a histogram with a bucket for
+ * every 8 bytes, and by size class; every request is also counted
+ * against its call site, the address kmalloc returns to. kh prints all
+ * of it, along with how much rounding up to the size classes wastes and
+ * the table of NSIZES classes that would have wasted least.
+ */
+
+#define KMPROF_GRAIN	8	/* bytes per histogram bucket */
+#define KMPROF_NBUCKETS	(LARGEST_SUBPAGE_SIZE / KMPROF_GRAIN)
+#define KMPROF_NSITES	64	/* call sites we keep track of */
+#define KMPROF_TOPSITES	16	/* call sites kh prints */
+
+struct kmsite {
+	void *site;		/* NULL if the slot is free */
+	unsigned count;
+	uint64_t requested;	/* bytes asked for */
+	uint64_t wasted;	/* bytes lost rounding up */
+};
+
+static unsigned kmprof_hist[KMPROF_NBUCKETS];	/* bucket (sz-1)/8 */
+static unsigned kmprof_classcount[NSIZES];
+static uint64_t kmprof_classrequested[NSIZES];
+static unsigned kmprof_large;		/* requests for whole pages */
+static uint64_t kmprof_largerequested;
+static struct kmsite kmprof_sites[KMPROF_NSITES];
+static unsigned kmprof_lostsites;	/* requests from sites not kept */
+static struct spinlock kmprof_spinlock = SPINLOCK_INITIALIZER;
+
+/*
+ * Count a request for SZ bytes from SITE.
+ */
+static
+void
+kmprof_record(size_t sz, void *site)
+{
+	struct kmsite *ks;
+	size_t got;
+	unsigned blktype, h, i;
+
+	if (sz < LARGEST_SUBPAGE_SIZE) {
+		blktype = blocktype(sz);
+		got = sizes[blktype];
+	}
+	else {
+		blktype = NSIZES;
+		got = ROUNDUP(sz, PAGE_SIZE);
+	}
+
+	spinlock_acquire(&kmprof_spinlock);
+
+	if (blktype < NSIZES) {
+		kmprof_hist[sz == 0 ? 0 : (sz-1) / KMPROF_GRAIN]++;
+		kmprof_classcount[blktype]++;
+		kmprof_classrequested[blktype] += sz;
+	}
+	else {
+		kmprof_large++;
+		kmprof_largerequested += sz;
+	}
+
+	/* Open addressing; sites are never removed. */
+	h = ((vaddr_t)site >> 2) % KMPROF_NSITES;
+	for (i=0; i<KMPROF_NSITES; i++) {
+		ks = &kmprof_sites[(h + i) % KMPROF_NSITES];
+		if (ks->site == site || ks->site == NULL) {
+			break;
+		}
+	}
+	if (i < KMPROF_NSITES) {
+		ks->site = site;
+		ks->count++;
+		ks->requested += sz;
+		ks->wasted += got - sz;
+	}
+	else {
+		kmprof_lostsites++;
+	}
+
+	spinlock_release(&kmprof_spinlock);
+}
+
+/*
+ * Find the table of NSIZES size classes, all multiples of KMPROF_GRAIN
+ * and ending at LARGEST_SUBPAGE_SIZE, that would have wasted least on
+ * the requests in HIST, and put it in BEST.
+ *
+ * Since every request in a bucket rounds up to the same class, a table
+ * costs the sum over buckets of count * class, and the best table for
+ * the buckets up to B with K classes, the last ending at B, is the best
+ * for the buckets below some A with K-1 classes plus a class ending at
+ * B for the buckets from A to B. So it's a dynamic program over (K, B).
+ * Returns -1 if out of memory.
+ */
+static
+int
+kmprof_bestsizes(const unsigned *hist, size_t *best)
+{
+	const unsigned lo = SMALLEST_SUBPAGE_SIZE / KMPROF_GRAIN - 1;
+	const unsigned n = KMPROF_NBUCKETS;
+	uint64_t *below;	/* below[b]: requests in buckets < b */
+	uint64_t *cost, *prevcost, *tmp, c;
+	uint16_t *from;		/* from[k*n + b]: first bucket of class k */
+	unsigned k, a, b;
+
+	below = kmalloc((n+1) * sizeof(uint64_t));
+	cost = kmalloc(n * sizeof(uint64_t));
+	prevcost = kmalloc(n * sizeof(uint64_t));
+	from = kmalloc(NSIZES * n * sizeof(uint16_t));
+	if (below == NULL || cost == NULL || prevcost == NULL || from == NULL) {
+		kfree(below);
+		kfree(cost);
+		kfree(prevcost);
+		kfree(from);
+		return -1;
+	}
+
+	below[0] = 0;
+	for (b=0; b<n; b++) {
+		below[b+1] = below[b] + hist[b];
+	}
+	/* Nothing is smaller than the smallest subpage: fold them in. */
+	below[lo] = 0;
+
+	/* cost[b]: least cost for buckets up to b with k+1 classes. */
+	for (b=lo; b<n; b++) {
+		cost[b] = below[b+1] * (b+1) * KMPROF_GRAIN;
+		from[b] = lo;
+	}
+	for (k=1; k<NSIZES; k++) {
+		tmp = prevcost;
+		prevcost = cost;
+		cost = tmp;
+		for (b=lo+k; b<n; b++) {
+			cost[b] = ~(uint64_t)0;
+			for (a=lo+k; a<=b; a++) {
+				c = prevcost[a-1] +
+					(below[b+1] - below[a]) *
+					(b+1) * KMPROF_GRAIN;
+				if (c < cost[b]) {
+					cost[b] = c;
+					from[k*n + b] = a;
+				}
+			}
+		}
+	}
+
+	/* Walk back from the last class. */
+	b = n-1;
+	for (k=NSIZES; k-- > 0; ) {
+		best[k] = (b+1) * KMPROF_GRAIN;
+		b = from[k*n + b] - 1;
+	}
+
+	kfree(below);
+	kfree(cost);
+	kfree(prevcost);
+	kfree(from);
+	return 0;
+}
+
+/*
+ * Print the profile, for kheap_printstats. Called without the spinlock,
+ * since it allocates memory.
+ */
+static
+void
+kmprof_print(void)
+{
+	unsigned *hist;
+	unsigned classcount[NSIZES];
+	uint64_t classrequested[NSIZES];
+	unsigned large;
+	uint64_t largerequested;
+	struct kmsite *sites, tmp;
+	unsigned lostsites;
+	size_t best[NSIZES];
+	uint64_t requested, allocated, newallocated;
+	unsigned i, j, b, top, shown;
+
+	hist = kmalloc(sizeof(kmprof_hist));
+	sites = kmalloc(sizeof(kmprof_sites));
+	if (hist == NULL || sites == NULL) {
+		kfree(hist);
+		kfree(sites);
+		kprintf("kmprof: out of memory\n");
+		return;
+	}
+
+	/* Take a copy, so that nothing below is counted in it. */
+	spinlock_acquire(&kmprof_spinlock);
+	memcpy(hist, kmprof_hist, sizeof(kmprof_hist));
+	memcpy(classcount, kmprof_classcount, sizeof(classcount));
+	memcpy(classrequested, kmprof_classrequested, sizeof(classrequested));
+	large = kmprof_large;
+	largerequested = kmprof_largerequested;
+	memcpy(sites, kmprof_sites, sizeof(kmprof_sites));
+	lostsites = kmprof_lostsites;
+	spinlock_release(&kmprof_spinlock);
+
+	kprintf("kmalloc size classes:\n");
+	requested = allocated = 0;
+	for (i=0; i<NSIZES; i++) {
+		requested += classrequested[i];
+		allocated += (uint64_t)classcount[i] * sizes[i];
+		if (classcount[i] == 0) {
+			continue;
+		}
+		kprintf("  %4lu: %8u allocs, %3u%% wasted\n",
+			(unsigned long)sizes[i], classcount[i],
+			(unsigned)(100 - classrequested[i] * 100 /
+				   ((uint64_t)classcount[i] * sizes[i])));
+	}
+	kprintf("  subpages: %llu bytes requested, %llu allocated, "
+		"%u%% wasted\n", requested, allocated,
+		allocated == 0 ? 0 :
+		(unsigned)((allocated - requested) * 100 / allocated));
+	kprintf("  whole pages: %u allocs, %llu bytes requested\n",
+		large, largerequested);
+
+	kprintf("kmalloc request sizes (bytes: count):\n");
+	shown = 0;
+	for (b=0; b<KMPROF_NBUCKETS; b++) {
+		if (hist[b] == 0) {
+			continue;
+		}
+		kprintf("%s%4u: %-8u", shown % 6 == 0 ? "  " : " ",
+			(b+1) * KMPROF_GRAIN, hist[b]);
+		if (++shown % 6 == 0) {
+			kprintf("\n");
+		}
+	}
+	if (shown % 6 != 0) {
+		kprintf("\n");
+	}
+
+	/* Selection sort the busiest sites to the front. */
+	kprintf("kmalloc call sites (caller: allocs, bytes, wasted):\n");
+	for (i=0; i<KMPROF_TOPSITES; i++) {
+		top = i;
+		for (j=i+1; j<KMPROF_NSITES; j++) {
+			if (sites[j].count > sites[top].count) {
+				top = j;
+			}
+		}
+		if (sites[top].count == 0) {
+			break;
+		}
+		if (top != i) {
+			tmp = sites[i];
+			sites[i] = sites[top];
+			sites[top] = tmp;
+		}
+		kprintf("  %p: %8u, %10llu, %10llu\n", sites[i].site,
+			sites[i].count, sites[i].requested, sites[i].wasted);
+	}
+	if (lostsites > 0) {
+		kprintf("  (%u allocs from sites not kept)\n", lostsites);
+	}
+
+	if (kmprof_bestsizes(hist, best) == 0 && requested > 0) {
+		newallocated = 0;
+		for (b=0; b<KMPROF_NBUCKETS; b++) {
+			for (i=0; i<NSIZES; i++) {
+				if ((b+1) * KMPROF_GRAIN <= best[i]) {
+					break;
+				}
+			}
+			newallocated += (uint64_t)hist[b] * best[i];
+		}
+		kprintf("best %u size classes for these requests:\n ",
+			NSIZES);
+		for (i=0; i<NSIZES; i++) {
+			kprintf(" %lu", (unsigned long)best[i]);
+		}
+		kprintf("\n  %u%% wasted\n",
+			(unsigned)((newallocated - requested) * 100 /
+				   newallocated));
+	}
+
+	kfree(hist);
+	kfree(sites);
+}
+#endif /* OPT_KMPROF */
+
 void *
 kmalloc(size_t sz)
 {
+#if OPT_KMPROF
+	kmprof_record(sz, __builtin_return_address(0));
+#endif
+
 	if (sz>=LARGEST_SUBPAGE_SIZE) {
 		unsigned long npages;
 		vaddr_t address;
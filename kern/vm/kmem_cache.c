@@ -0,0 +1,339 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <kmem_cache.h>
+
+#define KMEM_ALIGN 8 // default alignment, what kmalloc guarantees
+
+struct kmem_slab {
+  struct kmem_cache *ks_cache;
+  struct kmem_slab *ks_next; // on kc_partial or kc_empty, unless full
+  struct kmem_slab *ks_prev;
+  void *ks_free;             // first free object
+  unsigned ks_nfree;
+};
+
+static struct kmem_cache *kmem_caches; // every cache used so far
+static struct spinlock kmem_caches_lock = SPINLOCK_INITIALIZER;
+
+// Helper functions
+static void kc_setup(struct kmem_cache *kc);
+static struct kmem_slab *slab_create(struct kmem_cache *kc);
+static void slab_destroy(struct kmem_cache *kc, struct kmem_slab *slab);
+static void slab_insert(struct kmem_slab **list, struct kmem_slab *slab);
+static void slab_remove(struct kmem_slab **list, struct kmem_slab *slab);
+static void **obj_link(struct kmem_cache *kc, void *obj);
+
+/**
+ * makes a cache
+ * @param  name  for kmem_cache_printstats; must outlive the cache, so
+ *               should be a string constant
+ * @param  size  object size
+ * @param  align object alignment, a power of 2, or 0 for kmalloc's
+ * @param  ctor  sets up a new object, returning an error code; may be NULL
+ * @param  dtor  tears down an object before its slab is freed; may be NULL
+ * @return       the cache, or NULL if out of memory
+ */
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+                                     size_t align, int (*ctor)(void *),
+                                     void (*dtor)(void *)) {
+  struct kmem_cache *kc;
+
+  kc = kmalloc(sizeof(struct kmem_cache));
+  if (kc == NULL) {
+    return NULL;
+  }
+  kc->kc_name = name;
+  kc->kc_size = size;
+  kc->kc_align = align;
+  kc->kc_ctor = ctor;
+  kc->kc_dtor = dtor;
+  kc->kc_dynamic = true;
+  spinlock_init(&kc->kc_lock);
+  kc->kc_stride = 0;
+  kc->kc_first = 0;
+  kc->kc_perslab = 0;
+  kc->kc_partial = NULL;
+  kc->kc_empty = NULL;
+  kc->kc_nslabs = 0;
+  kc->kc_nempty = 0;
+  kc->kc_ninuse = 0;
+  kc->kc_next = NULL;
+  return kc;
+}
+
+/**
+ * destroys a cache made by kmem_cache_create, every object of which must
+ * have been freed
+ * @param kc cache
+ */
+void kmem_cache_destroy(struct kmem_cache *kc) {
+  struct kmem_cache **kcp;
+  struct kmem_slab *slab;
+
+    KASSERT(kc->kc_dynamic);
+    KASSERT(kc->kc_ninuse == 0);
+    KASSERT(kc->kc_partial == NULL);
+
+  spinlock_acquire(&kmem_caches_lock);
+  for (kcp = &kmem_caches; *kcp != NULL; kcp = &(*kcp)->kc_next) {
+    if (*kcp == kc) {
+      *kcp = kc->kc_next;
+      break;
+    }
+  }
+  spinlock_release(&kmem_caches_lock);
+
+  while (kc->kc_empty != NULL) {
+    slab = kc->kc_empty;
+    slab_remove(&kc->kc_empty, slab);
+    slab_destroy(kc, slab);
+  }
+  spinlock_cleanup(&kc->kc_lock);
+  kfree(kc);
+}
+
+/**
+ * allocates an object, constructed
+ * @param  kc cache
+ * @return    the object, or NULL if out of memory
+ */
+void *kmem_cache_alloc(struct kmem_cache *kc) {
+  struct kmem_slab *slab;
+  void *obj;
+
+  if (kc->kc_stride == 0) {
+    kc_setup(kc);
+  }
+
+  spinlock_acquire(&kc->kc_lock);
+  while ((slab = kc->kc_partial) == NULL && (slab = kc->kc_empty) == NULL) {
+    // alloc_kpages and constructors may sleep
+    spinlock_release(&kc->kc_lock);
+    slab = slab_create(kc);
+    if (slab == NULL) {
+      return NULL;
+    }
+    spinlock_acquire(&kc->kc_lock);
+    slab_insert(&kc->kc_empty, slab);
+    kc->kc_nempty++;
+    kc->kc_nslabs++;
+  }
+
+  if (slab->ks_nfree == kc->kc_perslab) {
+    slab_remove(&kc->kc_empty, slab);
+    kc->kc_nempty--;
+    slab_insert(&kc->kc_partial, slab);
+  }
+  obj = slab->ks_free;
+  slab->ks_free = *obj_link(kc, obj);
+  slab->ks_nfree--;
+  kc->kc_ninuse++;
+  if (slab->ks_nfree == 0) {
+    slab_remove(&kc->kc_partial, slab);
+  }
+  spinlock_release(&kc->kc_lock);
+
+  return obj;
+}
+
+/**
+ * frees an object, which must be back in its constructed state
+ * @param kc  cache it came from
+ * @param obj object, or NULL
+ */
+void kmem_cache_free(struct kmem_cache *kc, void *obj) {
+  struct kmem_slab *slab;
+
+  if (obj == NULL) {
+    return;
+  }
+  slab = (struct kmem_slab *)((vaddr_t)obj & PAGE_FRAME);
+    KASSERT(slab->ks_cache == kc);
+    KASSERT(((vaddr_t)obj - (vaddr_t)slab - kc->kc_first) % kc->kc_stride
+            == 0);
+
+  spinlock_acquire(&kc->kc_lock);
+    KASSERT(slab->ks_nfree < kc->kc_perslab);
+  *obj_link(kc, obj) = slab->ks_free;
+  slab->ks_free = obj;
+  slab->ks_nfree++;
+  kc->kc_ninuse--;
+
+  if (slab->ks_nfree == kc->kc_perslab) {
+    // Unless it was full, it was partly used
+    if (kc->kc_perslab > 1) {
+      slab_remove(&kc->kc_partial, slab);
+    }
+    if (kc->kc_nempty > 0) {
+      kc->kc_nslabs--;
+      spinlock_release(&kc->kc_lock);
+      slab_destroy(kc, slab);
+      return;
+    }
+    slab_insert(&kc->kc_empty, slab);
+    kc->kc_nempty++;
+  }
+  else if (slab->ks_nfree == 1) {
+    slab_insert(&kc->kc_partial, slab);
+  }
+  spinlock_release(&kc->kc_lock);
+}
+
+/**
+ * prints every cache's object size and memory use, for the kheap menu
+ * command
+ */
+void kmem_cache_printstats(void) {
+  struct kmem_cache *kc;
+
+  kprintf("Object caches:\n");
+  spinlock_acquire(&kmem_caches_lock);
+  for (kc = kmem_caches; kc != NULL; kc = kc->kc_next) {
+    // Counts may be a little out of date; that's fine here
+    kprintf("%-16s %4lu bytes (%4lu), %u in use, %u slabs (%u empty)\n",
+            kc->kc_name, (unsigned long)kc->kc_size,
+            (unsigned long)kc->kc_stride, kc->kc_ninuse, kc->kc_nslabs,
+            kc->kc_nempty);
+  }
+  spinlock_release(&kmem_caches_lock);
+}
+
+/**
+ * works out a cache's slab layout and adds it to the list of caches, on
+ * its first use
+ * @param kc cache
+ */
+static void kc_setup(struct kmem_cache *kc) {
+  spinlock_acquire(&kmem_caches_lock);
+  if (kc->kc_stride != 0) {
+    // Somebody beat us to it
+    spinlock_release(&kmem_caches_lock);
+    return;
+  }
+
+  if (kc->kc_align == 0) {
+    kc->kc_align = KMEM_ALIGN;
+  }
+    KASSERT((kc->kc_align & (kc->kc_align - 1)) == 0);
+
+  // Room for the free list link past the end of each object
+  kc->kc_first = ROUNDUP(sizeof(struct kmem_slab), kc->kc_align);
+  kc->kc_perslab = (PAGE_SIZE - kc->kc_first) /
+                   ROUNDUP(ROUNDUP(kc->kc_size, sizeof(void *)) +
+                           sizeof(void *), kc->kc_align);
+  if (kc->kc_perslab == 0) {
+    panic("kmem_cache %s: %lu byte objects don't fit in a slab\n",
+          kc->kc_name, (unsigned long)kc->kc_size);
+  }
+
+  kc->kc_next = kmem_caches;
+  kmem_caches = kc;
+  // Last, as it says the rest is done
+  kc->kc_stride = ROUNDUP(ROUNDUP(kc->kc_size, sizeof(void *)) +
+                          sizeof(void *), kc->kc_align);
+  spinlock_release(&kmem_caches_lock);
+}
+
+/**
+ * allocates a slab and constructs its objects; the caller holds no
+ * spinlock
+ * @param  kc cache
+ * @return    the slab, or NULL if out of memory or a constructor failed
+ */
+static struct kmem_slab *slab_create(struct kmem_cache *kc) {
+  struct kmem_slab *slab;
+  vaddr_t obj;
+  unsigned i, j;
+
+  slab = (struct kmem_slab *)alloc_kpages(1);
+  if (slab == NULL) {
+    return NULL;
+  }
+  slab->ks_cache = kc;
+  slab->ks_next = NULL;
+  slab->ks_prev = NULL;
+  slab->ks_free = NULL;
+  slab->ks_nfree = kc->kc_perslab;
+
+  // Link them in reverse so the first object is handed out first
+  for (i = kc->kc_perslab; i-- > 0; ) {
+    obj = (vaddr_t)slab + kc->kc_first + i * kc->kc_stride;
+    if (kc->kc_ctor != NULL && kc->kc_ctor((void *)obj)) {
+      for (j = i + 1; j < kc->kc_perslab && kc->kc_dtor != NULL; j++) {
+        kc->kc_dtor((void *)((vaddr_t)slab + kc->kc_first +
+                             j * kc->kc_stride));
+      }
+      free_kpages((vaddr_t)slab);
+      return NULL;
+    }
+    *obj_link(kc, (void *)obj) = slab->ks_free;
+    slab->ks_free = (void *)obj;
+  }
+  return slab;
+}
+
+/**
+ * destroys an empty slab's objects and frees it; the caller holds no
+ * spinlock
+ * @param kc   cache
+ * @param slab slab, on no list
+ */
+static void slab_destroy(struct kmem_cache *kc, struct kmem_slab *slab) {
+  void *obj;
+
+    KASSERT(slab->ks_nfree == kc->kc_perslab);
+
+  if (kc->kc_dtor != NULL) {
+    for (obj = slab->ks_free; obj != NULL; obj = *obj_link(kc, obj)) {
+      kc->kc_dtor(obj);
+    }
+  }
+  free_kpages((vaddr_t)slab);
+}
+
+/**
+ * puts a slab at the head of a list
+ * @param list list
+ * @param slab slab, on no list
+ */
+static void slab_insert(struct kmem_slab **list, struct kmem_slab *slab) {
+  slab->ks_prev = NULL;
+  slab->ks_next = *list;
+  if (*list != NULL) {
+    (*list)->ks_prev = slab;
+  }
+  *list = slab;
+}
+
+/**
+ * takes a slab off a list
+ * @param list list
+ * @param slab slab on it
+ */
+static void slab_remove(struct kmem_slab **list, struct kmem_slab *slab) {
+  if (slab->ks_prev != NULL) {
+    slab->ks_prev->ks_next = slab->ks_next;
+  }
+  else {
+      KASSERT(*list == slab);
+    *list = slab->ks_next;
+  }
+  if (slab->ks_next != NULL) {
+    slab->ks_next->ks_prev = slab->ks_prev;
+  }
+  slab->ks_next = NULL;
+  slab->ks_prev = NULL;
+}
+
+/**
+ * @param  kc  cache
+ * @param  obj object
+ * @return     the word past the end of the object that links it into its
+ *             slab's free list
+ */
+static void **obj_link(struct kmem_cache *kc, void *obj) {
+  return (void **)((vaddr_t)obj + ROUNDUP(kc->kc_size, sizeof(void *)));
+}
@@ -0,0 +1,412 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <synch.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vm.h>
+#include <coremap.h>
+#include <pagecache.h>
+#include <uw-vmstats.h>
+
+#define PC_NBUCKETS 64
+#define PC_MAPPEDSCAN 16 // mapped pages pagecache_reclaimmapped looks at,
+                         // give or take the rest of a bucket
+
+struct pcpage {
+  struct vnode *pp_vnode; // holds a reference
+  off_t pp_offset;        // page aligned
+  paddr_t pp_paddr;       // holds a coremap reference
+  bool pp_dirty;
+  bool pp_busy;           // being written back; not to be dropped
+  struct pcpage *pp_next;
+};
+
+static struct pcpage *pc_buckets[PC_NBUCKETS];
+static unsigned pc_reclaimhand; // next bucket pagecache_reclaim looks at
+static unsigned pc_mappedhand;  // and pagecache_reclaimmapped
+static struct lock *pc_lock;
+static struct cv *pc_cv; // a write-back finished
+
+// Helper functions
+static unsigned pc_hash(struct vnode *vn, off_t offset);
+static struct pcpage *pc_find(struct vnode *vn, off_t offset);
+static struct pcpage **pc_link(struct pcpage *pp);
+static int pc_writeback(struct pcpage *pp);
+static void pc_drop(struct pcpage **ppp);
+
+/**
+ * sets up the page cache; must be called once, after the coremap
+ */
+void pagecache_bootstrap(void) {
+  unsigned i;
+
+  pc_lock = lock_create("pagecache");
+  if (pc_lock == NULL) {
+    panic("pagecache_bootstrap: Out of memory\n");
+  }
+  pc_cv = cv_create("pagecache");
+  if (pc_cv == NULL) {
+    panic("pagecache_bootstrap: Out of memory\n");
+  }
+  for (i = 0; i < PC_NBUCKETS; i++) {
+    pc_buckets[i] = NULL;
+  }
+  pc_reclaimhand = 0;
+  pc_mappedhand = 0;
+}
+
+/**
+ * finds a cached page
+ * @param  vn     file
+ * @param  offset page aligned offset in the file
+ * @return        the frame holding the page with a new reference for the
+ *                caller, 0 if the page is not cached
+ */
+paddr_t pagecache_lookup(struct vnode *vn, off_t offset) {
+  struct pcpage *pp;
+  paddr_t paddr = 0;
+
+    KASSERT((offset & ~(off_t)PAGE_FRAME) == 0);
+
+  lock_acquire(pc_lock);
+  pp = pc_find(vn, offset);
+  if (pp != NULL) {
+    coremap_share(pp->pp_paddr);
+    paddr = pp->pp_paddr;
+  }
+  lock_release(pc_lock);
+  return paddr;
+}
+
+/**
+ * reads a page into a fresh zeroed frame and caches it, unless somebody
+ * else cached the same page since pagecache_lookup missed or while it was
+ * being read
+ * @param  vn     file
+ * @param  offset page aligned offset in the file
+ * @param  paddr  zeroed user frame the caller holds the only reference to
+ * @param  ret    destination for the cached frame, with the caller's
+ *                reference; if it is not paddr the caller frees paddr
+ * @return        0 on success, or the error from reading the file
+ */
+int pagecache_fill(struct vnode *vn, off_t offset, paddr_t paddr,
+                   paddr_t *ret) {
+  struct pcpage *pp, *theirs;
+  struct iovec iov;
+  struct uio u;
+  unsigned i;
+  int result;
+
+    KASSERT((offset & ~(off_t)PAGE_FRAME) == 0);
+
+  pp = kmalloc(sizeof(struct pcpage));
+  if (pp == NULL) {
+    return ENOMEM;
+  }
+
+  // Nothing else knows of the frame yet, so read it without pc_lock and
+  // other misses need not wait for this one's disk I/O. A short read just
+  // means the page runs past the end of the file
+  uio_kinit(&iov, &u, (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE, offset,
+            UIO_READ);
+  result = VOP_READ(vn, &u);
+  if (result) {
+    kfree(pp);
+    return result;
+  }
+  vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+  vmstats_inc(VMSTAT_ELF_FILE_READ);
+
+  lock_acquire(pc_lock);
+
+  theirs = pc_find(vn, offset);
+  if (theirs != NULL) {
+    // Lost the race while reading; use theirs
+    kfree(pp);
+    coremap_share(theirs->pp_paddr);
+    *ret = theirs->pp_paddr;
+    lock_release(pc_lock);
+    return 0; // Success
+  }
+
+  VOP_INCREF(vn);
+  pp->pp_vnode = vn;
+  pp->pp_offset = offset;
+  pp->pp_paddr = paddr;
+  pp->pp_dirty = false;
+  pp->pp_busy = false;
+  i = pc_hash(vn, offset);
+  pp->pp_next = pc_buckets[i];
+  pc_buckets[i] = pp;
+
+  // The cache's own reference; the frame no longer has a single owner
+  coremap_share(paddr);
+  *ret = paddr;
+
+  lock_release(pc_lock);
+  return 0; // Success
+}
+
+/**
+ * records that a mapping has written a cached page
+ * @param vn     file
+ * @param offset page aligned offset in the file
+ */
+void pagecache_markdirty(struct vnode *vn, off_t offset) {
+  struct pcpage *pp;
+
+  lock_acquire(pc_lock);
+  pp = pc_find(vn, offset);
+    KASSERT(pp != NULL);
+  pp->pp_dirty = true;
+  lock_release(pc_lock);
+}
+
+/**
+ * writes back every dirty cached page of a file
+ * @param  vn file
+ * @return    0 on success, otherwise the first write-back error
+ */
+int pagecache_flush(struct vnode *vn) {
+  struct pcpage *pp;
+  unsigned i;
+  int result, err = 0;
+
+  lock_acquire(pc_lock);
+  for (i = 0; i < PC_NBUCKETS; i++) {
+    pp = pc_buckets[i];
+    while (pp != NULL) {
+      if (pp->pp_vnode != vn || !pp->pp_dirty) {
+        pp = pp->pp_next;
+        continue;
+      }
+      if (pp->pp_busy) {
+        // It may be gone when we wake up; start the bucket again
+        cv_wait(pc_cv, pc_lock);
+        pp = pc_buckets[i];
+        continue;
+      }
+      result = pc_writeback(pp);
+      if (result && !err) {
+        err = result;
+      }
+      pp = pp->pp_next;
+    }
+  }
+  lock_release(pc_lock);
+  return err;
+}
+
+/**
+ * frees one cached page that nobody has mapped, writing it back first if
+ * it is dirty
+ * @return 0 if a frame was freed, ENOMEM if every cached page is mapped,
+ *         or the error from writing it back
+ */
+int pagecache_reclaim(void) {
+  struct pcpage **ppp, *pp;
+  unsigned n, i;
+  int result;
+
+  lock_acquire(pc_lock);
+  for (n = 0; n < PC_NBUCKETS; n++) {
+    i = pc_reclaimhand;
+    pc_reclaimhand = (i + 1) % PC_NBUCKETS;
+
+    for (ppp = &pc_buckets[i]; *ppp != NULL; ppp = &(*ppp)->pp_next) {
+      pp = *ppp;
+      if (pp->pp_busy || coremap_refcount(pp->pp_paddr) != 1) {
+        continue;
+      }
+      if (pp->pp_dirty) {
+        result = pc_writeback(pp);
+        if (result) {
+          lock_release(pc_lock);
+          return result;
+        }
+        // Mapped or written again while pc_lock was let go?
+        ppp = pc_link(pp);
+        if (pp->pp_dirty || coremap_refcount(pp->pp_paddr) != 1) {
+          continue;
+        }
+      }
+      pc_drop(ppp);
+      lock_release(pc_lock);
+      return 0; // Success
+    }
+  }
+  lock_release(pc_lock);
+  return ENOMEM;
+}
+
+/**
+ * frees one cached page that is mapped, taking it away from everybody
+ * who maps it and writing it back first if it is dirty; pages touched
+ * since they were last looked at here, or mapped by an address space
+ * that is busy, are passed over
+ * @return 0 if a frame was freed, ENOMEM if none could be, or the error
+ *         from writing it back
+ */
+int pagecache_reclaimmapped(void) {
+  struct pcpage **ppp, *pp;
+  unsigned n, i, seen = 0;
+  bool dirty;
+  int result;
+
+  lock_acquire(pc_lock);
+  for (n = 0; n < PC_NBUCKETS && seen < PC_MAPPEDSCAN; n++) {
+    i = pc_mappedhand;
+    pc_mappedhand = (i + 1) % PC_NBUCKETS;
+
+    for (ppp = &pc_buckets[i]; *ppp != NULL; ppp = &(*ppp)->pp_next) {
+      pp = *ppp;
+      if (pp->pp_busy) {
+        continue;
+      }
+      seen++;
+      vm_unmapcached(pp->pp_vnode, pp->pp_offset, pp->pp_paddr, &dirty);
+      if (dirty) {
+        pp->pp_dirty = true;
+      }
+      // Still mapped somewhere, or mapped again by a fork meanwhile
+      if (coremap_refcount(pp->pp_paddr) != 1) {
+        continue;
+      }
+      if (pp->pp_dirty) {
+        result = pc_writeback(pp);
+        if (result) {
+          lock_release(pc_lock);
+          return result;
+        }
+        ppp = pc_link(pp);
+        if (pp->pp_dirty || coremap_refcount(pp->pp_paddr) != 1) {
+          continue;
+        }
+      }
+      pc_drop(ppp);
+      lock_release(pc_lock);
+      return 0; // Success
+    }
+  }
+  lock_release(pc_lock);
+  return ENOMEM;
+}
+
+/**
+ * writes back and drops every cached page nobody has mapped, giving back
+ * the vnode references so file systems can be unmounted
+ */
+void pagecache_purge(void) {
+  while (pagecache_reclaim() == 0) {
+    // nothing
+  }
+}
+
+/**
+ * @param  vn     file
+ * @param  offset page aligned offset
+ * @return        bucket for the page
+ */
+static unsigned pc_hash(struct vnode *vn, off_t offset) {
+  return ((uintptr_t)vn / sizeof(struct vnode) + offset / PAGE_SIZE) %
+         PC_NBUCKETS;
+}
+
+/**
+ * finds a cached page; the caller holds pc_lock
+ * @param  vn     file
+ * @param  offset page aligned offset
+ * @return        the page, NULL if it is not cached
+ */
+static struct pcpage *pc_find(struct vnode *vn, off_t offset) {
+  struct pcpage *pp;
+
+    KASSERT(lock_do_i_hold(pc_lock));
+
+  for (pp = pc_buckets[pc_hash(vn, offset)]; pp != NULL; pp = pp->pp_next) {
+    if (pp->pp_vnode == vn && pp->pp_offset == offset) {
+      return pp;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * finds the link pointing at a cached page; the caller holds pc_lock
+ * @param  pp page, which must be cached
+ * @return    the bucket head or pp_next pointing at pp
+ */
+static struct pcpage **pc_link(struct pcpage *pp) {
+  struct pcpage **ppp;
+
+    KASSERT(lock_do_i_hold(pc_lock));
+
+  ppp = &pc_buckets[pc_hash(pp->pp_vnode, pp->pp_offset)];
+  while (*ppp != pp) {
+      KASSERT(*ppp != NULL);
+    ppp = &(*ppp)->pp_next;
+  }
+  return ppp;
+}
+
+/**
+ * writes a dirty page back to its file, stopping at end of file; the caller
+ * holds pc_lock, which is let go during the disk I/O, so the buckets may
+ * have changed by the time this returns. The page itself stays cached:
+ * nobody drops or writes back a page that is busy
+ * @param  pp page, not busy
+ * @return    0 on success, or the error from the file system
+ */
+static int pc_writeback(struct pcpage *pp) {
+  struct stat st;
+  struct iovec iov;
+  struct uio u;
+  size_t len;
+  int result;
+
+    KASSERT(lock_do_i_hold(pc_lock));
+    KASSERT(!pp->pp_busy);
+
+  // Cleared first, so a pagecache_markdirty meanwhile is not lost
+  pp->pp_busy = true;
+  pp->pp_dirty = false;
+  lock_release(pc_lock);
+
+  result = VOP_STAT(pp->pp_vnode, &st);
+  if (!result && pp->pp_offset < st.st_size) {
+    len = PAGE_SIZE;
+    if (st.st_size - pp->pp_offset < PAGE_SIZE) {
+      len = st.st_size - pp->pp_offset;
+    }
+    uio_kinit(&iov, &u, (void *)PADDR_TO_KVADDR(pp->pp_paddr), len,
+              pp->pp_offset, UIO_WRITE);
+    result = VOP_WRITE(pp->pp_vnode, &u);
+  }
+
+  lock_acquire(pc_lock);
+  if (result) {
+    pp->pp_dirty = true;
+  }
+  pp->pp_busy = false;
+  cv_broadcast(pc_cv, pc_lock);
+  return result;
+}
+
+/**
+ * unlinks a page and gives back its frame and vnode; the caller holds
+ * pc_lock
+ * @param ppp link pointing at the page
+ */
+static void pc_drop(struct pcpage **ppp) {
+  struct pcpage *pp = *ppp;
+
+    KASSERT(lock_do_i_hold(pc_lock));
+    KASSERT(!pp->pp_busy);
+
+  *ppp = pp->pp_next;
+  coremap_free(pp->pp_paddr);
+  VOP_DECREF(pp->pp_vnode);
+  kfree(pp);
+}
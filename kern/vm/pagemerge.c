@@ -0,0 +1,305 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <thread.h>
+#include <clock.h>
+#include <vm.h>
+#include <addrspace.h>
+#include <pagetable.h>
+#include <coremap.h>
+#include <pagemerge.h>
+#include <vmtune.h>
+#include <uw-vmstats.h>
+
+#define PM_NBUCKETS 64
+
+struct pmpage {
+  uint32_t pm_hash;       // of the contents when the page was scanned
+  paddr_t pm_paddr;
+  struct pmpage *pm_next;
+};
+
+static struct pmpage *pm_merged[PM_NBUCKETS];     // hold a coremap reference
+static struct pmpage *pm_candidates[PM_NBUCKETS]; // don't, and may be stale
+static unsigned pm_reclaimhand; // next bucket pagemerge_reclaim looks at
+static struct lock *pm_lock;
+
+// Helper functions
+static void pm_thread(void *data1, unsigned long data2);
+static void pm_scanpage(void);
+static bool pm_merge(struct addrspace *as, vaddr_t vaddr, paddr_t paddr,
+                     uint32_t hash);
+static void pm_remap(struct addrspace *as, vaddr_t vaddr, paddr_t paddr);
+static uint32_t pm_hash(paddr_t paddr);
+static bool pm_same(paddr_t a, paddr_t b);
+static void pm_flushcandidates(void);
+
+/**
+ * sets up the merge table and starts the scanner thread; must be called
+ * once, after the coremap
+ */
+void pagemerge_bootstrap(void) {
+  unsigned i;
+  int result;
+
+  pm_lock = lock_create("pagemerge");
+  if (pm_lock == NULL) {
+    panic("pagemerge_bootstrap: Out of memory\n");
+  }
+  for (i = 0; i < PM_NBUCKETS; i++) {
+    pm_merged[i] = NULL;
+    pm_candidates[i] = NULL;
+  }
+  pm_reclaimhand = 0;
+
+  result = thread_fork("pagemerge", NULL, pm_thread, NULL, 0);
+  if (result) {
+    panic("pagemerge_bootstrap: thread_fork failed: %s\n",
+          strerror(result));
+  }
+}
+
+/**
+ * frees one merged frame that nobody maps any more
+ * @return 0 if a frame was freed, ENOMEM if every merged frame is mapped
+ */
+int pagemerge_reclaim(void) {
+  struct pmpage **ppp, *pp;
+  unsigned n, i;
+
+  lock_acquire(pm_lock);
+  for (n = 0; n < PM_NBUCKETS; n++) {
+    i = pm_reclaimhand;
+    pm_reclaimhand = (i + 1) % PM_NBUCKETS;
+
+    for (ppp = &pm_merged[i]; *ppp != NULL; ppp = &(*ppp)->pm_next) {
+      // Nobody maps it, and nobody can start to without the table
+      if (coremap_refcount((*ppp)->pm_paddr) != 1) {
+        continue;
+      }
+      pp = *ppp;
+      *ppp = pp->pm_next;
+      coremap_free(pp->pm_paddr);
+      kfree(pp);
+      lock_release(pm_lock);
+      return 0; // Success
+    }
+  }
+  lock_release(pm_lock);
+  return ENOMEM;
+}
+
+/**
+ * scanner thread: looks at vm_mergerate pages, then sleeps for a second
+ * @param data1 unused
+ * @param data2 unused
+ */
+static void pm_thread(void *data1, unsigned long data2) {
+  int n;
+
+  (void)data1;
+  (void)data2;
+
+  while (true) {
+    for (n = 0; n < vm_mergerate; n++) {
+      pm_scanpage();
+    }
+    clocksleep(1);
+  }
+}
+
+/**
+ * looks at the next page of the sweep and merges it if it can; at the end
+ * of a sweep, forgets its candidates and frees the merged frames that were
+ * split off from every mapping
+ */
+static void pm_scanpage(void) {
+  struct addrspace *as;
+  vaddr_t vaddr;
+  paddr_t paddr;
+  bool locked;
+
+  paddr = coremap_nextowned(&as, &vaddr, &locked);
+  if (paddr == 0) {
+    lock_acquire(pm_lock);
+    pm_flushcandidates();
+    lock_release(pm_lock);
+    while (pagemerge_reclaim() == 0) {
+      // nothing
+    }
+    return;
+  }
+  vmstats_inc(VMSTAT_MERGE_SCANNED);
+
+  lock_acquire(pm_lock);
+  if (pm_merge(as, vaddr, paddr, pm_hash(paddr))) {
+    vmstats_inc(VMSTAT_MERGE_MERGED);
+  }
+  lock_release(pm_lock);
+
+  if (locked) {
+    lock_release(as->as_lock);
+  }
+}
+
+/**
+ * merges a page with a merged frame or a candidate with the same contents,
+ * or else makes it a candidate itself; the caller holds pm_lock and the
+ * page's as_lock
+ * @param  as    address space the page belongs to
+ * @param  vaddr the page
+ * @param  paddr its frame, which has no other owner
+ * @param  hash  of its contents, which may have changed since
+ * @return       true if the page now maps a merged frame
+ */
+static bool pm_merge(struct addrspace *as, vaddr_t vaddr, paddr_t paddr,
+                     uint32_t hash) {
+  struct pmpage **ppp, *pp;
+  struct addrspace *cas;
+  vaddr_t cvaddr;
+  pte_t *pte;
+  unsigned i = hash % PM_NBUCKETS;
+  bool frozen = false, clocked;
+
+    KASSERT(lock_do_i_hold(pm_lock));
+    KASSERT(lock_do_i_hold(as->as_lock));
+
+  // Merged frames are read-only everywhere, so only the page can change;
+  // once no TLB maps it, it can't without a fault, which needs as_lock
+  for (pp = pm_merged[i]; pp != NULL; pp = pp->pm_next) {
+    if (pp->pm_hash != hash) {
+      continue;
+    }
+    if (!frozen) {
+      vm_tlbinvalidate(as, vaddr);
+      frozen = true;
+    }
+    if (pm_same(paddr, pp->pm_paddr)) {
+      coremap_share(pp->pm_paddr);
+      pm_remap(as, vaddr, pp->pm_paddr);
+      return true;
+    }
+  }
+
+  // A candidate has to be frozen the same way, under its owner's lock
+  for (ppp = &pm_candidates[i]; *ppp != NULL; ppp = &(*ppp)->pm_next) {
+    pp = *ppp;
+    if (pp->pm_hash != hash || pp->pm_paddr == paddr) {
+      continue;
+    }
+    if (!coremap_lockowner(pp->pm_paddr, &cas, &cvaddr, &clocked)) {
+      // Freed, shared or busy since; the sweep's end drops it
+      continue;
+    }
+    if (!frozen) {
+      vm_tlbinvalidate(as, vaddr);
+      frozen = true;
+    }
+    vm_tlbinvalidate(cas, cvaddr);
+
+    if (pm_same(paddr, pp->pm_paddr)) {
+      // The candidate's frame becomes a merged one, with our reference;
+      // rehash it now that it can't change, or lookups may miss it
+      *ppp = pp->pm_next;
+      pp->pm_hash = pm_hash(pp->pm_paddr);
+      pp->pm_next = pm_merged[pp->pm_hash % PM_NBUCKETS];
+      pm_merged[pp->pm_hash % PM_NBUCKETS] = pp;
+      coremap_share(pp->pm_paddr);
+      pte = pt_lookup(cas->as_pt, cvaddr, false);
+      *pte |= PTE_MERGED;
+      if (clocked) {
+        lock_release(cas->as_lock);
+      }
+
+      coremap_share(pp->pm_paddr);
+      pm_remap(as, vaddr, pp->pm_paddr);
+      return true;
+    }
+    if (clocked) {
+      lock_release(cas->as_lock);
+    }
+  }
+
+  // Out of memory just means one page less to merge with
+  pp = kmalloc(sizeof(struct pmpage));
+  if (pp != NULL) {
+    pp->pm_hash = hash;
+    pp->pm_paddr = paddr;
+    pp->pm_next = pm_candidates[i];
+    pm_candidates[i] = pp;
+  }
+  return false;
+}
+
+/**
+ * points a page no TLB maps at a merged frame and frees its own; the
+ * caller holds as_lock and has added the new mapping's reference
+ * @param as    address space
+ * @param vaddr the page
+ * @param paddr merged frame
+ */
+static void pm_remap(struct addrspace *as, vaddr_t vaddr, paddr_t paddr) {
+  pte_t *pte;
+  paddr_t oldpa;
+
+  pte = pt_lookup(as->as_pt, vaddr, false);
+    KASSERT(pte != NULL && (*pte & PTE_VALID));
+
+  // Keep PTE_DIRTY: a clean page still matches its file, being the same
+  oldpa = *pte & PTE_FRAME;
+  *pte = paddr | (*pte & ~PTE_FRAME) | PTE_MERGED;
+  coremap_free(oldpa);
+}
+
+/**
+ * FNV-1a over the words of a page
+ * @param  paddr frame
+ * @return       hash of its contents
+ */
+static uint32_t pm_hash(paddr_t paddr) {
+  const uint32_t *words = (const uint32_t *)PADDR_TO_KVADDR(paddr);
+  uint32_t hash = 2166136261U;
+  unsigned i;
+
+  for (i = 0; i < PAGE_SIZE / sizeof(uint32_t); i++) {
+    hash = (hash ^ words[i]) * 16777619U;
+  }
+  return hash;
+}
+
+/**
+ * @param  a frame
+ * @param  b frame
+ * @return   whether the two frames hold the same bytes
+ */
+static bool pm_same(paddr_t a, paddr_t b) {
+  const uint32_t *wa = (const uint32_t *)PADDR_TO_KVADDR(a);
+  const uint32_t *wb = (const uint32_t *)PADDR_TO_KVADDR(b);
+  unsigned i;
+
+  for (i = 0; i < PAGE_SIZE / sizeof(uint32_t); i++) {
+    if (wa[i] != wb[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * forgets every candidate; the caller holds pm_lock
+ */
+static void pm_flushcandidates(void) {
+  struct pmpage *pp;
+  unsigned i;
+
+    KASSERT(lock_do_i_hold(pm_lock));
+
+  for (i = 0; i < PM_NBUCKETS; i++) {
+    while (pm_candidates[i] != NULL) {
+      pp = pm_candidates[i];
+      pm_candidates[i] = pp->pm_next;
+      kfree(pp);
+    }
+  }
+}
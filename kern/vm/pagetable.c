@@ -0,0 +1,134 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <vm.h>
+#include <coremap.h>
+#include <swap.h>
+#include <pagetable.h>
+
+// Helper functions
+static pte_t *pt_newleaf(void);
+
+/**
+ * creates an empty page table
+ * @return new page table, NULL if out of memory
+ */
+struct pagetable *pt_create(void) {
+  struct pagetable *pt;
+  int i;
+
+  pt = kmalloc(sizeof(struct pagetable));
+  if (pt == NULL) {
+    return NULL;
+  }
+  for (i = 0; i < PT_NDIR; i++) {
+    pt->pt_dir[i] = NULL;
+  }
+  return pt;
+}
+
+/**
+ * destroys a page table, dropping the frame behind every resident page and
+ * the slot behind every swapped out one
+ * @param pt page table
+ */
+void pt_destroy(struct pagetable *pt) {
+  int i, j;
+
+    KASSERT(pt != NULL);
+
+  for (i = 0; i < PT_NDIR; i++) {
+    if (pt->pt_dir[i] == NULL) {
+      continue;
+    }
+    for (j = 0; j < PT_NLEAF; j++) {
+      if (pt->pt_dir[i][j] & PTE_VALID) {
+        coremap_free(pt->pt_dir[i][j] & PTE_FRAME);
+      }
+      else if (pt->pt_dir[i][j] & PTE_SWAPPED) {
+        swap_free(PTE_SWAPSLOT(pt->pt_dir[i][j]));
+      }
+    }
+    kfree(pt->pt_dir[i]);
+  }
+  kfree(pt);
+}
+
+/**
+ * finds the entry for a virtual page
+ * @param  pt     page table
+ * @param  vaddr  any address in the page
+ * @param  create whether to allocate the leaf if it does not exist yet
+ * @return        the entry, NULL if the leaf does not exist and either create
+ *                is false or there is no memory for it
+ */
+pte_t *pt_lookup(struct pagetable *pt, vaddr_t vaddr, bool create) {
+  pte_t *leaf;
+
+    KASSERT(pt != NULL);
+
+  leaf = pt->pt_dir[PT_DIRINDEX(vaddr)];
+  if (leaf == NULL) {
+    if (!create) {
+      return NULL;
+    }
+    leaf = pt_newleaf();
+    if (leaf == NULL) {
+      return NULL;
+    }
+    pt->pt_dir[PT_DIRINDEX(vaddr)] = leaf;
+  }
+  return &leaf[PT_LEAFINDEX(vaddr)];
+}
+
+/**
+ * makes new map the same pages as old, sharing every resident frame
+ * copy-on-write and every swap slot
+ * @param  old page table to copy
+ * @param  new empty page table
+ * @return     0 on success, ENOMEM otherwise (new may be partly filled in)
+ */
+int pt_copy(struct pagetable *old, struct pagetable *new) {
+  int i, j;
+  pte_t pte;
+
+  for (i = 0; i < PT_NDIR; i++) {
+    if (old->pt_dir[i] == NULL) {
+      continue;
+    }
+      KASSERT(new->pt_dir[i] == NULL);
+    new->pt_dir[i] = pt_newleaf();
+    if (new->pt_dir[i] == NULL) {
+      return ENOMEM;
+    }
+    for (j = 0; j < PT_NLEAF; j++) {
+      pte = old->pt_dir[i][j];
+      if (pte & PTE_VALID) {
+        coremap_share(pte & PTE_FRAME);
+      }
+      else if (pte & PTE_SWAPPED) {
+        swap_share(PTE_SWAPSLOT(pte));
+      }
+      new->pt_dir[i][j] = pte;
+    }
+  }
+  return 0; // Success
+}
+
+/**
+ * allocates a leaf page with every entry invalid
+ * @return leaf, NULL if out of memory
+ */
+static pte_t *pt_newleaf(void) {
+  pte_t *leaf;
+  int i;
+
+  leaf = kmalloc(PT_NLEAF * sizeof(pte_t));
+  if (leaf == NULL) {
+    return NULL;
+  }
+  for (i = 0; i < PT_NLEAF; i++) {
+    leaf[i] = 0;
+  }
+  return leaf;
+}
@@ -0,0 +1,221 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <bitmap.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <vm.h>
+#include <swap.h>
+#include <zswap.h>
+#include <uw-vmstats.h>
+
+static struct vnode *swap_vnode;   // NULL if there is no swap space
+static struct bitmap *swap_map;    // slots in use
+static uint16_t *swap_refs;        // mappings of each slot in use
+static unsigned swap_nslots;
+
+static struct spinlock swap_lock = SPINLOCK_INITIALIZER;
+
+// Helper functions
+static int swap_io(unsigned slot, paddr_t paddr, enum uio_rw rw);
+
+/**
+ * opens the swap device and sets up the slot map; without it the system
+ * runs, but cannot evict dirty pages
+ * @return 0 on success, error code otherwise
+ */
+int swap_bootstrap(void) {
+  char path[sizeof(SWAP_DEVICE)];
+  struct vnode *v;
+  struct stat st;
+  unsigned i;
+  int result;
+
+  // vfs_open may modify the path
+  strcpy(path, SWAP_DEVICE);
+  result = vfs_open(path, O_RDWR, 0, &v);
+  if (result) {
+    return result;
+  }
+
+  result = VOP_STAT(v, &st);
+  if (result) {
+    vfs_close(v);
+    return result;
+  }
+  swap_nslots = st.st_size / PAGE_SIZE;
+  if (swap_nslots == 0) {
+    vfs_close(v);
+    return ENOSPC;
+  }
+
+  swap_map = bitmap_create(swap_nslots);
+  swap_refs = kmalloc(swap_nslots * sizeof(uint16_t));
+  if (swap_map == NULL || swap_refs == NULL) {
+    if (swap_map != NULL) {
+      bitmap_destroy(swap_map);
+    }
+    if (swap_refs != NULL) {
+      kfree(swap_refs);
+    }
+    vfs_close(v);
+    return ENOMEM;
+  }
+  for (i = 0; i < swap_nslots; i++) {
+    swap_refs[i] = 0;
+  }
+
+  // Slots still work without the compressed cache, just slower
+  result = zswap_bootstrap(swap_nslots);
+  if (result) {
+    kprintf("swap: no compressed cache (%s)\n", strerror(result));
+  }
+
+  // Only now can slots be handed out
+  swap_vnode = v;
+  kprintf("swap: %u pages on %s\n", swap_nslots, SWAP_DEVICE);
+  return 0; // Success
+}
+
+/**
+ * allocates a swap slot
+ * @param  slot destination for the slot number
+ * @return      0 on success, ENOSPC if swap is full or missing
+ */
+int swap_alloc(unsigned *slot) {
+  int result;
+
+  if (swap_vnode == NULL) {
+    return ENOSPC;
+  }
+
+  spinlock_acquire(&swap_lock);
+  result = bitmap_alloc(swap_map, slot);
+  if (!result) {
+    swap_refs[*slot] = 1;
+  }
+  spinlock_release(&swap_lock);
+  return result;
+}
+
+/**
+ * adds a reference to a slot, for a page that fork shares while swapped out
+ * @param slot slot number
+ */
+void swap_share(unsigned slot) {
+  spinlock_acquire(&swap_lock);
+    KASSERT(slot < swap_nslots && bitmap_isset(swap_map, slot));
+    KASSERT(swap_refs[slot] < 0xffff);
+  swap_refs[slot]++;
+  spinlock_release(&swap_lock);
+}
+
+/**
+ * drops a reference to a slot, freeing it with the last one
+ * @param slot slot number
+ */
+void swap_free(unsigned slot) {
+  unsigned refs;
+
+  spinlock_acquire(&swap_lock);
+    KASSERT(slot < swap_nslots && bitmap_isset(swap_map, slot));
+    KASSERT(swap_refs[slot] > 0);
+  swap_refs[slot]--;
+  refs = swap_refs[slot];
+  spinlock_release(&swap_lock);
+
+  if (refs == 0) {
+    // Nobody can share it now, and while it is still marked nobody can
+    // allocate it and pool something else under the same slot
+    zswap_drop(slot);
+    spinlock_acquire(&swap_lock);
+    bitmap_unmark(swap_map, slot);
+    spinlock_release(&swap_lock);
+  }
+}
+
+/**
+ * pages a frame out to a slot, into the compressed cache if it will go
+ * @param  slot  slot number
+ * @param  paddr frame to write
+ * @return       0 on success, error code otherwise
+ */
+int swap_write(unsigned slot, paddr_t paddr) {
+  if (zswap_store(slot, paddr) == 0) {
+    return 0; // Success
+  }
+  return swap_writeout(slot, paddr);
+}
+
+/**
+ * writes a frame to a slot on disk, bypassing the compressed cache
+ * @param  slot  slot number
+ * @param  paddr frame to write
+ * @return       0 on success, error code otherwise
+ */
+int swap_writeout(unsigned slot, paddr_t paddr) {
+  int result;
+
+  result = swap_io(slot, paddr, UIO_WRITE);
+  if (!result) {
+    vmstats_inc(VMSTAT_SWAP_FILE_WRITE);
+  }
+  return result;
+}
+
+/**
+ * reads a slot back into a frame, from the compressed cache if it is there
+ * @param  slot  slot number
+ * @param  paddr frame to fill
+ * @param  disk  destination for whether it came from disk
+ * @return       0 on success, error code otherwise
+ */
+int swap_read(unsigned slot, paddr_t paddr, bool *disk) {
+  int result;
+
+  *disk = false;
+  result = zswap_load(slot, paddr);
+  if (result != ENOENT) {
+    return result;
+  }
+
+  *disk = true;
+  result = swap_io(slot, paddr, UIO_READ);
+  if (!result) {
+    vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+    vmstats_inc(VMSTAT_SWAP_FILE_READ);
+  }
+  return result;
+}
+
+/**
+ * transfers one page between a frame and a slot
+ * @param  slot  slot number
+ * @param  paddr frame
+ * @param  rw    UIO_READ or UIO_WRITE
+ * @return       0 on success, error code otherwise
+ */
+static int swap_io(unsigned slot, paddr_t paddr, enum uio_rw rw) {
+  struct iovec iov;
+  struct uio u;
+  int result;
+
+    KASSERT(swap_vnode != NULL);
+    KASSERT(slot < swap_nslots);
+
+  uio_kinit(&iov, &u, (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE,
+            (off_t)slot * PAGE_SIZE, rw);
+  result = (rw == UIO_READ) ? VOP_READ(swap_vnode, &u)
+                            : VOP_WRITE(swap_vnode, &u);
+  if (result) {
+    return result;
+  }
+  if (u.uio_resid != 0) {
+    return EIO;
+  }
+  return 0; // Success
+}
@@ -15,9 +15,32 @@
 #include <synch.h>
 #include <spl.h>
 #include <uw-vmstats.h>
+#include "opt-A3.h"
 
+#if OPT_A3
+#include <cpu.h>
+#include <current.h>
+#include <platform/maxcpus.h>
+#include <vm.h>
+
+/* Counters for tracking statistics, one row per CPU so that counting
+ * takes no lock. Rows are summed when the stats are printed.
+ */
+static unsigned int stats_counts[MAXCPUS][VMSTAT_COUNT];
+
+/* Fault latency histograms and total cycles, also per CPU */
+static unsigned int hist_counts[MAXCPUS][VMHIST_COUNT][VMHIST_NBUCKETS];
+static uint64_t hist_cycles[MAXCPUS][VMHIST_COUNT];
+
+static const char *hist_names[] = {
+ /* 0 */ "Reload",
+ /* 1 */ "Zeroed",
+ /* 2 */ "Disk",
+};
+#else
 /* Counters for tracking statistics */
 static unsigned int stats_counts[VMSTAT_COUNT];
+#endif
 
 struct spinlock stats_lock = SPINLOCK_INITIALIZER;
 
@@ -33,6 +56,25 @@ static const char *stats_names[] = {
  /*  7 */ "Page Faults from ELF",
  /*  8 */ "Page Faults from Swapfile",
  /*  9 */ "Swapfile Writes",
+ /* 10 */ "TLB Flushes Avoided",
+ /* 11 */ "Zero Pool Hits",
+ /* 12 */ "Zero Pool Misses",
+ /* 13 */ "TLB Shootdowns Sent",
+ /* 14 */ "TLB Shootdown Invalidations",
+ /* 15 */ "Fault-Around Preloads",
+ /* 16 */ "Fault-Around Preloads Used",
+ /* 17 */ "Pages Prefetched",
+ /* 18 */ "Pages Scanned for Merging",
+ /* 19 */ "Pages Merged",
+ /* 20 */ "Merged Pages Split on Write",
+ /* 21 */ "Compressed Swap Stores",
+ /* 22 */ "Compressed Swap Bytes",
+ /* 23 */ "Compressed Swap Hits",
+ /* 24 */ "Compressed Swap Spills",
+ /* 25 */ "Compressed Swap Rejects",
+ /* 26 */ "Pages Reclaimed at RSS Limit",
+ /* 27 */ "Faults over RSS Limit",
+ /* 28 */ "File Pages Unmapped to Reclaim",
 };
 
 
@@ -41,9 +83,18 @@ static const char *stats_names[] = {
 void
 vmstats_inc(unsigned int index)
 {
+#if OPT_A3
+    int spl;
+
+    /* Only this CPU writes its row; just don't get moved off it midway */
+    spl = splhigh();
+      _vmstats_inc(index);
+    splx(spl);
+#else
     spinlock_acquire(&stats_lock);
       _vmstats_inc(index);
     spinlock_release(&stats_lock);
+#endif
 }
 
 /* ---------------------------------------------------------------------- */
@@ -65,14 +116,20 @@ void
 _vmstats_inc(unsigned int index)
 {
   KASSERT(index < VMSTAT_COUNT);
+#if OPT_A3
+  stats_counts[curcpu->c_number][index]++;
+#else
   stats_counts[index]++;
+#endif
 }
 
 /* ---------------------------------------------------------------------- */
 void
 _vmstats_init(void)
 {
+#if !OPT_A3
   int i = 0;
+#endif
 
   if (sizeof(stats_names) / sizeof(char *) != VMSTAT_COUNT) {
     kprintf("vmstats_init: number of stats_names = %d != VMSTAT_COUNT = %d\n",
@@ -80,17 +137,138 @@ _vmstats_init(void)
     panic("Should really fix this before proceeding\n");
   }
 
+#if OPT_A3
+  bzero(stats_counts, sizeof(stats_counts));
+  bzero(hist_counts, sizeof(hist_counts));
+  bzero(hist_cycles, sizeof(hist_cycles));
+#else
   for (i=0; i<VMSTAT_COUNT; i++) {
     stats_counts[i] = 0;
   }
+#endif
 
 }
 
+#if OPT_A3
+/* ---------------------------------------------------------------------- */
+/* Zero every counter and histogram. Unlike vmstats_init this leaves
+ * stats_lock alone, so it is safe while other CPUs are counting; their
+ * increments racing with it may be lost.
+ */
+void
+vmstats_reset(void)
+{
+  _vmstats_init();
+}
+
+/* ---------------------------------------------------------------------- */
+/* Add n to the given count, which vmstats_inc would take n calls to do */
+void
+vmstats_add(unsigned int index, unsigned int n)
+{
+  int spl;
+
+  KASSERT(index < VMSTAT_COUNT);
+
+  spl = splhigh();
+  stats_counts[curcpu->c_number][index] += n;
+  splx(spl);
+}
+
+/* ---------------------------------------------------------------------- */
+/* Record that a fault of the given kind took the given number of cycles.
+ * Bucket 0 holds faults under 1024 cycles and each later bucket twice the
+ * range of the one before; the last one also holds everything longer.
+ */
+void
+vmstats_time(unsigned int kind, uint32_t cycles)
+{
+  unsigned int bucket = 0;
+  uint32_t c;
+  int spl;
+
+  KASSERT(kind < VMHIST_COUNT);
+
+  for (c = cycles >> 10; c != 0 && bucket < VMHIST_NBUCKETS - 1; c >>= 1) {
+    bucket++;
+  }
+
+  spl = splhigh();
+  hist_counts[curcpu->c_number][kind][bucket]++;
+  hist_cycles[curcpu->c_number][kind] += cycles;
+  splx(spl);
+}
+
+/* ---------------------------------------------------------------------- */
+/* Print the fault latency histograms, summed over all CPUs. Like
+ * vmstats_print this takes no lock, so counts still changing on other
+ * CPUs may be off by a little.
+ */
+void
+vmstats_printhist(void)
+{
+  unsigned int counts[VMHIST_COUNT][VMHIST_NBUCKETS];
+  uint64_t cycles[VMHIST_COUNT];
+  unsigned int total[VMHIST_COUNT];
+  unsigned int i, j, k;
+
+  bzero(counts, sizeof(counts));
+  bzero(cycles, sizeof(cycles));
+  bzero(total, sizeof(total));
+  for (i=0; i<MAXCPUS; i++) {
+    for (j=0; j<VMHIST_COUNT; j++) {
+      for (k=0; k<VMHIST_NBUCKETS; k++) {
+        counts[j][k] += hist_counts[i][j][k];
+        total[j] += hist_counts[i][j][k];
+      }
+      cycles[j] += hist_cycles[i][j];
+    }
+  }
+
+  kprintf("VMHIST %12s %10s %10s %10s\n", "cycles >=",
+    hist_names[VMHIST_RELOAD], hist_names[VMHIST_ZERO], hist_names[VMHIST_DISK]);
+  for (k=0; k<VMHIST_NBUCKETS; k++) {
+    kprintf("VMHIST %12u %10u %10u %10u\n", k == 0 ? 0 : 512U << k,
+      counts[VMHIST_RELOAD][k], counts[VMHIST_ZERO][k], counts[VMHIST_DISK][k]);
+  }
+  for (j=0; j<VMHIST_COUNT; j++) {
+    kprintf("VMHIST %-6s faults = %10u, mean cycles = %10u\n", hist_names[j],
+      total[j], total[j] == 0 ? 0 : (unsigned int)(cycles[j] / total[j]));
+  }
+}
+#endif
+
+/* ---------------------------------------------------------------------- */
+/* Add up the per-CPU rows */
+static
+void
+vmstats_sum(unsigned int *counts)
+{
+  int i = 0;
+
+#if OPT_A3
+  unsigned int cpu;
+
+  for (i=0; i<VMSTAT_COUNT; i++) {
+    counts[i] = 0;
+    for (cpu=0; cpu<MAXCPUS; cpu++) {
+      counts[i] += stats_counts[cpu][i];
+    }
+  }
+#else
+  for (i=0; i<VMSTAT_COUNT; i++) {
+    counts[i] = stats_counts[i];
+  }
+#endif
+}
+
 /* ---------------------------------------------------------------------- */
 /* Assumes vmstat_init has already been called */
 /* NOTE: We do not grab the spinlock here because kprintf may block
  * and we can't block while holding a spinlock.
  * Just use this when there is only one thread remaining.
+ * (With per-CPU counters it is also safe at other times, but counts
+ * still changing on other CPUs may be off by a little.)
  */
 
 void
@@ -102,18 +280,27 @@ vmstats_print(void)
   int tlb_faults = 0;
   int elf_plus_swap_reads = 0;
   int disk_reads = 0;
+  int prefetched = 0;
+  unsigned int counts[VMSTAT_COUNT];
+#if OPT_A3
+  uint64_t ratio;
+#endif
+
+  vmstats_sum(counts);
 
   kprintf("VMSTATS:\n");
   for (i=0; i<VMSTAT_COUNT; i++) {
-    kprintf("VMSTAT %25s = %10d\n", stats_names[i], stats_counts[i]);
+    kprintf("VMSTAT %25s = %10d\n", stats_names[i], counts[i]);
   }
 
-  tlb_faults = stats_counts[VMSTAT_TLB_FAULT];
-  free_plus_replace = stats_counts[VMSTAT_TLB_FAULT_FREE] + stats_counts[VMSTAT_TLB_FAULT_REPLACE];
-  disk_plus_zeroed_plus_reload = stats_counts[VMSTAT_PAGE_FAULT_DISK] +
-    stats_counts[VMSTAT_PAGE_FAULT_ZERO] + stats_counts[VMSTAT_TLB_RELOAD];
-  elf_plus_swap_reads = stats_counts[VMSTAT_ELF_FILE_READ] + stats_counts[VMSTAT_SWAP_FILE_READ];
-  disk_reads = stats_counts[VMSTAT_PAGE_FAULT_DISK];
+  tlb_faults = counts[VMSTAT_TLB_FAULT];
+  free_plus_replace = counts[VMSTAT_TLB_FAULT_FREE] + counts[VMSTAT_TLB_FAULT_REPLACE];
+  disk_plus_zeroed_plus_reload = counts[VMSTAT_PAGE_FAULT_DISK] +
+    counts[VMSTAT_PAGE_FAULT_ZERO] + counts[VMSTAT_TLB_RELOAD];
+  elf_plus_swap_reads = counts[VMSTAT_ELF_FILE_READ] + counts[VMSTAT_SWAP_FILE_READ];
+  disk_reads = counts[VMSTAT_PAGE_FAULT_DISK];
+  /* madvise(MADV_WILLNEED) pages things in without any TLB fault */
+  prefetched = counts[VMSTAT_PAGE_PREFETCH];
 
   kprintf("VMSTAT TLB Faults with Free + TLB Faults with Replace = %d\n", free_plus_replace);
   if (tlb_faults != free_plus_replace) {
@@ -123,9 +310,9 @@ vmstats_print(void)
 
   kprintf("VMSTAT TLB Reloads + Page Faults (Zeroed) + Page Faults (Disk) = %d\n",
     disk_plus_zeroed_plus_reload);
-  if (tlb_faults != disk_plus_zeroed_plus_reload) {
-    kprintf("WARNING: TLB Faults (%d) != TLB Reloads + Page Faults (Zeroed) + Page Faults (Disk) (%d)\n",
-      tlb_faults, disk_plus_zeroed_plus_reload); 
+  if (tlb_faults + prefetched != disk_plus_zeroed_plus_reload) {
+    kprintf("WARNING: TLB Faults (%d) + Pages Prefetched (%d) != TLB Reloads + Page Faults (Zeroed) + Page Faults (Disk) (%d)\n",
+      tlb_faults, prefetched, disk_plus_zeroed_plus_reload); 
   }
 
   kprintf("VMSTAT ELF File reads + Swapfile reads = %d\n", elf_plus_swap_reads);
@@ -133,5 +320,15 @@ vmstats_print(void)
     kprintf("WARNING: ELF File reads + Swapfile reads != Page Faults (Disk) %d\n",
       elf_plus_swap_reads);
   }
+
+#if OPT_A3
+  /* In hundredths, as uncompressed size over compressed */
+  if (counts[VMSTAT_ZSWAP_BYTES] > 0) {
+    ratio = (uint64_t)counts[VMSTAT_ZSWAP_STORE] * PAGE_SIZE * 100 /
+      counts[VMSTAT_ZSWAP_BYTES];
+    kprintf("VMSTAT Compressed Swap ratio = %u.%02u : 1\n",
+      (unsigned int)(ratio / 100), (unsigned int)(ratio % 100));
+  }
+#endif
 }
 /* ---------------------------------------------------------------------- */
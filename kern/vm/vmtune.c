@@ -0,0 +1,73 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <vmtune.h>
+
+int vm_tlbpolicy = TLBPOLICY_RR;
+int vm_zeropool = 64;
+int vm_stackmax = 1024;
+int vm_stackguard = 4;
+int vm_faultaround = 4;
+int vm_mergerate = 0;
+int vm_zswap = 32;
+
+static struct {
+  const char *name;
+  int *value;
+  int min;
+  int max;
+  const char *desc;
+} vmtunables[] = {
+  { "tlbpolicy", &vm_tlbpolicy, TLBPOLICY_RR, TLBPOLICY_NRU,
+    "TLB replacement (0 round-robin, 1 not-recently-used)" },
+  { "zeropool", &vm_zeropool, 0, 4096,
+    "free pages idle CPUs keep zeroed (0 off)" },
+  { "stackmax", &vm_stackmax, 1, 16384,
+    "user stack limit in pages, for new processes" },
+  { "stackguard", &vm_stackguard, 0, 1024,
+    "unmapped pages kept between the stack and other regions" },
+  { "faultaround", &vm_faultaround, 0, 16,
+    "resident pages preloaded into the TLB on a sequential miss (0 off)" },
+  { "mergerate", &vm_mergerate, 0, 65536,
+    "pages scanned per second for identical ones to merge (0 off)" },
+  { "zswap", &vm_zswap, 0, 1024,
+    "pages of memory for compressed swapped out pages (0 off)" },
+  { NULL, NULL, 0, 0, NULL }
+};
+
+/**
+ * changes a tunable
+ * @param  name  tunable name
+ * @param  value new value
+ * @return       0 on success, ENOENT for an unknown name, EINVAL if value is
+ *               out of range
+ */
+int vmtune_set(const char *name, int value) {
+  int i;
+
+  for (i = 0; vmtunables[i].name != NULL; i++) {
+    if (strcmp(vmtunables[i].name, name) != 0) {
+      continue;
+    }
+    if (value < vmtunables[i].min || value > vmtunables[i].max) {
+      return EINVAL;
+    }
+    // Readers don't lock; an aligned int store is atomic
+    *vmtunables[i].value = value;
+    return 0; // Success
+  }
+  return ENOENT;
+}
+
+/**
+ * prints every tunable with its current value and range
+ */
+void vmtune_print(void) {
+  int i;
+
+  for (i = 0; vmtunables[i].name != NULL; i++) {
+    kprintf("%-12s %6d  [%d..%d] %s\n", vmtunables[i].name,
+            *vmtunables[i].value, vmtunables[i].min, vmtunables[i].max,
+            vmtunables[i].desc);
+  }
+}
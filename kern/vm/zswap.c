@@ -0,0 +1,463 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <vm.h>
+#include <swap.h>
+#include <zswap.h>
+#include <vmtune.h>
+#include <uw-vmstats.h>
+
+// Longer isn't worth keeping in memory; kmalloc takes a whole page for
+// PAGE_SIZE / 2 itself
+#define ZS_MAXLEN   (PAGE_SIZE / 2 - 1)
+#define ZS_MINMATCH 4
+#define ZS_HASHBITS 12
+
+struct zspage {
+  unsigned zp_slot;
+  size_t zp_len;
+  uint8_t *zp_data;
+  struct zspage *zp_newer; // LRU list links
+  struct zspage *zp_older;
+};
+
+static struct zspage **zs_slots;  // by slot, NULL if not in the pool
+static unsigned zs_nslots;
+static struct zspage *zs_newest;
+static struct zspage *zs_oldest;
+static size_t zs_bytes;           // compressed bytes in the pool
+static paddr_t zs_scratch;        // frame spills are decompressed into
+static struct lock *zs_lock;
+
+// Compressor state, used under zs_lock
+static uint16_t zs_table[1 << ZS_HASHBITS]; // position + 1 of a recent
+                                            // 4 bytes with each hash
+static uint8_t zs_buf[ZS_MAXLEN];
+
+// Helper functions
+static int zs_spill(void);
+static void zs_link(struct zspage *zp);
+static void zs_unlink(struct zspage *zp);
+static size_t zs_compress(const uint8_t *in, uint8_t *out, size_t cap);
+static int zs_decompress(const uint8_t *in, size_t len, uint8_t *out);
+static bool zs_putseq(uint8_t *out, size_t *op, size_t cap,
+                      const uint8_t *lit, size_t nlit, size_t off,
+                      size_t mlen);
+static bool zs_putlen(uint8_t *out, size_t *op, size_t cap, size_t n);
+static bool zs_getlen(const uint8_t *in, size_t len, size_t *ip, size_t *n);
+static uint32_t zs_read32(const uint8_t *p);
+
+/**
+ * sets up an empty pool; must be called once, by swap_bootstrap
+ * @param  nslots number of swap slots
+ * @return        0 on success, ENOMEM otherwise
+ */
+int zswap_bootstrap(unsigned nslots) {
+  vaddr_t scratch;
+  unsigned i;
+
+  zs_lock = lock_create("zswap");
+  if (zs_lock == NULL) {
+    return ENOMEM;
+  }
+  scratch = alloc_kpages(1);
+  if (scratch == 0) {
+    lock_destroy(zs_lock);
+    return ENOMEM;
+  }
+  zs_slots = kmalloc(nslots * sizeof(struct zspage *));
+  if (zs_slots == NULL) {
+    free_kpages(scratch);
+    lock_destroy(zs_lock);
+    return ENOMEM;
+  }
+  for (i = 0; i < nslots; i++) {
+    zs_slots[i] = NULL;
+  }
+  zs_nslots = nslots;
+  zs_newest = NULL;
+  zs_oldest = NULL;
+  zs_bytes = 0;
+  zs_scratch = KVADDR_TO_PADDR(scratch);
+  return 0; // Success
+}
+
+/**
+ * compresses a frame into the pool, spilling older pages to disk to make
+ * room if need be
+ * @param  slot  swap slot the page was given, which must not be pooled
+ * @param  paddr frame to store
+ * @return       0 on success; ENOSPC if the pool is off, EFBIG if the page
+ *               doesn't compress well, ENOMEM, or the error from a spill.
+ *               On failure the caller writes the page to disk itself
+ */
+int zswap_store(unsigned slot, paddr_t paddr) {
+  struct zspage *zp;
+  size_t len;
+  int result;
+
+  if (zs_slots == NULL || vm_zswap == 0) {
+    return ENOSPC;
+  }
+    KASSERT(slot < zs_nslots);
+
+  lock_acquire(zs_lock);
+    KASSERT(zs_slots[slot] == NULL);
+
+  len = zs_compress((const uint8_t *)PADDR_TO_KVADDR(paddr), zs_buf,
+                    ZS_MAXLEN);
+  if (len == 0) {
+    lock_release(zs_lock);
+    vmstats_inc(VMSTAT_ZSWAP_REJECT);
+    return EFBIG;
+  }
+
+  // Least recently used first
+  while (zs_bytes + len > (size_t)vm_zswap * PAGE_SIZE && zs_oldest != NULL) {
+    result = zs_spill();
+    if (result) {
+      lock_release(zs_lock);
+      return result;
+    }
+  }
+
+  zp = kmalloc(sizeof(struct zspage));
+  if (zp == NULL) {
+    lock_release(zs_lock);
+    return ENOMEM;
+  }
+  zp->zp_data = kmalloc(len);
+  if (zp->zp_data == NULL) {
+    kfree(zp);
+    lock_release(zs_lock);
+    return ENOMEM;
+  }
+  memcpy(zp->zp_data, zs_buf, len);
+  zp->zp_len = len;
+  zp->zp_slot = slot;
+  zs_link(zp);
+  zs_slots[slot] = zp;
+  zs_bytes += len;
+
+  lock_release(zs_lock);
+  vmstats_inc(VMSTAT_ZSWAP_STORE);
+  vmstats_add(VMSTAT_ZSWAP_BYTES, len);
+  return 0; // Success
+}
+
+/**
+ * decompresses a pooled page into a frame; the page stays pooled, as the
+ * slot may still be shared, until zswap_drop
+ * @param  slot  swap slot
+ * @param  paddr frame to fill
+ * @return       0 on success, ENOENT if the slot isn't pooled (it is on
+ *               disk), EIO if its data is corrupt
+ */
+int zswap_load(unsigned slot, paddr_t paddr) {
+  struct zspage *zp;
+  int result;
+
+  if (zs_slots == NULL) {
+    return ENOENT;
+  }
+    KASSERT(slot < zs_nslots);
+
+  lock_acquire(zs_lock);
+  zp = zs_slots[slot];
+  if (zp == NULL) {
+    lock_release(zs_lock);
+    return ENOENT;
+  }
+  result = zs_decompress(zp->zp_data, zp->zp_len,
+                         (uint8_t *)PADDR_TO_KVADDR(paddr));
+  if (result) {
+    lock_release(zs_lock);
+    return result;
+  }
+  zs_unlink(zp);
+  zs_link(zp);
+  lock_release(zs_lock);
+
+  vmstats_inc(VMSTAT_ZSWAP_HIT);
+  return 0; // Success
+}
+
+/**
+ * forgets a slot's pooled page, if it has one, once the slot is freed
+ * @param slot swap slot
+ */
+void zswap_drop(unsigned slot) {
+  struct zspage *zp;
+
+  if (zs_slots == NULL) {
+    return;
+  }
+    KASSERT(slot < zs_nslots);
+
+  lock_acquire(zs_lock);
+  zp = zs_slots[slot];
+  if (zp != NULL) {
+    zs_slots[slot] = NULL;
+    zs_unlink(zp);
+    zs_bytes -= zp->zp_len;
+    kfree(zp->zp_data);
+    kfree(zp);
+  }
+  lock_release(zs_lock);
+}
+
+/**
+ * writes the least recently used page out to its slot and takes it out of
+ * the pool; the caller holds zs_lock
+ * @return 0 on success, or the error from decompressing or writing it
+ */
+static int zs_spill(void) {
+  struct zspage *zp = zs_oldest;
+  int result;
+
+    KASSERT(lock_do_i_hold(zs_lock));
+    KASSERT(zp != NULL);
+
+  result = zs_decompress(zp->zp_data, zp->zp_len,
+                         (uint8_t *)PADDR_TO_KVADDR(zs_scratch));
+  if (result) {
+    return result;
+  }
+  result = swap_writeout(zp->zp_slot, zs_scratch);
+  if (result) {
+    return result;
+  }
+  vmstats_inc(VMSTAT_ZSWAP_SPILL);
+
+  zs_slots[zp->zp_slot] = NULL;
+  zs_unlink(zp);
+  zs_bytes -= zp->zp_len;
+  kfree(zp->zp_data);
+  kfree(zp);
+  return 0; // Success
+}
+
+/**
+ * puts a page at the newest end of the LRU list
+ * @param zp page
+ */
+static void zs_link(struct zspage *zp) {
+  zp->zp_newer = NULL;
+  zp->zp_older = zs_newest;
+  if (zs_newest != NULL) {
+    zs_newest->zp_newer = zp;
+  }
+  else {
+    zs_oldest = zp;
+  }
+  zs_newest = zp;
+}
+
+/**
+ * takes a page off the LRU list
+ * @param zp page
+ */
+static void zs_unlink(struct zspage *zp) {
+  if (zp->zp_newer != NULL) {
+    zp->zp_newer->zp_older = zp->zp_older;
+  }
+  else {
+    zs_newest = zp->zp_older;
+  }
+  if (zp->zp_older != NULL) {
+    zp->zp_older->zp_newer = zp->zp_newer;
+  }
+  else {
+    zs_oldest = zp->zp_newer;
+  }
+}
+
+/**
+ * compresses a page; the caller holds zs_lock
+ * @param  in  page to compress
+ * @param  out destination
+ * @param  cap size of out
+ * @return     compressed length, 0 if it doesn't fit in cap
+ */
+static size_t zs_compress(const uint8_t *in, uint8_t *out, size_t cap) {
+  size_t ip = 0, anchor = 0, op = 0, ref, len;
+  uint32_t h;
+
+    KASSERT(lock_do_i_hold(zs_lock));
+
+  bzero(zs_table, sizeof(zs_table));
+  while (ip + ZS_MINMATCH <= PAGE_SIZE) {
+    // Knuth's multiplicative hash of the next 4 bytes
+    h = (zs_read32(in + ip) * 2654435761U) >> (32 - ZS_HASHBITS);
+    ref = zs_table[h];
+    zs_table[h] = ip + 1;
+    if (ref == 0 || zs_read32(in + ref - 1) != zs_read32(in + ip)) {
+      ip++;
+      continue;
+    }
+    ref--;
+
+    // May run on into the bytes being matched; that decodes fine
+    len = ZS_MINMATCH;
+    while (ip + len < PAGE_SIZE && in[ref + len] == in[ip + len]) {
+      len++;
+    }
+    if (!zs_putseq(out, &op, cap, in + anchor, ip - anchor, ip - ref, len)) {
+      return 0;
+    }
+    ip += len;
+    anchor = ip;
+  }
+
+  if (!zs_putseq(out, &op, cap, in + anchor, PAGE_SIZE - anchor, 0, 0)) {
+    return 0;
+  }
+  return op;
+}
+
+/**
+ * decompresses a page
+ * @param  in  compressed data
+ * @param  len its length
+ * @param  out page to fill
+ * @return     0 on success, EIO if the data doesn't make exactly a page
+ */
+static int zs_decompress(const uint8_t *in, size_t len, uint8_t *out) {
+  size_t ip = 0, op = 0, nlit, off, mlen;
+  uint8_t token;
+
+  while (ip < len) {
+    token = in[ip++];
+
+    nlit = token >> 4;
+    if (nlit == 15 && !zs_getlen(in, len, &ip, &nlit)) {
+      return EIO;
+    }
+    if (ip + nlit > len || op + nlit > PAGE_SIZE) {
+      return EIO;
+    }
+    memcpy(out + op, in + ip, nlit);
+    ip += nlit;
+    op += nlit;
+    if (ip == len) {
+      // The last sequence has no match
+      break;
+    }
+
+    if (ip + 2 > len) {
+      return EIO;
+    }
+    off = in[ip] | (in[ip + 1] << 8);
+    ip += 2;
+    mlen = token & 15;
+    if (mlen == 15 && !zs_getlen(in, len, &ip, &mlen)) {
+      return EIO;
+    }
+    mlen += ZS_MINMATCH;
+    if (off == 0 || off > op || op + mlen > PAGE_SIZE) {
+      return EIO;
+    }
+    // A byte at a time, as the match may overlap what it produces
+    for (; mlen > 0; mlen--, op++) {
+      out[op] = out[op - off];
+    }
+  }
+  return (op == PAGE_SIZE) ? 0 : EIO;
+}
+
+/**
+ * appends a sequence to compressed output
+ * @param  out  destination
+ * @param  op   length of out so far, updated
+ * @param  cap  size of out
+ * @param  lit  literals
+ * @param  nlit number of literals
+ * @param  off  how far back the match starts
+ * @param  mlen length of the match, 0 for the last sequence
+ * @return      false if out is full
+ */
+static bool zs_putseq(uint8_t *out, size_t *op, size_t cap,
+                      const uint8_t *lit, size_t nlit, size_t off,
+                      size_t mlen) {
+  size_t mcode = (mlen == 0) ? 0 : mlen - ZS_MINMATCH;
+
+  if (*op >= cap) {
+    return false;
+  }
+  out[(*op)++] = ((nlit < 15 ? nlit : 15) << 4) | (mcode < 15 ? mcode : 15);
+  if (nlit >= 15 && !zs_putlen(out, op, cap, nlit - 15)) {
+    return false;
+  }
+  if (*op + nlit > cap) {
+    return false;
+  }
+  memcpy(out + *op, lit, nlit);
+  *op += nlit;
+  if (mlen == 0) {
+    return true;
+  }
+
+  if (*op + 2 > cap) {
+    return false;
+  }
+  out[(*op)++] = off & 0xff;
+  out[(*op)++] = off >> 8;
+  if (mcode >= 15 && !zs_putlen(out, op, cap, mcode - 15)) {
+    return false;
+  }
+  return true;
+}
+
+/**
+ * appends the rest of a length that didn't fit in the token: 255 while
+ * at least that much is left, then the remainder
+ * @param  out destination
+ * @param  op  length of out so far, updated
+ * @param  cap size of out
+ * @param  n   what is left of the length
+ * @return     false if out is full
+ */
+static bool zs_putlen(uint8_t *out, size_t *op, size_t cap, size_t n) {
+  for (;;) {
+    if (*op >= cap) {
+      return false;
+    }
+    if (n < 255) {
+      out[(*op)++] = n;
+      return true;
+    }
+    out[(*op)++] = 255;
+    n -= 255;
+  }
+}
+
+/**
+ * reads the rest of a length written by zs_putlen
+ * @param  in  compressed data
+ * @param  len its length
+ * @param  ip  position in it, updated
+ * @param  n   length so far, added to
+ * @return     false if the data ends first
+ */
+static bool zs_getlen(const uint8_t *in, size_t len, size_t *ip, size_t *n) {
+  uint8_t b;
+
+  do {
+    if (*ip >= len) {
+      return false;
+    }
+    b = in[(*ip)++];
+    *n += b;
+  } while (b == 255);
+  return true;
+}
+
+/**
+ * reads 4 bytes without assuming they are aligned
+ * @param  p first byte
+ * @return   the bytes, little-endian
+ */
+static uint32_t zs_read32(const uint8_t *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
@@ -37,6 +37,7 @@
 
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <assert.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -132,6 +133,35 @@ printstatus(int status)
 	}
 }
 
+/*
+ * printusage
+ * print what a command used, from getrusage(RUSAGE_CHILDREN) before
+ * and after it. The peak RSS is the largest of any child so far, as
+ * peaks of different children don't subtract.
+ */
+static
+void
+printusage(const struct rusage *before, const struct rusage *after)
+{
+	unsigned long umsecs, smsecs;
+
+	umsecs = (after->ru_utime.tv_sec - before->ru_utime.tv_sec) * 1000 +
+		(after->ru_utime.tv_usec - before->ru_utime.tv_usec) / 1000;
+	smsecs = (after->ru_stime.tv_sec - before->ru_stime.tv_sec) * 1000 +
+		(after->ru_stime.tv_usec - before->ru_stime.tv_usec) / 1000;
+
+	warnx("subprocess usage: %lu.%03lu user, %lu.%03lu system seconds, "
+	      "%lu KB peak RSS",
+	      umsecs / 1000, umsecs % 1000, smsecs / 1000, smsecs % 1000,
+	      (unsigned long) after->ru_maxrss);
+	warnx("subprocess faults: %lu minor, %lu major; "
+	      "switches: %lu voluntary, %lu involuntary",
+	      (unsigned long) (after->ru_minflt - before->ru_minflt),
+	      (unsigned long) (after->ru_majflt - before->ru_majflt),
+	      (unsigned long) (after->ru_nvcsw - before->ru_nvcsw),
+	      (unsigned long) (after->ru_nivcsw - before->ru_nivcsw));
+}
+
 /*
  * dowait
  * just does a waitpid.
@@ -311,6 +341,8 @@ docommand(char *buf)
 	int bg=0;
 	time_t startsecs, endsecs;
 	unsigned long startnsecs, endnsecs;
+	struct rusage startru, endru;
+	int haveru = 0;
 
 	nargs = 0;
 	for (s = strtok(buf, " \t\r\n"); s; s = strtok(NULL, " \t\r\n")) {
@@ -352,6 +384,7 @@ docommand(char *buf)
 
 	if (timing) {
 		__time(&startsecs, &startnsecs);
+		haveru = (getrusage(RUSAGE_CHILDREN, &startru) == 0);
 	}
 
 	pid = fork();
@@ -399,6 +432,9 @@ docommand(char *buf)
 		endsecs -= startsecs;
 		warnx("subprocess time: %lu.%09lu seconds",
 		      (unsigned long) endsecs, (unsigned long) endnsecs);
+		if (haveru && getrusage(RUSAGE_CHILDREN, &endru) == 0) {
+			printusage(&startru, &endru);
+		}
 	}
 
 	return status;
@@ -44,6 +44,8 @@
 #include <kern/time.h>
 #include <kern/unistd.h>
 #include <kern/wait.h>
+#include <kern/mman.h>
+#include <kern/resource.h>
 
 
 /*
@@ -147,6 +149,13 @@ int chdir(const char *path);
 
 /* Optional. */
 void *sbrk(int change);
+void *mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset);
+int munmap(void *addr, size_t len);
+int madvise(void *addr, size_t len, int advice);
+int mincore(void *addr, size_t len, unsigned char *vec);
+int getrusage(int who, struct rusage *usage);
+int getrlimit(int resource, struct rlimit *rlp);
+int setrlimit(int resource, const struct rlimit *rlp);
 int getdirentry(int filehandle, char *buf, size_t buflen);
 int symlink(const char *target, const char *linkname);
 int readlink(const char *path, char *buf, size_t buflen);